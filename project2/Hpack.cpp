@@ -0,0 +1,363 @@
+#include <cstring>
+
+#include "Hpack.hpp"
+
+using std::string;
+using std::vector;
+
+/*
+ * The HPACK static table (RFC 7541 Appendix A). Index 1 is the first entry so
+ * we leave a blank entry at the front to keep indices lined up.
+ */
+static const HeaderField static_table[] = {
+	{"", ""},
+	{":authority", ""}, {":method", "GET"}, {":method", "POST"},
+	{":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+	{":scheme", "https"}, {":status", "200"}, {":status", "204"},
+	{":status", "206"}, {":status", "304"}, {":status", "400"},
+	{":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+	{"accept-ranges", ""}, {"accept", ""},
+	{"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+	{"authorization", ""}, {"cache-control", ""},
+	{"content-disposition", ""}, {"content-encoding", ""},
+	{"content-language", ""}, {"content-length", ""},
+	{"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+	{"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+	{"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+	{"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+	{"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+	{"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+	{"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+	{"refresh", ""}, {"retry-after", ""}, {"server", ""},
+	{"set-cookie", ""}, {"strict-transport-security", ""},
+	{"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+	{"via", ""}, {"www-authenticate", ""},
+};
+static const uint64_t STATIC_TABLE_LEN = 61;
+
+/*
+ * Huffman code for each symbol (RFC 7541 Appendix B), as {code, bit length}.
+ * Symbol 256 is EOS, which must never appear in a decoded string.
+ */
+static const struct { uint32_t code; uint8_t len; } huffman_codes[257] = {
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+	{0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+	{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+	{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+	{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+	{0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+	{0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+	{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+	{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+	{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+	{0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+	{0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+	{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+	{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+	{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+	{0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+	{0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+	{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+	{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+	{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+	{0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+	{0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+	{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+	{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+	{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+	{0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+	{0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+	{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+	{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+	{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+	{0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+	{0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+	{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+	{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+	{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+	{0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+	{0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+	{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+	{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+	{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+	{0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+	{0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+	{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+	{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+	{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+	{0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+	{0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+	{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+	{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+	{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+	{0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+	{0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+	{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+	{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+	{0x3fffffff, 30},
+};
+
+/*
+ * Binary tree used to decode Huffman strings one bit at a time. Leaves have
+ * a symbol >= 0, interior nodes have symbol -1.
+ */
+struct HuffmanNode {
+	int child[2];
+	int symbol;
+};
+
+/**
+ * Builds the Huffman decoding tree from the code table. This is only done
+ * once, the first time a Huffman string is decoded.
+ *
+ * @return The tree, with the root at index 0.
+ */
+static vector<HuffmanNode> build_huffman_tree() {
+	vector<HuffmanNode> tree;
+	tree.push_back({{-1, -1}, -1});
+
+	for (int sym = 0; sym < 257; sym++) {
+		int node = 0;
+		for (int bit = huffman_codes[sym].len - 1; bit >= 0; bit--) {
+			int b = (huffman_codes[sym].code >> bit) & 1;
+			if (tree[node].child[b] == -1) {
+				tree[node].child[b] = tree.size();
+				tree.push_back({{-1, -1}, -1});
+			}
+			node = tree[node].child[b];
+		}
+		tree[node].symbol = sym;
+	}
+	return tree;
+}
+
+string hpack_huffman_decode(const uint8_t *data, size_t length) {
+	static const vector<HuffmanNode> tree = build_huffman_tree();
+
+	string result;
+	int node = 0;
+	int bits_since_symbol = 0;
+	bool all_ones = true; // padding must be the most significant bits of EOS
+
+	for (size_t i = 0; i < length; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			int b = (data[i] >> bit) & 1;
+			node = tree[node].child[b];
+			if (node == -1) {
+				throw HpackError("invalid Huffman code");
+			}
+			bits_since_symbol++;
+			all_ones = all_ones && b == 1;
+
+			if (tree[node].symbol >= 0) {
+				if (tree[node].symbol == 256) {
+					throw HpackError("EOS in Huffman string");
+				}
+				result.push_back((char)tree[node].symbol);
+				node = 0;
+				bits_since_symbol = 0;
+				all_ones = true;
+			}
+		}
+	}
+
+	if (bits_since_symbol > 7 || !all_ones) {
+		throw HpackError("invalid Huffman padding");
+	}
+	return result;
+}
+
+/**
+ * Decodes an HPACK integer (RFC 7541 5.1) and advances pos past it.
+ *
+ * @param block The header block.
+ * @param length Length of the header block.
+ * @param pos Position of the first byte of the integer.
+ * @param prefix_bits Number of bits of the first byte used by the integer.
+ * @return The decoded integer.
+ */
+static uint64_t decode_int(const uint8_t *block, size_t length, size_t &pos,
+		int prefix_bits) {
+	if (pos >= length) {
+		throw HpackError("truncated integer");
+	}
+	uint64_t max_prefix = (1 << prefix_bits) - 1;
+	uint64_t value = block[pos++] & max_prefix;
+	if (value < max_prefix) {
+		return value;
+	}
+
+	int shift = 0;
+	while (true) {
+		if (pos >= length || shift > 56) {
+			throw HpackError("bad integer encoding");
+		}
+		uint8_t b = block[pos++];
+		value += (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if ((b & 0x80) == 0) {
+			return value;
+		}
+	}
+}
+
+/**
+ * Decodes an HPACK string literal (RFC 7541 5.2) and advances pos past it.
+ */
+static string decode_string(const uint8_t *block, size_t length, size_t &pos) {
+	if (pos >= length) {
+		throw HpackError("truncated string");
+	}
+	bool huffman = (block[pos] & 0x80) != 0;
+	uint64_t str_len = decode_int(block, length, pos, 7);
+	if (str_len > length - pos) {
+		throw HpackError("string longer than header block");
+	}
+
+	string s;
+	if (huffman) {
+		s = hpack_huffman_decode(block + pos, str_len);
+	}
+	else {
+		s.assign((const char *)block + pos, str_len);
+	}
+	pos += str_len;
+	return s;
+}
+
+void HpackDecoder::evict(size_t limit) {
+	while (table_size > limit && !dynamic_table.empty()) {
+		const HeaderField &oldest = dynamic_table.back();
+		table_size -= oldest.first.size() + oldest.second.size() + 32;
+		dynamic_table.pop_back();
+	}
+}
+
+void HpackDecoder::add_entry(const string &name, const string &value) {
+	size_t entry_size = name.size() + value.size() + 32;
+	if (entry_size > max_table_size) {
+		// An entry bigger than the table just empties it (RFC 7541 4.4).
+		evict(0);
+		return;
+	}
+	evict(max_table_size - entry_size);
+	dynamic_table.emplace_front(name, value);
+	table_size += entry_size;
+}
+
+const HeaderField &HpackDecoder::lookup(uint64_t index) const {
+	if (index == 0) {
+		throw HpackError("index 0 is not valid");
+	}
+	if (index <= STATIC_TABLE_LEN) {
+		return static_table[index];
+	}
+	uint64_t dyn_index = index - STATIC_TABLE_LEN - 1;
+	if (dyn_index >= dynamic_table.size()) {
+		throw HpackError("index past end of dynamic table");
+	}
+	return dynamic_table[dyn_index];
+}
+
+vector<HeaderField> HpackDecoder::decode(const uint8_t *block, size_t length) {
+	vector<HeaderField> fields;
+	size_t pos = 0;
+
+	while (pos < length) {
+		uint8_t b = block[pos];
+
+		if (b & 0x80) {
+			// Indexed header field
+			fields.push_back(lookup(decode_int(block, length, pos, 7)));
+		}
+		else if ((b & 0xe0) == 0x20) {
+			// Dynamic table size update
+			uint64_t new_size = decode_int(block, length, pos, 5);
+			if (new_size > 4096) {
+				throw HpackError("table size update above SETTINGS limit");
+			}
+			max_table_size = new_size;
+			evict(max_table_size);
+		}
+		else {
+			// Literal header field. With incremental indexing uses a 6 bit
+			// prefix, without indexing and never indexed use a 4 bit one.
+			bool index_it = (b & 0xc0) == 0x40;
+			uint64_t name_index = decode_int(block, length, pos,
+					index_it ? 6 : 4);
+
+			string name;
+			if (name_index == 0) {
+				name = decode_string(block, length, pos);
+			}
+			else {
+				name = lookup(name_index).first;
+			}
+			string value = decode_string(block, length, pos);
+
+			if (index_it) {
+				add_entry(name, value);
+			}
+			fields.emplace_back(name, value);
+		}
+	}
+
+	return fields;
+}
+
+void hpack_encode_int(string &out, uint64_t value, int prefix_bits,
+		uint8_t first_byte_flags) {
+	uint64_t max_prefix = (1 << prefix_bits) - 1;
+	if (value < max_prefix) {
+		out.push_back((char)(first_byte_flags | value));
+		return;
+	}
+
+	out.push_back((char)(first_byte_flags | max_prefix));
+	value -= max_prefix;
+	while (value >= 128) {
+		out.push_back((char)((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+void hpack_encode_field(string &out, const string &name, const string &value) {
+	// Use a fully indexed representation when the static table has an exact
+	// match (e.g. ":status: 200").
+	for (uint64_t i = 1; i <= STATIC_TABLE_LEN; i++) {
+		if (static_table[i].first == name && static_table[i].second == value
+				&& !value.empty()) {
+			hpack_encode_int(out, i, 7, 0x80);
+			return;
+		}
+	}
+
+	uint64_t name_index = 0;
+	for (uint64_t i = 1; i <= STATIC_TABLE_LEN; i++) {
+		if (static_table[i].first == name) {
+			name_index = i;
+			break;
+		}
+	}
+
+	// Literal header field without indexing (first four bits 0000)
+	hpack_encode_int(out, name_index, 4, 0x00);
+	if (name_index == 0) {
+		hpack_encode_int(out, name.size(), 7, 0x00);
+		out += name;
+	}
+	hpack_encode_int(out, value.size(), 7, 0x00);
+	out += value;
+}
@@ -0,0 +1,89 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * A single decoded header field (name and value).
+ */
+typedef std::pair<std::string, std::string> HeaderField;
+
+/**
+ * Thrown when a header block can't be decoded. HTTP/2 treats this as a
+ * connection error of type COMPRESSION_ERROR.
+ */
+class HpackError : public std::runtime_error {
+  public:
+	HpackError(const std::string &what) : std::runtime_error(what) {}
+};
+
+/**
+ * HPACK (RFC 7541) header block decoder.
+ *
+ * One decoder is kept per HTTP/2 connection since the dynamic table is
+ * shared by every header block the client sends on that connection.
+ */
+class HpackDecoder {
+  private:
+	std::deque<HeaderField> dynamic_table; // newest entry at the front
+	size_t table_size; // current size of the dynamic table (RFC 7541 4.1)
+	size_t max_table_size; // limit the peer is allowed to use
+
+	void add_entry(const std::string &name, const std::string &value);
+	void evict(size_t limit);
+	const HeaderField &lookup(uint64_t index) const;
+
+  public:
+	HpackDecoder() : table_size(0), max_table_size(4096) {}
+
+	/**
+	 * Decodes one complete header block (HEADERS plus any CONTINUATIONs).
+	 *
+	 * @param block Pointer to the start of the header block.
+	 * @param length Length of the header block in bytes.
+	 * @return The header fields, in the order they appeared.
+	 */
+	std::vector<HeaderField> decode(const uint8_t *block, size_t length);
+};
+
+/**
+ * Appends an HPACK integer with the given prefix size to out.
+ *
+ * @param out Where to write the encoded integer.
+ * @param value The integer to encode.
+ * @param prefix_bits Number of bits available in the first byte.
+ * @param first_byte_flags High bits to OR into the first byte.
+ */
+void hpack_encode_int(std::string &out, uint64_t value, int prefix_bits,
+		uint8_t first_byte_flags);
+
+/**
+ * Appends a header field as a "literal without indexing" representation,
+ * using a static table index for the name when there is one.
+ *
+ * Responses from torero-serve only use a handful of fields so skipping the
+ * dynamic table keeps the encoder stateless.
+ *
+ * @param out Where to write the encoded field.
+ * @param name Lowercase header name.
+ * @param value Header value.
+ */
+void hpack_encode_field(std::string &out, const std::string &name,
+		const std::string &value);
+
+/**
+ * Decodes a Huffman-encoded HPACK string literal.
+ *
+ * @param data Pointer to the encoded bytes.
+ * @param length Number of encoded bytes.
+ * @return The decoded string.
+ */
+std::string hpack_huffman_decode(const uint8_t *data, size_t length);
+
+#endif // HPACK_HPP
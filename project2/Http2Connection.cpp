@@ -0,0 +1,623 @@
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Http2Connection.hpp"
+
+using std::string;
+using std::vector;
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t PREFACE_LEN = sizeof(PREFACE) - 1;
+
+// Frame types (RFC 7540 6)
+static const uint8_t FRAME_DATA = 0x0;
+static const uint8_t FRAME_HEADERS = 0x1;
+static const uint8_t FRAME_RST_STREAM = 0x3;
+static const uint8_t FRAME_SETTINGS = 0x4;
+static const uint8_t FRAME_PING = 0x6;
+static const uint8_t FRAME_GOAWAY = 0x7;
+static const uint8_t FRAME_WINDOW_UPDATE = 0x8;
+static const uint8_t FRAME_CONTINUATION = 0x9;
+
+// Frame flags
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+// Error codes (RFC 7540 7)
+static const uint32_t NO_ERROR = 0x0;
+static const uint32_t PROTOCOL_ERROR = 0x1;
+static const uint32_t FLOW_CONTROL_ERROR = 0x3;
+static const uint32_t FRAME_SIZE_ERROR = 0x6;
+static const uint32_t REFUSED_STREAM = 0x7;
+static const uint32_t COMPRESSION_ERROR = 0x9;
+static const uint32_t ENHANCE_YOUR_CALM = 0xb;
+
+static const uint32_t DEFAULT_WINDOW = 65535;
+static const uint32_t MAX_FRAME_SIZE = 16384; // the most we accept
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const uint32_t MAX_CONCURRENT_STREAMS = 100;
+// Most bytes of (compressed) header block we'll collect for one request
+static const uint32_t MAX_HEADER_LIST_SIZE = 16384;
+
+// Browsers keep h2 connections open so they can reuse them, but each one
+// ties up one of our few worker threads. A quiet connection is kept for
+// IDLE_TIMEOUT_MS while nobody else is waiting, but only BUSY_IDLE_TIMEOUT_MS
+// once other connections are queued up for a thread.
+static const int IDLE_TIMEOUT_MS = 5000;
+static const int BUSY_IDLE_TIMEOUT_MS = 100;
+
+static uint32_t read_u32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+		| ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void append_u32(string &out, uint32_t v) {
+	out.push_back((char)(v >> 24));
+	out.push_back((char)(v >> 16));
+	out.push_back((char)(v >> 8));
+	out.push_back((char)v);
+}
+
+/**
+ * Builds the 9 byte frame header (RFC 7540 4.1).
+ */
+static string frame_header(uint32_t length, uint8_t type, uint8_t flags,
+		uint32_t stream_id) {
+	string h;
+	h.push_back((char)(length >> 16));
+	h.push_back((char)(length >> 8));
+	h.push_back((char)length);
+	h.push_back((char)type);
+	h.push_back((char)flags);
+	append_u32(h, stream_id & 0x7fffffff);
+	return h;
+}
+
+/**
+ * Decodes base64url (no padding), as used by the HTTP2-Settings header.
+ */
+static string base64url_decode(const string &in) {
+	string out;
+	uint32_t buffer = 0;
+	int bits = 0;
+	for (char c : in) {
+		int v;
+		if (c >= 'A' && c <= 'Z') v = c - 'A';
+		else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') v = c - '0' + 52;
+		else if (c == '-' || c == '+') v = 62;
+		else if (c == '_' || c == '/') v = 63;
+		else continue; // skip padding and whitespace
+
+		buffer = (buffer << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out.push_back((char)((buffer >> bits) & 0xff));
+		}
+	}
+	return out;
+}
+
+bool is_http2_preface(const char *data, size_t length) {
+	return length >= PREFACE_LEN && memcmp(data, PREFACE, PREFACE_LEN) == 0;
+}
+
+Http2Connection::Http2Connection(int client_sock, Http2Handler request_handler,
+		std::function<bool()> others_waiting) :
+	sock(client_sock), handler(request_handler), waiting(others_waiting),
+	preface_pending(true),
+	closing(false), conn_window(DEFAULT_WINDOW),
+	peer_initial_window(DEFAULT_WINDOW), peer_max_frame(16384),
+	last_stream_id(0), header_stream(0) {
+	// Frames are written with several small sends, so don't let Nagle hold
+	// back the end of a response.
+	int one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+Http2Connection::~Http2Connection() {
+	for (auto &entry : streams) {
+		if (entry.second.fd >= 0) {
+			close(entry.second.fd);
+		}
+	}
+}
+
+void Http2Connection::serve(const char *initial, size_t length) {
+	inbuf.assign(initial, length);
+	try {
+		send_settings();
+		run();
+	}
+	catch (const std::system_error &err) {
+		// The client went away mid-response, nothing left to do.
+	}
+}
+
+void Http2Connection::serve_upgrade(const string &path, const string &settings,
+		const char *rest, size_t length) {
+	string switching = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	inbuf.assign(rest, length);
+
+	try {
+		write_all(switching.c_str(), switching.length());
+		send_settings();
+
+		string client_settings = base64url_decode(settings);
+		apply_settings((const uint8_t *)client_settings.data(),
+				client_settings.size());
+
+		// The upgrade request is stream 1, already half-closed by the client.
+		last_stream_id = 1;
+		start_response(1, "GET", path);
+		run();
+	}
+	catch (const std::system_error &err) {
+		// The client went away mid-response, nothing left to do.
+	}
+}
+
+/**
+ * Sends everything in the buffer, raising an exception if the connection
+ * fails.
+ */
+void Http2Connection::write_all(const char *data, size_t length, int flags) {
+	size_t total_sent = 0;
+	while (total_sent < length) {
+		ssize_t n = send(sock, data + total_sent, length - total_sent,
+				flags | MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			std::error_code ec(errno, std::generic_category());
+			throw std::system_error(ec, "send failed");
+		}
+		total_sent += n;
+	}
+}
+
+void Http2Connection::send_frame(uint8_t type, uint8_t flags,
+		uint32_t stream_id, const string &payload) {
+	string frame = frame_header(payload.size(), type, flags, stream_id);
+	frame += payload;
+	write_all(frame.data(), frame.size());
+}
+
+void Http2Connection::send_goaway(uint32_t error_code) {
+	string payload;
+	append_u32(payload, last_stream_id);
+	append_u32(payload, error_code);
+	send_frame(FRAME_GOAWAY, 0, 0, payload);
+	closing = true;
+}
+
+void Http2Connection::send_rst_stream(uint32_t stream_id, uint32_t error_code) {
+	string payload;
+	append_u32(payload, error_code);
+	send_frame(FRAME_RST_STREAM, 0, stream_id, payload);
+	close_stream(stream_id);
+}
+
+void Http2Connection::send_settings() {
+	string payload;
+	payload.push_back(0x0);
+	payload.push_back(0x3); // SETTINGS_MAX_CONCURRENT_STREAMS
+	append_u32(payload, MAX_CONCURRENT_STREAMS);
+	payload.push_back(0x0);
+	payload.push_back(0x6); // SETTINGS_MAX_HEADER_LIST_SIZE
+	append_u32(payload, MAX_HEADER_LIST_SIZE);
+	send_frame(FRAME_SETTINGS, 0, 0, payload);
+}
+
+void Http2Connection::apply_settings(const uint8_t *payload, size_t length) {
+	for (size_t i = 0; i + 6 <= length; i += 6) {
+		uint16_t id = (payload[i] << 8) | payload[i+1];
+		uint32_t value = read_u32(payload + i + 2);
+
+		if (id == 0x4) {
+			// SETTINGS_INITIAL_WINDOW_SIZE changes the window of every open
+			// stream by the difference (RFC 7540 6.9.2).
+			if (value > MAX_WINDOW) {
+				send_goaway(FLOW_CONTROL_ERROR);
+				return;
+			}
+			int64_t delta = (int64_t)value - peer_initial_window;
+			peer_initial_window = value;
+			for (auto &entry : streams) {
+				entry.second.window += delta;
+			}
+		}
+		else if (id == 0x5) {
+			if (value < 16384 || value > 16777215) {
+				send_goaway(PROTOCOL_ERROR);
+				return;
+			}
+			peer_max_frame = value;
+		}
+	}
+}
+
+void Http2Connection::run() {
+	int idle_ms = 0; // how long we've had nothing to send or receive
+	while (!closing) {
+		process_frames();
+		if (closing) break;
+
+		bool more_to_send = pump_data();
+
+		// Only block on the socket when we have nothing we're allowed to
+		// send; otherwise just peek for WINDOW_UPDATEs and new requests.
+		// Blocking is done in short waits so we notice when other
+		// connections start waiting for our thread.
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		int rv = poll(&pfd, 1, more_to_send ? 0 : BUSY_IDLE_TIMEOUT_MS);
+		if (rv < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (rv == 0) {
+			if (!more_to_send) {
+				idle_ms += BUSY_IDLE_TIMEOUT_MS;
+				bool busy = waiting && waiting();
+				if (idle_ms >= (busy ? BUSY_IDLE_TIMEOUT_MS : IDLE_TIMEOUT_MS)) {
+					send_goaway(NO_ERROR);
+				}
+			}
+			continue;
+		}
+		idle_ms = 0;
+
+		char data[16384];
+		ssize_t n = recv(sock, data, sizeof(data), 0);
+		if (n <= 0) {
+			break;
+		}
+		inbuf.append(data, n);
+	}
+}
+
+void Http2Connection::process_frames() {
+	if (preface_pending) {
+		if (inbuf.size() < PREFACE_LEN) {
+			return;
+		}
+		if (!is_http2_preface(inbuf.data(), inbuf.size())) {
+			send_goaway(PROTOCOL_ERROR);
+			return;
+		}
+		inbuf.erase(0, PREFACE_LEN);
+		preface_pending = false;
+	}
+
+	size_t pos = 0;
+	while (!closing && inbuf.size() - pos >= 9) {
+		const uint8_t *h = (const uint8_t *)inbuf.data() + pos;
+		uint32_t length = (h[0] << 16) | (h[1] << 8) | h[2];
+		if (length > MAX_FRAME_SIZE) {
+			send_goaway(FRAME_SIZE_ERROR);
+			break;
+		}
+		if (inbuf.size() - pos - 9 < length) {
+			break; // wait for the rest of the frame
+		}
+
+		uint8_t type = h[3];
+		uint8_t flags = h[4];
+		uint32_t stream_id = read_u32(h + 5) & 0x7fffffff;
+		handle_frame(type, flags, stream_id, h + 9, length);
+		pos += 9 + length;
+	}
+	inbuf.erase(0, pos);
+}
+
+void Http2Connection::handle_frame(uint8_t type, uint8_t flags,
+		uint32_t stream_id, const uint8_t *payload, uint32_t length) {
+	// Once a header block starts, nothing but its CONTINUATIONs may follow.
+	if (header_stream != 0 && (type != FRAME_CONTINUATION
+				|| stream_id != header_stream)) {
+		send_goaway(PROTOCOL_ERROR);
+		return;
+	}
+
+	switch (type) {
+	case FRAME_HEADERS:
+	case FRAME_CONTINUATION:
+		handle_headers(type, flags, stream_id, payload, length);
+		break;
+
+	case FRAME_DATA:
+		if (stream_id == 0) {
+			send_goaway(PROTOCOL_ERROR);
+			break;
+		}
+		// We only serve GETs, but keep the client's windows open so a
+		// request body can't stall the connection.
+		if (length > 0) {
+			string increment;
+			append_u32(increment, length);
+			send_frame(FRAME_WINDOW_UPDATE, 0, 0, increment);
+			send_frame(FRAME_WINDOW_UPDATE, 0, stream_id, increment);
+		}
+		break;
+
+	case FRAME_SETTINGS:
+		if (flags & FLAG_ACK) break;
+		if (stream_id != 0 || length % 6 != 0) {
+			send_goaway(FRAME_SIZE_ERROR);
+			break;
+		}
+		apply_settings(payload, length);
+		send_frame(FRAME_SETTINGS, FLAG_ACK, 0, "");
+		break;
+
+	case FRAME_PING:
+		if (length != 8) {
+			send_goaway(FRAME_SIZE_ERROR);
+			break;
+		}
+		if (!(flags & FLAG_ACK)) {
+			send_frame(FRAME_PING, FLAG_ACK, 0, string((const char *)payload, 8));
+		}
+		break;
+
+	case FRAME_WINDOW_UPDATE: {
+		if (length != 4) {
+			send_goaway(FRAME_SIZE_ERROR);
+			break;
+		}
+		uint32_t increment = read_u32(payload) & 0x7fffffff;
+		if (stream_id == 0) {
+			conn_window += increment;
+			if (conn_window > MAX_WINDOW) send_goaway(FLOW_CONTROL_ERROR);
+		}
+		else if (streams.count(stream_id)) {
+			Stream &s = streams[stream_id];
+			s.window += increment;
+			if (s.window > MAX_WINDOW) {
+				// RFC 7540 6.9.1: only this stream is in error.
+				send_rst_stream(stream_id, FLOW_CONTROL_ERROR);
+			}
+		}
+		break;
+	}
+
+	case FRAME_RST_STREAM:
+		close_stream(stream_id);
+		break;
+
+	case FRAME_GOAWAY:
+		closing = true;
+		break;
+
+	default:
+		// PRIORITY, and any frame type we don't know, is ignored.
+		break;
+	}
+}
+
+void Http2Connection::handle_headers(uint8_t type, uint8_t flags,
+		uint32_t stream_id, const uint8_t *payload, uint32_t length) {
+	if (type == FRAME_HEADERS) {
+		// Client streams are odd and must always increase.
+		if (stream_id % 2 == 0 || stream_id <= last_stream_id) {
+			send_goaway(PROTOCOL_ERROR);
+			return;
+		}
+		last_stream_id = stream_id;
+
+		uint32_t start = 0;
+		uint32_t pad = 0;
+		if (flags & FLAG_PADDED) {
+			if (length < 1) {
+				send_goaway(PROTOCOL_ERROR);
+				return;
+			}
+			pad = payload[0];
+			start = 1;
+		}
+		if (flags & FLAG_PRIORITY) {
+			start += 5; // stream dependency and weight
+		}
+		if (start + pad > length) {
+			send_goaway(PROTOCOL_ERROR);
+			return;
+		}
+		if (length - start - pad > MAX_HEADER_LIST_SIZE) {
+			send_goaway(ENHANCE_YOUR_CALM);
+			return;
+		}
+		header_block.assign((const char *)payload + start, length - start - pad);
+	}
+	else {
+		if (header_stream == 0) {
+			send_goaway(PROTOCOL_ERROR);
+			return;
+		}
+		// A client that never ends its header block doesn't get to make us
+		// hold on to it forever.
+		if (header_block.size() + length > MAX_HEADER_LIST_SIZE) {
+			send_goaway(ENHANCE_YOUR_CALM);
+			return;
+		}
+		header_block.append((const char *)payload, length);
+	}
+
+	if (!(flags & FLAG_END_HEADERS)) {
+		header_stream = stream_id;
+		return;
+	}
+	header_stream = 0;
+
+	vector<HeaderField> fields;
+	try {
+		fields = decoder.decode((const uint8_t *)header_block.data(),
+				header_block.size());
+	}
+	catch (const HpackError &err) {
+		send_goaway(COMPRESSION_ERROR);
+		return;
+	}
+
+	// The block still had to be decoded, to keep the HPACK table in step
+	// with the client, but we won't answer more than we said we would.
+	if (streams.size() >= MAX_CONCURRENT_STREAMS) {
+		send_rst_stream(stream_id, REFUSED_STREAM);
+		return;
+	}
+
+	string method, path;
+	for (const HeaderField &f : fields) {
+		if (f.first == ":method") method = f.second;
+		else if (f.first == ":path") path = f.second;
+	}
+	start_response(stream_id, method, path);
+}
+
+void Http2Connection::start_response(uint32_t stream_id, const string &method,
+		const string &path) {
+	Http2Response response;
+	if (method != "GET" || path.empty() || path[0] != '/') {
+		response.status = 400;
+		response.content_type = "text/html";
+	}
+	else {
+		// Query strings don't map to anything on disk.
+		response = handler(path.substr(0, path.find('?')));
+	}
+
+	Stream s;
+	s.window = peer_initial_window;
+	s.body_pos = 0;
+	s.fd = -1;
+	s.offset = 0;
+	s.file_size = 0;
+
+	off_t content_length = response.body.size();
+	if (!response.file_path.empty()) {
+		s.fd = open(response.file_path.c_str(), O_RDONLY);
+		struct stat st;
+		if (s.fd < 0 || fstat(s.fd, &st) < 0) {
+			if (s.fd >= 0) close(s.fd);
+			s.fd = -1;
+			response.status = 404;
+			response.content_type = "text/html";
+		}
+		else {
+			s.file_size = st.st_size;
+			content_length = st.st_size;
+		}
+	}
+	if (s.fd < 0) {
+		s.body = std::move(response.body);
+		content_length = s.body.size();
+	}
+
+	string block;
+	hpack_encode_field(block, ":status", std::to_string(response.status));
+	hpack_encode_field(block, "content-type", response.content_type);
+	hpack_encode_field(block, "content-length", std::to_string(content_length));
+
+	bool empty = content_length == 0;
+	send_frame(FRAME_HEADERS,
+			FLAG_END_HEADERS | (empty ? FLAG_END_STREAM : 0), stream_id, block);
+
+	if (empty) {
+		if (s.fd >= 0) close(s.fd);
+		return;
+	}
+	streams[stream_id] = std::move(s);
+}
+
+void Http2Connection::close_stream(uint32_t stream_id) {
+	auto it = streams.find(stream_id);
+	if (it == streams.end()) {
+		return;
+	}
+	if (it->second.fd >= 0) {
+		close(it->second.fd);
+	}
+	streams.erase(it);
+}
+
+/**
+ * Sends at most one DATA frame for each open stream (round-robin), as large
+ * as the flow-control windows and the client's frame size allow.
+ *
+ * @return true if some stream still has data it is allowed to send.
+ */
+bool Http2Connection::pump_data() {
+	vector<uint32_t> finished;
+
+	for (auto &entry : streams) {
+		if (conn_window <= 0) break;
+		Stream &s = entry.second;
+		if (s.window <= 0) continue;
+
+		int64_t remaining = s.fd >= 0 ? s.file_size - s.offset
+			: (int64_t)(s.body.size() - s.body_pos);
+		int64_t len = std::min<int64_t>(remaining, peer_max_frame);
+		len = std::min(len, s.window);
+		len = std::min(len, conn_window);
+		bool last = len == remaining;
+
+		string header = frame_header(len, FRAME_DATA,
+				last ? FLAG_END_STREAM : 0, entry.first);
+		if (s.fd >= 0) {
+			// Frame header goes out first, then the kernel copies the file
+			// straight into the socket.
+			write_all(header.data(), header.size(), MSG_MORE);
+			off_t end = s.offset + len;
+			while (s.offset < end) {
+				ssize_t n = sendfile(sock, s.fd, &s.offset, end - s.offset);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) {
+					std::error_code ec(n < 0 ? errno : EIO,
+							std::generic_category());
+					throw std::system_error(ec, "sendfile failed");
+				}
+			}
+		}
+		else {
+			header.append(s.body, s.body_pos, len);
+			write_all(header.data(), header.size());
+			s.body_pos += len;
+		}
+
+		s.window -= len;
+		conn_window -= len;
+		if (last) {
+			finished.push_back(entry.first);
+		}
+	}
+
+	for (uint32_t id : finished) {
+		close_stream(id);
+	}
+
+	if (conn_window <= 0) {
+		return false;
+	}
+	for (auto &entry : streams) {
+		if (entry.second.window > 0) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,141 @@
+#ifndef HTTP2CONNECTION_HPP
+#define HTTP2CONNECTION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+#include <sys/types.h>
+
+#include "Hpack.hpp"
+
+/**
+ * What torero-serve wants to send back for a single request. Either body
+ * holds the whole response (e.g. a directory listing or error page) or
+ * file_path names a file whose contents are streamed with sendfile.
+ */
+struct Http2Response {
+	int status;
+	std::string content_type;
+	std::string body;
+	std::string file_path;
+};
+
+/**
+ * Function that maps a request path (e.g. "/pic.html") to a response.
+ */
+typedef std::function<Http2Response(const std::string &path)> Http2Handler;
+
+/**
+ * Checks whether the given bytes start with the HTTP/2 client connection
+ * preface, i.e. the client is speaking h2c with prior knowledge.
+ *
+ * @param data The first bytes received from the client.
+ * @param length Number of bytes received.
+ * @return true if this is an HTTP/2 connection.
+ */
+bool is_http2_preface(const char *data, size_t length);
+
+/**
+ * Serves one cleartext HTTP/2 (h2c) connection.
+ *
+ * All requests on the connection are multiplexed: each open stream gets one
+ * DATA frame per round, limited by the stream and connection flow-control
+ * windows, so a big image can't hold up the stylesheet requested after it.
+ */
+class Http2Connection {
+  private:
+	/**
+	 * A response that still has body bytes left to send.
+	 */
+	struct Stream {
+		int64_t window; // how many bytes the client lets us send
+		std::string body; // in-memory body (when fd is -1)
+		size_t body_pos;
+		int fd; // open file being streamed, or -1
+		off_t offset; // next byte of the file to send
+		off_t file_size;
+	};
+
+	int sock;
+	Http2Handler handler;
+	std::function<bool()> waiting; // whether other connections want a thread
+	HpackDecoder decoder;
+
+	std::string inbuf; // received bytes not yet parsed into frames
+	bool preface_pending; // still waiting for the client's preface
+	bool closing;
+
+	int64_t conn_window; // connection-level send window
+	int64_t peer_initial_window; // SETTINGS_INITIAL_WINDOW_SIZE from client
+	uint32_t peer_max_frame; // SETTINGS_MAX_FRAME_SIZE from client
+	uint32_t last_stream_id; // highest stream the client has opened
+
+	// Header block being collected across HEADERS/CONTINUATION frames
+	uint32_t header_stream;
+	std::string header_block;
+
+	std::map<uint32_t, Stream> streams;
+
+	void run();
+	void write_all(const char *data, size_t length, int flags = 0);
+	void send_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+			const std::string &payload);
+	void send_goaway(uint32_t error_code);
+	void send_rst_stream(uint32_t stream_id, uint32_t error_code);
+	void send_settings();
+	void apply_settings(const uint8_t *payload, size_t length);
+
+	void process_frames();
+	void handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+			const uint8_t *payload, uint32_t length);
+	void handle_headers(uint8_t type, uint8_t flags, uint32_t stream_id,
+			const uint8_t *payload, uint32_t length);
+	void start_response(uint32_t stream_id, const std::string &method,
+			const std::string &path);
+	void close_stream(uint32_t stream_id);
+	bool pump_data();
+
+  public:
+	/**
+	 * Constructor for Http2Connection class.
+	 *
+	 * @param client_sock The (blocking) socket connected to the client.
+	 * @param request_handler Function that builds the response for a path.
+	 * @param others_waiting Says whether other connections are waiting for
+	 * 	a thread, in which case an idle connection is closed sooner (may be
+	 * 	empty).
+	 */
+	Http2Connection(int client_sock, Http2Handler request_handler,
+			std::function<bool()> others_waiting = nullptr);
+
+	/**
+	 * Destructor for Http2Connection class. Closes any files still open for
+	 * unfinished streams, but not the client socket.
+	 */
+	~Http2Connection();
+
+	/**
+	 * Serves a connection that started with the HTTP/2 preface.
+	 *
+	 * @param initial Bytes already received (starting with the preface).
+	 * @param length Number of bytes already received.
+	 */
+	void serve(const char *initial, size_t length);
+
+	/**
+	 * Serves a connection that sent an HTTP/1.1 request with "Upgrade: h2c".
+	 * The upgraded request becomes stream 1 and is answered over HTTP/2.
+	 *
+	 * @param path The path requested in the HTTP/1.1 request.
+	 * @param settings The HTTP2-Settings header value (base64url).
+	 * @param rest Bytes received after the end of the HTTP/1.1 request.
+	 * @param length Number of bytes in rest.
+	 */
+	void serve_upgrade(const std::string &path, const std::string &settings,
+			const char *rest, size_t length);
+};
+
+#endif // HTTP2CONNECTION_HPP
@@ -0,0 +1,56 @@
+/**
+ * Implementation of the RequestArena class.
+ * See the associated header file (RequestArena.hpp) for the declaration of
+ * this class.
+ */
+#include <cstring>
+
+#include "RequestArena.hpp"
+
+RequestArena::RequestArena(size_t size) :
+	buffer(new char[size]), capacity(size), used(0) {}
+
+RequestArena::~RequestArena() {
+	reset();
+	delete[] buffer;
+}
+
+void *RequestArena::allocate(size_t num_bytes) {
+	const size_t align = alignof(std::max_align_t);
+	size_t start = (used + align - 1) & ~(align - 1);
+
+	if (start + num_bytes > capacity) {
+		// Unusually large request (e.g. a very long base directory), so fall
+		// back to the heap for this piece.
+		char *block = new char[num_bytes];
+		overflow.push_back(block);
+		return block;
+	}
+
+	used = start + num_bytes;
+	return buffer + start;
+}
+
+const char *RequestArena::concat(std::initializer_list<std::string_view> parts) {
+	size_t length = 0;
+	for (std::string_view part : parts) {
+		length += part.size();
+	}
+
+	char *joined = (char *)allocate(length + 1);
+	char *pos = joined;
+	for (std::string_view part : parts) {
+		memcpy(pos, part.data(), part.size());
+		pos += part.size();
+	}
+	*pos = '\0';
+	return joined;
+}
+
+void RequestArena::reset() {
+	for (char *block : overflow) {
+		delete[] block;
+	}
+	overflow.clear();
+	used = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef REQUESTARENA_HPP
+#define REQUESTARENA_HPP
+
+#include <cstddef>
+#include <initializer_list>
+#include <string_view>
+#include <vector>
+
+/**
+ * A bump allocator for memory that only lives as long as one request.
+ *
+ * Each worker thread keeps one arena and resets it when a request finishes,
+ * so building paths and response headers doesn't go through malloc (and
+ * doesn't make the worker threads fight over the heap lock).
+ */
+class RequestArena {
+  private:
+	char *buffer; // the arena's fixed block of memory
+	size_t capacity; // size of buffer (in bytes)
+	size_t used; // bytes of buffer handed out since the last reset
+	std::vector<char *> overflow; // heap blocks for requests that didn't fit
+
+  public:
+	/**
+	 * Constructor for RequestArena class.
+	 *
+	 * @param size Number of bytes to reserve up front.
+	 */
+	RequestArena(size_t size);
+
+	/**
+	 * Destructor for RequestArena class.
+	 */
+	~RequestArena();
+
+	RequestArena(const RequestArena &) = delete;
+	RequestArena &operator=(const RequestArena &) = delete;
+
+	/**
+	 * Allocates memory that stays valid until the next reset.
+	 *
+	 * @param num_bytes Number of bytes needed.
+	 * @return Pointer to the memory (aligned for any type).
+	 */
+	void *allocate(size_t num_bytes);
+
+	/**
+	 * Joins the given pieces into a single NUL-terminated string in the
+	 * arena (e.g. base_dir + file_name + "index.html").
+	 *
+	 * @param parts The pieces to join, in order.
+	 * @return The joined string.
+	 */
+	const char *concat(std::initializer_list<std::string_view> parts);
+
+	/**
+	 * Frees everything allocated since the last reset.
+	 */
+	void reset();
+};
+
+#endif // REQUESTARENA_HPP
@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 // C++ standard libraries
@@ -36,35 +37,79 @@
 #include <iostream>
 #include <system_error>
 #include <filesystem>
-#include <fstream>
-#include <regex>
+#include <string_view>
 #include <mutex>
+#include <atomic>
+
+#include "Http2Connection.hpp"
+#include "RequestArena.hpp"
 
 // shorten the std::filesystem namespace down to just fs
 namespace fs = std::filesystem;
 
 using std::cout;
 using std::string;
+using std::string_view;
 using std::vector;
 using std::thread;
 
 // This will limit how many clients can be waiting for a connection.
 static const int BACKLOG = 10;
 
+// Bytes each worker thread reserves for per-request paths and headers.
+static const size_t ARENA_SIZE = 16384;
+
+#ifdef ALLOC_STATS
+/*
+ * Debug builds (make debug) count heap allocations per thread so that
+ * handleClient can report how many each request needed.
+ */
+static thread_local uint64_t thread_allocs = 0;
+
+// GCC flags free() on memory from operator new, but that is exactly how our
+// replacement operators are paired up.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size) {
+	thread_allocs++;
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+#endif
+
 // forward declarations
 int createSocketAndListen(const int port_num);
 void acceptConnections(const int server_sock, string base_dir);
-void handleClient(const int client_sock);
+void handleClient(const int client_sock, string_view base_dir, RequestArena &arena,
+		const std::atomic<int> &queued);
 void sendData(int socked_fd, const char *data, size_t data_length);
 int receiveData(int socked_fd, char *dest, size_t buff_size);
 void badRequest(const int client_sock);
 void notFoundRequest(const int client_sock);
-void okayResponse(const int client_sock, string file_type);
-void contentResponse(const int client_sock, string file_name, string base_dir);
-void check_dir(int client_sock, string file_name, string base_dir);
-void send_page(int client_sock, string file_name, string base_dir);
-void send_dir(int client_sock, string file_name, string base_dir);
-void thread_function(int &count, int &tail, int buff_size, string base_dir, int sock_buff[], std::mutex &count_mutex, std::mutex &get_mutex);
+void okayResponse(const int client_sock, string_view file_type, RequestArena &arena);
+string_view mimePrefix(string_view file_type);
+string contentType(string file_type);
+bool validRequestLine(string_view line);
+string_view findHeader(string_view request, string_view name);
+bool isRegularFile(const char *path);
+bool isDirectory(const char *path);
+Http2Response http2Response(const string &file_name, const string &base_dir);
+void contentResponse(const int client_sock, string_view file_name, string_view base_dir, RequestArena &arena);
+void check_dir(int client_sock, string_view file_name, string_view base_dir, RequestArena &arena);
+void send_page(int client_sock, string_view file_name, string_view base_dir, RequestArena &arena);
+void send_dir(int client_sock, string_view file_name, string_view base_dir);
+void thread_function(std::atomic<int> &count, int &tail, int buff_size, string base_dir, int sock_buff[], std::mutex &count_mutex, std::mutex &get_mutex);
 
 
 
@@ -107,7 +152,7 @@ void sendData(int socked_fd, const char *data, size_t data_length) {
 	// the data has been completely sent.
 	size_t total_sent = 0;
 	while (total_sent != data_length){	
-		int num_bytes_sent = send(socked_fd, data, data_length, 0);
+		int num_bytes_sent = send(socked_fd, data + total_sent, data_length - total_sent, 0);
 		if (num_bytes_sent == -1) {
 			std::error_code ec(errno, std::generic_category());
 			throw std::system_error(ec, "send failed");
@@ -135,6 +180,51 @@ int receiveData(int socked_fd, char *dest, size_t buff_size) {
 	return num_bytes_received;
 }
 
+/**
+ * Checks whether a request line is a GET we know how to handle. This is the
+ * same check as the regular expression
+ * "GET( *)/([a-zA-Z0-9_\-/.]*)( *)HTTP/([0-9]*).([0-9]*)", done by hand since
+ * building a std::regex for every request costs dozens of allocations.
+ *
+ * @param line - the request line, without the trailing "\r\n"
+ * @return true if the request line is valid
+ */
+bool validRequestLine(string_view line) {
+	if (line.substr(0, 3) != "GET") {
+		return false;
+	}
+	size_t i = 3;
+	while (i < line.size() && line[i] == ' ') i++;
+	if (i >= line.size() || line[i] != '/') {
+		return false;
+	}
+	size_t path_start = ++i;
+	while (i < line.size() && (isalnum((unsigned char)line[i]) || line[i] == '_'
+				|| line[i] == '-' || line[i] == '/' || line[i] == '.')) {
+		i++;
+	}
+
+	// The path may have swallowed part of "HTTP", so back up until the rest
+	// of the line matches ( *)HTTP/([0-9]*).([0-9]*)
+	for (size_t end = i + 1; end-- > path_start; ) {
+		size_t j = end;
+		while (j < line.size() && line[j] == ' ') j++;
+		if (line.substr(j, 5) != "HTTP/") {
+			continue;
+		}
+		// The version is digits, any one character, then digits.
+		string_view version = line.substr(j + 5);
+		int non_digits = 0;
+		for (char c : version) {
+			if (!isdigit((unsigned char)c)) non_digits++;
+		}
+		if (!version.empty() && non_digits <= 1) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /**
  * Receives a request from a connected HTTP client and sends back the
  * appropriate response.
@@ -143,44 +233,67 @@ int receiveData(int socked_fd, char *dest, size_t buff_size) {
  * may not be used again).
  *
  * @param client_sock The client's socket file descriptor.
+ * @param base_dir - the wanted directory listed on the command line
+ * @param arena - this thread's arena, reset once the request is done
+ * @param queued - number of connections waiting for a thread
  */
-void handleClient(const int client_sock, string base_dir) {
+void handleClient(const int client_sock, string_view base_dir, RequestArena &arena,
+		const std::atomic<int> &queued) {
+#ifdef ALLOC_STATS
+	uint64_t allocs_before = thread_allocs;
+#endif
 	// Step 1: Receive the request message from the client
 	char received_data[2048];
 	int bytes_received = receiveData(client_sock, received_data, 2048);
-	string received_str = std::string(received_data);
 
-	// Turn the char array into a C++ string for easier processing.
-	string request_string(received_data, bytes_received);
-	
-	// Step 2: Parse the request string to determine what response to generate.
-	// We used regular expressions (specifically C++'s std::regex) to
-	// determine if a request is properly formatted.
-	std::vector<string> received_lines;
-	string::size_type pos = 0;
-	string::size_type prev = 0;
-	while(( pos = received_str.find("\r\n", prev)) != std::string::npos){
-		received_lines.push_back(received_str.substr(prev, pos - prev));
-		prev = pos + 1;
+	// Clients that already know we speak HTTP/2 (h2c with prior knowledge)
+	// start with the connection preface instead of a request line.
+	if (is_http2_preface(received_data, bytes_received)) {
+		Http2Connection conn(client_sock, [base_dir](const string &path) {
+				return http2Response(path, string(base_dir));
+				}, [&queued] { return queued > 0; });
+		conn.serve(received_data, bytes_received);
+		close(client_sock);
+		return;
 	}
-	received_lines.push_back(received_str.substr(prev));
- 	
-	//Check if valid request
-    // This is a regex that matches all valid requests
-	std::regex http_request_regex("GET( *)/([a-zA-Z0-9_\\-/.]*)( *)HTTP/([0-9]*).([0-9]*)",
-	             std::regex_constants::ECMAScript);
- 	std::smatch request_match;
-	// if no match send badRequest message
-	if (! std::regex_match(received_lines[0], request_match, http_request_regex)) {
+
+	// Step 2: Parse the request to determine what response to generate.
+	// Everything below just points into received_data (or the arena), so
+	// there is no need to copy the request into strings.
+	string_view request(received_data, bytes_received);
+	string_view request_line = request.substr(0, request.find("\r\n"));
+
+	// if it isn't a valid GET send badRequest message
+	if (!validRequestLine(request_line)) {
 		badRequest(client_sock);
 		close(client_sock);
 		return;
 	}
-	
+
 	//Process the data to determine request
- 	int end_index = received_lines[0].find(" ", 4) - 4;
-	string file_name = received_lines[0].substr(4, end_index);
-	
+	string_view::size_type path_start = request_line.find("/");
+	string_view file_name = request_line.substr(path_start,
+			request_line.find(" ", path_start) - path_start);
+
+	// A browser asking to upgrade to h2c gets this response over HTTP/2 and
+	// can then fetch the rest of the page's assets on the same connection.
+	string_view upgrade = findHeader(request, "upgrade");
+	string_view h2_settings = findHeader(request, "http2-settings");
+	if (upgrade == "h2c" && !h2_settings.empty()) {
+		string_view rest;
+		string_view::size_type header_end = request.find("\r\n\r\n");
+		if (header_end != string_view::npos) {
+			rest = request.substr(header_end + 4);
+		}
+		Http2Connection conn(client_sock, [base_dir](const string &path) {
+				return http2Response(path, string(base_dir));
+				}, [&queued] { return queued > 0; });
+		conn.serve_upgrade(string(file_name), string(h2_settings), rest.data(),
+				rest.size());
+		close(client_sock);
+		return;
+	}
+
 	// Step 3: Generate HTTP response message based on the request you received.
 	if (file_name == "/favicon.ico"){
 		close(client_sock);
@@ -189,13 +302,38 @@ void handleClient(const int client_sock, string base_dir) {
 	
 	// parse file type
 	if (file_name.back() == '/'){
-		check_dir(client_sock, file_name, base_dir);
+		check_dir(client_sock, file_name, base_dir, arena);
 	}
 	else{
-		send_page(client_sock, file_name, base_dir);
+		send_page(client_sock, file_name, base_dir, arena);
 	}
 	// Close connection with client.
 	close(client_sock);
+
+#ifdef ALLOC_STATS
+	cout << "GET " << file_name << ": " << (thread_allocs - allocs_before)
+		<< " allocations" << std::endl;
+#endif
+}
+
+/**
+ * Checks whether path names a regular file, without building an fs::path.
+ *
+ * @param path - NUL-terminated path
+ */
+bool isRegularFile(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * Checks whether path names a directory, without building an fs::path.
+ *
+ * @param path - NUL-terminated path
+ */
+bool isDirectory(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
 /**
@@ -204,13 +342,14 @@ void handleClient(const int client_sock, string base_dir) {
  * @param client_sock - the client sock
  * @param file_name - the file name
  * @param base_dir - the wanted directory on the command line
+ * @param arena - where to build paths
  */
-void check_dir(int client_sock, string file_name, string base_dir){
-	if (fs::is_regular_file(base_dir + file_name + "index.html")){
-		send_page(client_sock, file_name + "index.html", base_dir);
+void check_dir(int client_sock, string_view file_name, string_view base_dir, RequestArena &arena){
+	if (isRegularFile(arena.concat({base_dir, file_name, "index.html"}))){
+		send_page(client_sock, arena.concat({file_name, "index.html"}), base_dir, arena);
 	}
-	else if (fs::is_directory(base_dir + file_name)){
-		okayResponse(client_sock, "html");
+	else if (isDirectory(arena.concat({base_dir, file_name}))){
+		okayResponse(client_sock, "html", arena);
 		send_dir(client_sock, file_name, base_dir);
 	}
 	else{
@@ -225,9 +364,10 @@ void check_dir(int client_sock, string file_name, string base_dir){
  * @param file_name - the file name
  * @param base_dir - the wanted directory on the command line
  */
-void send_dir(int client_sock, string file_name, string base_dir){
+void send_dir(int client_sock, string_view file_name, string_view base_dir){
 	string dir_html = "<html>\n<body>\n<ul>\n";
-	for (const auto& entry: fs::directory_iterator( base_dir + file_name)) {	
+	fs::path dir_path = string(base_dir) + string(file_name);
+	for (const auto& entry: fs::directory_iterator(dir_path)) {	
 		string path_name = entry.path().filename();
 		dir_html += "<li><a href=\"" + path_name + "/\">" + path_name + "/</a></li>\n";
 	}
@@ -242,28 +382,109 @@ void send_dir(int client_sock, string file_name, string base_dir){
  * @param client_sock - the client sock
  * @param file_name - the file name
  * @param base_dir - the wanted directory on the command line
+ * @param arena - where to build paths and headers
  */
-void send_page(int client_sock, string file_name, string base_dir){
+void send_page(int client_sock, string_view file_name, string_view base_dir, RequestArena &arena){
 	// Step 4: Send response to client using the sendData function.
-	if (fs::is_regular_file( base_dir + file_name)){
-		int start_index = file_name.find(".") + 1;
-		string file_type = file_name.substr(start_index);
-		okayResponse(client_sock, file_type);
-		contentResponse(client_sock, file_name, base_dir);	
+	if (isRegularFile(arena.concat({base_dir, file_name}))){
+		string_view file_type = file_name.substr(file_name.find(".") + 1);
+		okayResponse(client_sock, file_type, arena);
+		contentResponse(client_sock, file_name, base_dir, arena);
 	}
 	else{
 		notFoundRequest(client_sock);
 	}
 }	
 
+/**
+ * Finds the value of a header in the request, ignoring the case of the
+ * header name.
+ *
+ * @param request - the whole request
+ * @param name - the lowercase header name
+ * @return the trimmed header value, or "" if it isn't there
+ */
+string_view findHeader(string_view request, string_view name) {
+	string_view::size_type pos = request.find("\r\n");
+	while (pos != string_view::npos) {
+		pos += 2;
+		string_view::size_type end = request.find("\r\n", pos);
+		string_view line = request.substr(pos, end == string_view::npos
+				? string_view::npos : end - pos);
+		pos = end;
+
+		if (line.size() <= name.size() || line[name.size()] != ':') {
+			continue;
+		}
+		bool match = true;
+		for (size_t j = 0; j < name.size(); j++) {
+			if (tolower((unsigned char)line[j]) != name[j]) {
+				match = false;
+				break;
+			}
+		}
+		if (match) {
+			string_view value = line.substr(name.size() + 1);
+			string_view::size_type start = value.find_first_not_of(" \t");
+			if (start == string_view::npos) {
+				return "";
+			}
+			return value.substr(start, value.find_last_not_of(" \t") - start + 1);
+		}
+	}
+	return "";
+}
+
+/**
+ * Works out the response for an HTTP/2 request. This follows the same rules
+ * as check_dir and send_page but hands back the file to stream instead of
+ * writing to the socket, since HTTP/2 needs to frame the body.
+ *
+ * @param file_name - the requested path
+ * @param base_dir - the wanted directory listed on the command line
+ * @return the response to send on the stream
+ */
+Http2Response http2Response(const string &file_name, const string &base_dir) {
+	Http2Response response;
+	response.status = 200;
+
+	string page = file_name;
+	if (page.back() == '/') {
+		if (fs::is_regular_file(base_dir + page + "index.html")) {
+			page += "index.html";
+		}
+		else if (fs::is_directory(base_dir + page)) {
+			response.content_type = contentType("html");
+			response.body = "<html>\n<body>\n<ul>\n";
+			for (const auto& entry: fs::directory_iterator(base_dir + page)) {
+				string path_name = entry.path().filename();
+				response.body += "<li><a href=\"" + path_name + "/\">" + path_name + "/</a></li>\n";
+			}
+			response.body += "</ul>\n</body>\n</html>";
+			return response;
+		}
+	}
+
+	if (page.find("..") == string::npos && fs::is_regular_file(base_dir + page)) {
+		response.content_type = contentType(page.substr(page.find(".") + 1));
+		response.file_path = base_dir + page;
+		return response;
+	}
+
+	response.status = 404;
+	response.content_type = "text/html";
+	response.body = "<html>\n<head>\n<title>Ruh-roh! Page not found!</title>\n</head>\n<body>\n404 Page Not Found! :'( :'( :'(\n</body>\n</html>";
+	return response;
+}
+
 /**
  * Bad request void function
  *
  * @param client_sock - the client sock
  */
 void badRequest(const int client_sock) {
-	string bad_request_string = "HTTP/1.0 400 BAD REQUEST\r\n\r\n";	
-	sendData(client_sock, bad_request_string.c_str(), bad_request_string.length());
+	static const char bad_request_string[] = "HTTP/1.0 400 BAD REQUEST\r\n\r\n";
+	sendData(client_sock, bad_request_string, sizeof(bad_request_string) - 1);
 }
 
 /**
@@ -272,8 +493,8 @@ void badRequest(const int client_sock) {
  * @param client_sock - the client sock
  */
 void notFoundRequest(const int client_sock) {
-	string n_found_str = "HTTP/1.0 404 NOT FOUND\r\nContent-Type: text/html\r\n\r\n<html>\n<head>\n<title>Ruh-roh! Page not found!</title>\n</head>\n<body>\n404 Page Not Found! :'( :'( :'(\n</body>\n</html>";
-	sendData(client_sock, n_found_str.c_str(), n_found_str.length());
+	static const char n_found_str[] = "HTTP/1.0 404 NOT FOUND\r\nContent-Type: text/html\r\n\r\n<html>\n<head>\n<title>Ruh-roh! Page not found!</title>\n</head>\n<body>\n404 Page Not Found! :'( :'( :'(\n</body>\n</html>";
+	sendData(client_sock, n_found_str, sizeof(n_found_str) - 1);
 }
 
 /**
@@ -282,26 +503,39 @@ void notFoundRequest(const int client_sock) {
  *
  * @param client_sock - the client sock
  * @param file_type - the file type (such as html, css, txt, etc.)
+ * @param arena - where to build the header
+ */
+void okayResponse(const int client_sock, string_view file_type, RequestArena &arena) {
+	// message and header put together
+	const char *together = arena.concat({"HTTP/1.0 200 OK\r\nContent-Type: ",
+			mimePrefix(file_type), file_type, "\r\n\r\n"});
+	sendData(client_sock, together, strlen(together));
+}
+
+/**
+ * Gives the top-level MIME type for a file extension
+ *
+ * @param file_type - the file type (such as html, css, txt, etc.)
+ * @return "text/", "image/" or "application/"
  */
-void okayResponse(const int client_sock, string file_type) {
+string_view mimePrefix(string_view file_type) {
 	if (file_type == "html" || file_type == "css" || file_type == "txt"){
-		file_type = "text/" + file_type;
+		return "text/";
 	}
 	else if(file_type == "jpeg" || file_type == "gif" || file_type == "png"){
-		file_type = "image/" + file_type;
+		return "image/";
 	}
-	else{
-		file_type = "application/" + file_type;
-	}
-	// messaged
-	string okay_string = "HTTP/1.0 200 OK\r\n";
-	
-	// header
-	string content_type = "Content-Type: " + file_type + "\r\n";
-		
-	// putting em together
-	string together = okay_string + content_type + "\r\n";
-	sendData(client_sock, together.c_str(), together.length());
+	return "application/";
+}
+
+/**
+ * Turns a file extension into its MIME type
+ *
+ * @param file_type - the file type (such as html, css, txt, etc.)
+ * @return the Content-Type value for that file type
+ */
+string contentType(string file_type) {
+	return string(mimePrefix(file_type)) + file_type;
 }
 
 /**
@@ -310,23 +544,22 @@ void okayResponse(const int client_sock, string file_type) {
  * @param client_sock - the client sock
  * @param file_name - the file name
  * @param base_dir - the wanted directory listed on the command line
+ * @param arena - where to build the path
  */
-void contentResponse(const int client_sock, string file_name, string base_dir){
+void contentResponse(const int client_sock, string_view file_name, string_view base_dir, RequestArena &arena){
 	//read_file
-	std::ifstream file(base_dir + file_name, std::ios::binary);
-	if (! file.is_open()){
+	int fd = open(arena.concat({base_dir, file_name}), O_RDONLY);
+	if (fd < 0){
 		notFoundRequest(client_sock);
-		close(client_sock);
 		return;	
 	}
 	const unsigned int buffer_size = 4096;
-    char file_data[buffer_size];
-    while(!file.eof()) {
-        file.read(file_data, buffer_size);
-        int bytes_read = file.gcount();
+	char file_data[buffer_size];
+	ssize_t bytes_read;
+	while((bytes_read = read(fd, file_data, buffer_size)) > 0) {
 		sendData(client_sock, file_data, bytes_read);
 	}
-    file.close();
+	close(fd);
 }
 
 /**
@@ -416,7 +649,10 @@ int createSocketAndListen(const int port_num) {
 void acceptConnections(const int server_sock, string base_dir) {
 	const int buff_size = 20;
 	int sock_buff[buff_size];
-	int tail = 0, head = 0, count = 0;
+	int tail = 0, head = 0;
+	// Read without count_mutex by threads waiting for work and by idle h2
+	// connections checking whether anyone is queued up, so it's atomic.
+	std::atomic<int> count(0);
 	std::mutex count_mutex;
 	std::mutex get_mutex;
 	const int num_threads = 8;
@@ -484,7 +720,8 @@ void acceptConnections(const int server_sock, string base_dir) {
  * @param count_mutex - keeps track of the count for mutexes
  * @param get_mutex - gets the mutex to unlock and lock the threads:
  */
-void thread_function(int &count, int &tail, int buff_size, string base_dir, int buff[], std::mutex &count_mutex, std::mutex &get_mutex){
+void thread_function(std::atomic<int> &count, int &tail, int buff_size, string base_dir, int buff[], std::mutex &count_mutex, std::mutex &get_mutex){
+	RequestArena arena(ARENA_SIZE);
 	while (true){
 		// This locks and unlocks twice to make sure 
 		get_mutex.lock();
@@ -498,6 +735,7 @@ void thread_function(int &count, int &tail, int buff_size, string base_dir, int
 		int socket = buff[tail];
 		tail = (tail + 1) % buff_size;
 		get_mutex.unlock();
-		handleClient(socket, base_dir);
+		handleClient(socket, base_dir, arena, count);
+		arena.reset();
 	}
 }
@@ -1,7 +1,10 @@
 package edu.sandiego.comp375.jukebox;
 
 import java.io.BufferedInputStream;
+import java.io.DataInputStream;
 import java.io.DataOutputStream;
+import java.io.PipedInputStream;
+import java.io.PipedOutputStream;
 import java.net.Socket;
 import java.util.Scanner;
 
@@ -11,8 +14,6 @@ import java.util.Scanner;
 public class AudioClient {
 	public static void main(String[] args) throws Exception {
 		Scanner s = new Scanner(System.in);
-		BufferedInputStream in = null;
-		DataOutputStream dOut = null;
 		Thread player = null;
 		int port = 0;
 		String ip;
@@ -29,30 +30,58 @@ public class AudioClient {
 		}
 		ip = args[1];
 
+		// One connection carries every command. Starting a session tells the
+		// server to frame everything it sends, so replies to list and info
+		// can arrive in the middle of a song.
+		Socket socket = new Socket(ip, port);
+		DataOutputStream dOut = new DataOutputStream(socket.getOutputStream());
+		SessionReader reader = new SessionReader(new DataInputStream(
+					new BufferedInputStream(socket.getInputStream(), 2048)));
+		Thread readerThread = new Thread(reader);
+		readerThread.setDaemon(true);
+		readerThread.start();
+		dOut.writeUTF("session");
+		dOut.flush();
+
 		while (true) {
 			System.out.print(">> ");
 			String command = s.nextLine();
 			String commands[] = command.split(" ", 2);
-			if (commands[0].equals("play")) {
+			if (commands[0].equals("play") || commands[0].equals("radio")
+					|| commands[0].equals("queue")) {
 				try {
+					// This will throw an error if the command is invalid
+					// (play may be followed by "at <seconds>"). A radio
+					// channel plays just like a song that never ends, and a
+					// queue of songs just like one long one.
+					Integer.valueOf(commands[1].split(" ")[0]);
 					if (player != null){
 						player.stop();
 					}
-					// This will throw an error if the command is invalid
-					Integer.valueOf(commands[1]); 
-					Socket socket = new Socket(ip, port);
-					if (socket.isConnected()) {
-						in = new BufferedInputStream(socket.getInputStream(), 2048);
-						//THIS IS NEW CODE
-						dOut = new DataOutputStream(socket.getOutputStream());
-						dOut.writeUTF(command);
-						dOut.flush(); // send play to server
 
-						//BACK TO GIVEN CODE
-						AudioPlayerThread thread = new AudioPlayerThread(in);
-						player = new Thread(thread);
-						player.start();
-					}
+					// The reader passes the song's audio to the player
+					// through a pipe.
+					PipedOutputStream audio = new PipedOutputStream();
+					final BufferedInputStream in = new BufferedInputStream(
+							new PipedInputStream(audio, 1024 * 1024), 2048);
+					reader.addSong(audio);
+
+					// The server stops whatever it was sending as soon as
+					// it gets this.
+					dOut.writeUTF(command);
+					dOut.flush();
+
+					player = new Thread(new Runnable() {
+						public void run() {
+							try {
+								new AudioPlayerThread(in).run();
+							}
+							catch (Exception e) {
+								System.out.println(e);
+							}
+						}
+					});
+					player.start();
 				}
 				catch(ArrayIndexOutOfBoundsException e){
 					System.out.println("Invalid song index");
@@ -62,10 +91,6 @@ public class AudioClient {
 				}
 			}
 			else if (command.equals("exit")) {
-				// Currently this doesn't actually stop the music from
-				// playing.
-				// Your final solution should make sure that the exit command
-				// causes music to stop playing immediately.
 				if (player != null){
 					player.stop();
 				}
@@ -73,60 +98,42 @@ public class AudioClient {
 				break;
 			}
 			else if (command.equals("list")){
-				Socket socket = new Socket(ip, port);
-				if (socket.isConnected()) {
-					dOut = new DataOutputStream(socket.getOutputStream());
-					dOut.writeUTF("list");
-					dOut.flush();
-					in = new BufferedInputStream(socket.getInputStream(), 2048);
-					// Thread.sleep(1000);
-					while(in.available() == 0){} // Wait till recv data
-					while (in.available() > 0) {
-  
-						// Read the byte and
-						// convert the integer to character
-						char c = (char)in.read();
-						// Print the characters
-						System.out.print(c);
-					}
-				}
-				socket.close();
+				dOut.writeUTF("list");
+				dOut.flush();
+			}
+			else if (command.equals("stats")){
+				dOut.writeUTF("stats");
+				dOut.flush();
+			}
+			else if (commands[0].equals("search") && commands.length > 1){
+				// The server replies with the best matches, numbered as in
+				// the list.
+				dOut.writeUTF(command);
+				dOut.flush();
 			}
 			else if (commands[0].equals("info")){
-				Socket socket = new Socket(ip, port);
 				try{
 					Integer.valueOf(commands[1]); // make sure second arg is an integer
-					if (socket.isConnected()) {
-						dOut = new DataOutputStream(socket.getOutputStream());
-						dOut.writeUTF(command);
-						dOut.flush();
-						in = new BufferedInputStream(socket.getInputStream(), 2048);
-						while(in.available() == 0){} // Wait till recv data
-						while (in.available() > 0) {
-	
-							// Read the byte and
-							// convert the integer to character
-							char c = (char)in.read();
-							// Print the characters
-							System.out.print(c);
-						}
-						System.out.println();
-					}
+					dOut.writeUTF(command);
+					dOut.flush();
 				}
 				catch(Exception e){
 					System.out.println(e);
 				}
-				socket.close();
 			}
 			else if (command.equals("stop")){
 				if (player != null){
 					player.stop();
 				}
+				// Don't waste the network sending the rest of the song.
+				dOut.writeUTF("stop");
+				dOut.flush();
 			}
 			else {
 				System.err.println("ERROR: unknown command");
 			}
 		}
+		socket.close();
 		s.close();
 		System.out.println("Client: Exiting");
 	}
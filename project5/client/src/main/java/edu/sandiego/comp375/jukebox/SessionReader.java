@@ -0,0 +1,86 @@
+package edu.sandiego.comp375.jukebox;
+
+import java.io.DataInputStream;
+import java.io.EOFException;
+import java.io.IOException;
+import java.io.OutputStream;
+import java.util.Queue;
+import java.util.concurrent.ConcurrentLinkedQueue;
+
+/**
+ * Reads the frames the server sends over a session connection.
+ *
+ * Every frame is a type byte, a four byte length and then the payload.
+ * Audio is passed along to the player of the song it belongs to and text
+ * replies are printed. The server ends every song (whether it finished or
+ * was stopped) with a SONG_END frame, so audio that was already on its way
+ * when we switched songs never reaches the new song's player.
+ */
+public class SessionReader implements Runnable {
+	public static final int AUDIO_FRAME = 1;
+	public static final int MESSAGE_FRAME = 2;
+	public static final int SONG_END_FRAME = 3;
+
+	private final DataInputStream in;
+	// Where to send the audio of each song we've asked for, in order
+	private final Queue<OutputStream> songs =
+		new ConcurrentLinkedQueue<OutputStream>();
+	private OutputStream current = null;
+
+	public SessionReader(DataInputStream in) {
+		this.in = in;
+	}
+
+	/**
+	 * Says where the audio of the next song we asked for should go.
+	 */
+	public void addSong(OutputStream audio) {
+		songs.add(audio);
+	}
+
+	public void run() {
+		try {
+			while (true) {
+				int type = in.readUnsignedByte();
+				int length = in.readInt();
+				byte[] payload = new byte[length];
+				in.readFully(payload);
+
+				if (type == AUDIO_FRAME) {
+					if (current == null) {
+						current = songs.poll();
+					}
+					if (current != null) {
+						try {
+							current.write(payload);
+						}
+						catch (IOException e) {
+							// The player was stopped, so nobody wants the
+							// rest of this song.
+						}
+					}
+				}
+				else if (type == MESSAGE_FRAME) {
+					System.out.println(new String(payload, "UTF-8"));
+				}
+				else if (type == SONG_END_FRAME) {
+					if (current == null) {
+						// The song ended before any of it arrived.
+						current = songs.poll();
+					}
+					AudioPlayerThread.closeQuietly(current);
+					current = null;
+				}
+			}
+		}
+		catch (EOFException e) {
+			System.out.println("Server closed the connection");
+		}
+		catch (Exception e) {
+			System.out.println(e);
+		}
+		finally {
+			AudioPlayerThread.closeQuietly(current);
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+
+#include "Catalog.h"
+
+using std::shared_ptr;
+
+shared_ptr<const Catalog> Catalog::latest = std::make_shared<const Catalog>(
+		std::vector<fs::path>());
+
+Catalog::Catalog(std::vector<fs::path> song_paths) : songs(std::move(song_paths)) {
+	// Directory order is arbitrary, so sort to keep song numbers the same
+	// from one reload to the next.
+	std::sort(songs.begin(), songs.end());
+
+	std::stringstream list;
+	for (size_t i = 0; i < songs.size(); ++i) {
+		list << "(" << i << ") " << songs[i] << "\n";
+	}
+	list_reply = std::make_shared<const std::string>(list.str());
+	info_replies.resize(songs.size());
+	index = std::make_shared<const SearchIndex>(songs, std::vector<SongText>());
+}
+
+/**
+ * Reads what's in a song's .info file.
+ *
+ * @param song Path of the song.
+ * @return What's in the file, or NULL if the song doesn't have one.
+ */
+static shared_ptr<const std::string> read_info_file(const fs::path &song) {
+	fs::path info_path = song;
+	info_path.replace_extension(".mp3.info");
+	std::ifstream info_file(info_path, std::ios::binary);
+	if (!info_file) {
+		return NULL;
+	}
+	std::stringstream info;
+	info << info_file.rdbuf();
+	return std::make_shared<const std::string>(info.str());
+}
+
+/**
+ * @param info What's in a song's .info file, or NULL if it doesn't have one.
+ * @return What to send in reply to info for the song.
+ */
+static shared_ptr<const std::string> info_reply(
+		shared_ptr<const std::string> info) {
+	if (info) {
+		return info;
+	}
+	return std::make_shared<const std::string>(
+			"Song does not have an info file.");
+}
+
+shared_ptr<const std::string> Catalog::load_info(size_t song_index) const {
+	shared_ptr<const std::string> info = read_info_file(songs[song_index]);
+	std::atomic_store(&info_replies[song_index], info_reply(info));
+	return info;
+}
+
+shared_ptr<const std::string> Catalog::read_info_response(const fs::path &song) {
+	return info_reply(read_info_file(song));
+}
+
+shared_ptr<const Catalog> Catalog::current() {
+	return std::atomic_load(&latest);
+}
+
+void Catalog::publish(shared_ptr<const Catalog> catalog) {
+	std::atomic_store(&latest, catalog);
+}
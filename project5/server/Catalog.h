@@ -0,0 +1,124 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "SearchIndex.h"
+
+namespace fs = std::filesystem;
+
+/**
+ * The songs the jukebox is serving, in the order list numbers them.
+ *
+ * A Catalog never changes once it has been built. When the music directory
+ * changes, a new one is built and published in its place; clients that are
+ * in the middle of a command keep using the one they started with (which is
+ * freed once the last of them lets go), so commands never need a lock or a
+ * copy of the song list.
+ */
+class Catalog {
+  private:
+	std::vector<fs::path> songs;
+
+	// Replies to list and info, built once per catalog and shared by every
+	// client that asks rather than rebuilt for each one. The info replies
+	// are read in by the same background pass that indexes the songs'
+	// text (see load_info), never by an event loop.
+	std::shared_ptr<const std::string> list_reply;
+	mutable std::vector<std::shared_ptr<const std::string>> info_replies;
+
+	// Index for search. It starts out covering just file names, and is
+	// replaced once the songs' tags and .info files have been read.
+	mutable std::shared_ptr<const SearchIndex> index;
+
+	static std::shared_ptr<const Catalog> latest;
+
+  public:
+	/**
+	 * Constructor for Catalog class.
+	 *
+	 * @param song_paths Paths of all the songs (they get sorted by path).
+	 */
+	Catalog(std::vector<fs::path> song_paths);
+
+	/**
+	 * @return Paths to all songs.
+	 */
+	const std::vector<fs::path> &song_list() const { return songs; }
+
+	/**
+	 * @return Number of songs.
+	 */
+	size_t size() const { return songs.size(); }
+
+	/**
+	 * @return What to send in reply to the list command.
+	 */
+	std::shared_ptr<const std::string> list_response() const {
+		return list_reply;
+	}
+
+	/**
+	 * @param song_index Index of a song (must be less than size()).
+	 * @return What to send in reply to info for that song, or NULL if its
+	 * 	.info file hasn't been read in yet.
+	 */
+	std::shared_ptr<const std::string> info_response(size_t song_index) const {
+		return std::atomic_load(&info_replies[song_index]);
+	}
+
+	/**
+	 * Reads a song's .info file in, and keeps the reply to info for it.
+	 * This waits on the disk, so it shouldn't be called from an event loop.
+	 * Safe to call from any thread.
+	 *
+	 * @param song_index Index of a song (must be less than size()).
+	 * @return What's in the file, or NULL if the song doesn't have one.
+	 */
+	std::shared_ptr<const std::string> load_info(size_t song_index) const;
+
+	/**
+	 * Reads the reply to info for a song, without keeping it. This waits on
+	 * the disk, so it shouldn't be called from an event loop.
+	 *
+	 * @param song Path of the song.
+	 * @return What to send in reply to info for it.
+	 */
+	static std::shared_ptr<const std::string> read_info_response(
+			const fs::path &song);
+
+	/**
+	 * @return The index to answer search with.
+	 */
+	std::shared_ptr<const SearchIndex> search_index() const {
+		return std::atomic_load(&index);
+	}
+
+	/**
+	 * Replaces the search index (with one that covers more of each song).
+	 * Safe to call from any thread.
+	 *
+	 * @param new_index The new index, for this catalog's songs.
+	 */
+	void set_search_index(std::shared_ptr<const SearchIndex> new_index) const {
+		std::atomic_store(&index, new_index);
+	}
+
+	/**
+	 * @return The most recently published catalog.
+	 */
+	static std::shared_ptr<const Catalog> current();
+
+	/**
+	 * Replaces the current catalog. Safe to call from any thread.
+	 *
+	 * @param catalog The new catalog.
+	 */
+	static void publish(std::shared_ptr<const Catalog> catalog);
+};
+
+#endif // CATALOG_H
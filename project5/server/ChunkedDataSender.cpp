@@ -4,108 +4,308 @@
 #include <cerrno>
 #include <cstdio>
 
-#include <fstream>
 #include <filesystem>
 #include <iostream>
 
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 namespace fs = std::filesystem;
 
 using std::cout;
 
 #include "ChunkedDataSender.h"
+#include "SongCache.h"
 
-ArraySender::ArraySender(const char *array_to_send, size_t length) {
-	this->array = new char[length];
-	std::copy(array_to_send, array_to_send+length, this->array);
-	this->array_length = length;
-	this->curr_loc = 0;
+/**
+ * Handles a send error we didn't expect. It's only this client's problem, so
+ * hang up on it: epoll will report the hangup and the event loop will close
+ * the client.
+ *
+ * @param sock_fd Socket the send failed on.
+ * @param what Which send failed, for the error message.
+ * @return -1, as for a full socket buffer.
+ */
+static ssize_t hang_up(int sock_fd, const char *what) {
+	perror(what);
+	shutdown(sock_fd, SHUT_RDWR);
+	return -1;
 }
 
-ssize_t ArraySender::send_next_chunk(int sock_fd) {
-	// Determine how many bytes we need to put in the next chunk.
-	// This will be either the CHUNK_SIZE constant or the number of bytes left
-	// to send in the array, whichever is smaller.
-	size_t num_bytes_remaining = array_length - curr_loc;
-	size_t bytes_in_chunk = std::min(num_bytes_remaining, CHUNK_SIZE);
-
-	if (bytes_in_chunk > 0) {
-		// Create the chunk and copy the data over from the appropriate
-		// location in the array
-		char chunk[CHUNK_SIZE];
-		memcpy(chunk, array+curr_loc, bytes_in_chunk);
+/**
+ * Sends a header (if any) followed by a chunk of data from memory with a
+ * single writev, so a frame header doesn't cost a syscall of its own.
+ *
+ * @param sock_fd Socket which to send the data over.
+ * @param header Bytes to send first (NULL if none).
+ * @param header_length Number of bytes in header.
+ * @param data The chunk of data to send after the header.
+ * @param length Number of bytes in data.
+ * @return -1 if we couldn't send because of a full socket buffer, otherwise
+ * 	the number of bytes actually sent over the socket.
+ */
+static ssize_t send_buffers(int sock_fd, const char *header,
+		size_t header_length, const char *data, size_t length) {
+	struct iovec iov[2];
+	int iov_count = 0;
+	if (header_length > 0) {
+		iov[iov_count].iov_base = (void *)header;
+		iov[iov_count].iov_len = header_length;
+		iov_count++;
+	}
+	if (length > 0) {
+		iov[iov_count].iov_base = (void *)data;
+		iov[iov_count].iov_len = length;
+		iov_count++;
+	}
+	if (iov_count == 0) {
+		return 0;
+	}
 
-		ssize_t num_bytes_sent = send(sock_fd, chunk, bytes_in_chunk, 0);
+	ssize_t num_bytes_sent = writev(sock_fd, iov, iov_count);
 
-		if (num_bytes_sent > 0) {
-			// We successfully send some of the data so update our location in
-			// the array so we know where to start sending the next time we
-			// call this function.
-			curr_loc += num_bytes_sent;
-			return num_bytes_sent;
-		}
-		else if (num_bytes_sent < 0 && errno == EAGAIN) {
-			// We couldn't send anything because the buffer was full
-			return -1;
-		}
-		else {
-			// Send had an error which we didn't expect, so exit the program.
-			perror("send_next_chunk send");
-			exit(EXIT_FAILURE);
-		}
+	if (num_bytes_sent >= 0) {
+		return num_bytes_sent;
 	}
-	else {
+	else if (errno == EAGAIN) {
+		// We couldn't send anything because the buffer was full
+		return -1;
+	}
+	else if (errno == EPIPE || errno == ECONNRESET) {
+		// The client hung up on us. Treat it like a full buffer; epoll
+		// will report the error and the event loop will close the client.
+		return -1;
+	}
+	else if (errno == EFAULT) {
+		// The mapped file got shorter under us, so the rest of the data is
+		// gone. Report that there is nothing more to send, as sendfile does.
 		return 0;
 	}
-	
+	else {
+		return hang_up(sock_fd, "send_next_chunk writev");
+	}
 }
 
-FileSender::FileSender(fs::path song_path) {
-	this->indata = new ifstream (song_path.c_str());
-	(*indata).seekg (0, (*indata).end);
-    this->file_length = (*indata).tellg();
-    (*indata).seekg (0, (*indata).beg);
-	this->curr_loc = 0;
+ssize_t ArraySender::send_next_chunk(int sock_fd, size_t max_bytes,
+		const char *header, size_t header_length) {
+	// The caller decides how big a chunk to send (from the room left in the
+	// socket buffer), so offer the socket everything up to max_bytes and let
+	// it take what fits.
+	size_t num_bytes_remaining = array->size() - curr_loc;
+	size_t bytes_in_chunk = std::min(num_bytes_remaining, max_bytes);
+
+	// The array never changes, so we can send straight out of it.
+	ssize_t num_bytes_sent = send_buffers(sock_fd, header, header_length,
+			array->data() + curr_loc, bytes_in_chunk);
+
+	// We successfully sent some of the data so update our location in the
+	// array so we know where to start sending the next time we call this
+	// function.
+	if (num_bytes_sent > (ssize_t)header_length) {
+		curr_loc += num_bytes_sent - header_length;
+	}
+	return num_bytes_sent;
 }
 
-ssize_t FileSender::send_next_chunk(int sock_fd) {
-	// Determine how many bytes we need to put in the next chunk.
-	// This will be either the CHUNK_SIZE constant or the number of bytes left
-	// to send in the array, whichever is smaller.
-	size_t num_bytes_remaining = file_length - curr_loc;
-	size_t bytes_in_chunk = std::min(num_bytes_remaining, CHUNK_SIZE);
-    // read data as a block:
+std::string ArraySender::peek(size_t max_bytes) const {
+	return array->substr(curr_loc, max_bytes);
+}
+
+FileSender::FileSender(fs::path song_path, off_t start_offset) {
+	this->fd = open(song_path.c_str(), O_RDONLY);
+	this->file_length = 0;
+	this->curr_loc = start_offset;
+
+	struct stat file_info;
+	if (this->fd < 0 || fstat(this->fd, &file_info) < 0) {
+		// Nothing to send, so send_next_chunk will just report we're done.
+		perror("FileSender open");
+		return;
+	}
+	this->file_length = file_info.st_size;
+	this->curr_loc = std::min(this->curr_loc, this->file_length);
+
+	// Songs are streamed front to back, so let the kernel read ahead
+	// aggressively.
+	posix_fadvise(this->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+FileSender::~FileSender() {
+	if (this->fd >= 0) {
+		close(this->fd);
+	}
+}
+
+FileSender::FileSender(FileSender &&other) :
+	fd(other.fd), file_length(other.file_length), curr_loc(other.curr_loc) {
+	other.fd = -1;
+}
+
+FileSender &FileSender::operator=(FileSender &&other) {
+	if (this != &other) {
+		if (this->fd >= 0) {
+			close(this->fd);
+		}
+		this->fd = other.fd;
+		this->file_length = other.file_length;
+		this->curr_loc = other.curr_loc;
+		other.fd = -1;
+	}
+	return *this;
+}
 
-	if (bytes_in_chunk > 0) {
-		// Create the chunk and copy the data over from the appropriate
-		// location in the array
-		char *chunk = new char [bytes_in_chunk];
+std::string FileSender::peek(size_t max_bytes) const {
+	std::string data(std::min(remaining(), max_bytes), '\0');
+	size_t length = 0;
+	while (length < data.size()) {
+		ssize_t num_read = pread(fd, &data[length], data.size() - length,
+				curr_loc + length);
+		if (num_read <= 0) {
+			break; // the file got shorter (or went away)
+		}
+		length += num_read;
+	}
+	data.resize(length);
+	return data;
+}
+
+ssize_t FileSender::send_next_chunk(int sock_fd, size_t max_bytes,
+		const char *header, size_t header_length) {
+	if (header_length > 0) {
+		// sendfile can't take a header along with it, so send the header
+		// on its own, telling the kernel more is coming right behind it so
+		// the two still go out together.
+		int flags = (curr_loc < file_length && max_bytes > 0) ? MSG_MORE : 0;
+		ssize_t num_bytes_sent = send(sock_fd, header, header_length, flags);
+		if (num_bytes_sent < 0) {
+			if (errno == EAGAIN || errno == EPIPE || errno == ECONNRESET) {
+				return -1;
+			}
+			return hang_up(sock_fd, "send_next_chunk send");
+		}
+		else if ((size_t)num_bytes_sent < header_length) {
+			return num_bytes_sent;
+		}
 
-		(*indata).read(chunk, bytes_in_chunk);
+		ssize_t file_bytes_sent = send_next_chunk(sock_fd, max_bytes);
+		return header_length + std::max(file_bytes_sent, (ssize_t)0);
+	}
+
+	// sendfile doesn't need a buffer, so offer the socket everything that is
+	// left (up to max_bytes) and let it take what fits.
+	size_t num_bytes_remaining = file_length - curr_loc;
 
-		ssize_t num_bytes_sent = send(sock_fd, chunk, bytes_in_chunk, 0);
+	if (num_bytes_remaining > 0 && max_bytes > 0) {
+		// sendfile updates curr_loc by however many bytes it actually sent,
+		// so a partial send leaves us at exactly the right spot.
+		ssize_t num_bytes_sent = sendfile(sock_fd, fd, &curr_loc,
+									std::min(num_bytes_remaining, max_bytes));
 
-		delete[] chunk;
 		if (num_bytes_sent > 0) {
-			// We successfully send some of the data so update our location in
-			// the array so we know where to start sending the next time we
-			// call this function.
-			curr_loc += num_bytes_sent;
 			return num_bytes_sent;
 		}
 		else if (num_bytes_sent < 0 && errno == EAGAIN) {
 			// We couldn't send anything because the buffer was full
 			return -1;
 		}
+		else if (num_bytes_sent < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+			// The client hung up on us. Treat it like a full buffer; epoll
+			// will report the error and the event loop will close the client.
+			return -1;
+		}
+		else if (num_bytes_sent == 0) {
+			// The file got shorter since we opened it, so there is nothing
+			// more to send.
+			curr_loc = file_length;
+			return 0;
+		}
 		else {
-			// Send had an error which we didn't expect, so exit the program.
-			perror("send_next_chunk send");
-			exit(EXIT_FAILURE);
+			return hang_up(sock_fd, "send_next_chunk sendfile");
 		}
 	}
 	else {
 		return 0;
 	}
 }
+
+MappedSender::MappedSender(std::shared_ptr<const MappedSong> mapped_song,
+		size_t start_offset) :
+	song(mapped_song), curr_loc(std::min(start_offset, mapped_song->length)) {}
+
+size_t MappedSender::remaining() const {
+	return song->length - curr_loc;
+}
+
+std::string MappedSender::peek(size_t max_bytes) const {
+	std::string data(std::min(remaining(), max_bytes), '\0');
+	data.resize(song->read(curr_loc, &data[0], data.size()));
+	return data;
+}
+
+ssize_t MappedSender::send_next_chunk(int sock_fd, size_t max_bytes,
+		const char *header, size_t header_length) {
+	// The pages are already in memory (or will be faulted in by the kernel),
+	// so offer the socket everything that's left, up to max_bytes.
+	size_t num_bytes_remaining = song->length - curr_loc;
+	ssize_t num_bytes_sent = send_buffers(sock_fd, header, header_length,
+			song->data + curr_loc,
+			std::min(num_bytes_remaining, max_bytes));
+
+	if (num_bytes_sent > (ssize_t)header_length) {
+		curr_loc += num_bytes_sent - header_length;
+	}
+	else if (num_bytes_sent == 0) {
+		// The file was truncated, so the rest of the song can't be sent.
+		curr_loc = song->length;
+	}
+	return num_bytes_sent;
+}
+
+ssize_t send_next_chunk(ChunkedDataSender &sender, int sock_fd,
+		size_t max_bytes, const char *header, size_t header_length) {
+	if (ArraySender *array_sender = std::get_if<ArraySender>(&sender)) {
+		return array_sender->send_next_chunk(sock_fd, max_bytes, header,
+				header_length);
+	}
+	else if (FileSender *file_sender = std::get_if<FileSender>(&sender)) {
+		return file_sender->send_next_chunk(sock_fd, max_bytes, header,
+				header_length);
+	}
+	else if (MappedSender *mapped_sender = std::get_if<MappedSender>(&sender)) {
+		return mapped_sender->send_next_chunk(sock_fd, max_bytes, header,
+				header_length);
+	}
+	// Nothing to send but the header (if there is one)
+	return send_buffers(sock_fd, header, header_length, NULL, 0);
+}
+
+size_t bytes_remaining(const ChunkedDataSender &sender) {
+	if (const ArraySender *array_sender = std::get_if<ArraySender>(&sender)) {
+		return array_sender->remaining();
+	}
+	else if (const FileSender *file_sender = std::get_if<FileSender>(&sender)) {
+		return file_sender->remaining();
+	}
+	else if (const MappedSender *mapped_sender = std::get_if<MappedSender>(&sender)) {
+		return mapped_sender->remaining();
+	}
+	return 0;
+}
+
+std::string peek_bytes(const ChunkedDataSender &sender, size_t max_bytes) {
+	if (const ArraySender *array_sender = std::get_if<ArraySender>(&sender)) {
+		return array_sender->peek(max_bytes);
+	}
+	else if (const FileSender *file_sender = std::get_if<FileSender>(&sender)) {
+		return file_sender->peek(max_bytes);
+	}
+	else if (const MappedSender *mapped_sender = std::get_if<MappedSender>(&sender)) {
+		return mapped_sender->peek(max_bytes);
+	}
+	return std::string();
+}
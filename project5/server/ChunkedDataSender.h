@@ -2,89 +2,242 @@
 #define CHUNKEDDATASENDER_H
 
 #include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <variant>
 
-using std::ifstream;
+#include <sys/types.h>
 
 namespace fs = std::filesystem;
 
-const size_t CHUNK_SIZE = 4096;
+class MappedSong;
 
-/**
- * An interface for sending data in fixed-sized chunks over a network socket.
- * This interface contains one function, send_next_chunk, which should send
- * the next chunk of data.
- */
-class ChunkedDataSender {
-  public:
-	virtual ~ChunkedDataSender() {}
-
-	virtual ssize_t send_next_chunk(int sock_fd) = 0;
-};
+// Pass as max_bytes to send_next_chunk to send as much as the socket takes.
+const size_t NO_LIMIT = SIZE_MAX;
 
 /**
- * Class that allows sending an array of over a network socket.
+ * Class that allows sending an array of over a network socket. The array is
+ * shared, so the same prebuilt reply can go out to any number of clients
+ * without being copied.
  */
-class ArraySender : public virtual ChunkedDataSender {
+class ArraySender {
   private:
-	char *array; // the array of data to send
-	size_t array_length; // length of the array to send (in bytes)
+	std::shared_ptr<const std::string> array; // the array of data to send
 	size_t curr_loc; // index in array where next send will start
 
   public:
 	/**
 	 * Constructor for ArraySender class.
+	 *
+	 * @param array_to_send The data to send.
 	 */
-	ArraySender(const char *array_to_send, size_t length);
+	ArraySender(std::shared_ptr<const std::string> array_to_send) :
+		array(std::move(array_to_send)), curr_loc(0) {}
 
 	/**
-	 * Destructor for ArraySender class.
+	 * @return Number of bytes left to send.
 	 */
-	~ArraySender() {
-		delete[] array;
-	}
+	size_t remaining() const { return array->size() - curr_loc; }
+
+	/**
+	 * @param max_bytes Most bytes to copy.
+	 * @return Copy of the next bytes to send, without sending them.
+	 */
+	std::string peek(size_t max_bytes) const;
 
 	/**
 	 * Sends the next chunk of data, starting at the spot in the array right
 	 * after the last chunk we sent.
 	 *
 	 * @param sock_fd Socket which to send the data over.
+	 * @param max_bytes Most bytes of the array to send in this call.
+	 * @param header Bytes (e.g. a frame header) to send ahead of the chunk in
+	 * 	the same writev, or NULL.
+	 * @param header_length Number of bytes in header.
 	 * @return -1 if we couldn't send because of a full socket buffer,
-	 * 	otherwise the number of bytes actually sent over the socket.
+	 * 	otherwise the number of bytes actually sent over the socket
+	 * 	(counting the header).
 	 */
-	virtual ssize_t send_next_chunk(int sock_fd);
+	ssize_t send_next_chunk(int sock_fd, size_t max_bytes,
+			const char *header = NULL, size_t header_length = 0);
 };
 
 
-class FileSender : public virtual ChunkedDataSender {
+/**
+ * Class that allows sending a file over a network socket. The file is sent
+ * with sendfile, so the kernel copies it straight from the page cache into
+ * the socket without it passing through our memory.
+ */
+class FileSender {
   private:
-	
-	ifstream *indata;
-	int file_length;
-	int curr_loc;
+	int fd; // the open file, or -1 if it couldn't be opened
+	off_t file_length; // length of the file (in bytes)
+	off_t curr_loc; // offset in the file where the next send will start
 
   public:
 
 	/**
-	 * Constructor for ArraySender class.
+	 * Constructor for FileSender class.
+	 *
+	 * @param song_path Path of the file to send.
+	 * @param start_offset Offset in the file to start sending from.
 	 */
-	FileSender(fs::path song_path);
+	FileSender(fs::path song_path, off_t start_offset = 0);
+
+	/**
+	 * Destructor for FileSender class.
+	 */
+	~FileSender();
+
+	FileSender(const FileSender &) = delete;
+	FileSender &operator=(const FileSender &) = delete;
 
 	/**
-	 * Destructor for ArraySender class.
+	 * Moving a FileSender hands over its open file.
 	 */
-	~FileSender() {
-		(*indata).close();
+	FileSender(FileSender &&other);
+	FileSender &operator=(FileSender &&other);
+
+	/**
+	 * @return Number of bytes left to send.
+	 */
+	size_t remaining() const { return file_length - curr_loc; }
+
+	/**
+	 * @return Offset in the file where the next send will start.
+	 */
+	size_t position() const { return curr_loc; }
+
+	/**
+	 * @param max_bytes Most bytes to copy.
+	 * @return Copy of the next bytes to send, without sending them.
+	 */
+	std::string peek(size_t max_bytes) const;
+
+	/**
+	 * Sends as much of the rest of the file as the socket will take,
+	 * starting right after the last byte we sent.
+	 *
+	 * @param sock_fd Socket which to send the data over.
+	 * @param max_bytes Most bytes of the song to send in this call.
+	 * @param header Bytes to send ahead of the chunk, or NULL.
+	 * @param header_length Number of bytes in header.
+	 * @return -1 if we couldn't send because of a full socket buffer,
+	 * 	otherwise the number of bytes actually sent over the socket
+	 * 	(counting the header).
+	 */
+	ssize_t send_next_chunk(int sock_fd, size_t max_bytes,
+			const char *header = NULL, size_t header_length = 0);
+};
+
+/**
+ * Class that allows sending a song from the shared SongCache. Every client
+ * playing the same song sends from the same mapped pages.
+ */
+class MappedSender {
+  private:
+	std::shared_ptr<const MappedSong> song; // keeps the mapping alive
+	size_t curr_loc; // offset in the song where the next send will start
+
+  public:
+	/**
+	 * Constructor for MappedSender class.
+	 *
+	 * @param mapped_song The song to send, from SongCache::acquire.
+	 * @param start_offset Offset in the song to start sending from.
+	 */
+	MappedSender(std::shared_ptr<const MappedSong> mapped_song,
+			size_t start_offset = 0);
+
+	/**
+	 * @return Number of bytes left to send.
+	 */
+	size_t remaining() const;
+
+	/**
+	 * @return Offset in the song where the next send will start.
+	 */
+	size_t position() const { return curr_loc; }
+
+	/**
+	 * @param max_bytes Most bytes to copy.
+	 * @return Copy of the next bytes to send, without sending them.
+	 */
+	std::string peek(size_t max_bytes) const;
+
+	/**
+	 * @return The song being sent.
+	 */
+	const std::shared_ptr<const MappedSong> &mapped_song() const {
+		return song;
 	}
 
 	/**
-	 * Sends the next chunk of data, starting at the spot in the array right
-	 * after the last chunk we sent.
+	 * Sends as much of the rest of the song as the socket will take,
+	 * starting right after the last byte we sent.
 	 *
 	 * @param sock_fd Socket which to send the data over.
+	 * @param max_bytes Most bytes of the song to send in this call.
+	 * @param header Bytes to send ahead of the chunk, or NULL.
+	 * @param header_length Number of bytes in header.
 	 * @return -1 if we couldn't send because of a full socket buffer,
-	 * 	otherwise the number of bytes actually sent over the socket.
+	 * 	otherwise the number of bytes actually sent over the socket
+	 * 	(counting the header).
 	 */
-	virtual ssize_t send_next_chunk(int sock_fd);
+	ssize_t send_next_chunk(int sock_fd, size_t max_bytes,
+			const char *header = NULL, size_t header_length = 0);
 };
 
+/**
+ * Something for a client to send in chunks over a network
+ * socket: one of the senders above, or std::monostate when there is nothing
+ * to send.
+ *
+ * Clients hold this inline rather than pointing to a sender on the heap, so
+ * starting a response doesn't allocate and sending a chunk doesn't go
+ * through a virtual call.
+ */
+typedef std::variant<std::monostate, ArraySender, FileSender, MappedSender>
+	ChunkedDataSender;
+
+/**
+ * Sends the next chunk of whatever the sender holds, optionally with a header
+ * in front of it. Senders with the data in memory send the header and the
+ * chunk with one writev.
+ *
+ * Chunks aren't a fixed size: the caller picks max_bytes (e.g. from how much
+ * room is left in the socket buffer) and the socket takes what fits. A short
+ * send means the buffer is full, so there's no need to try again until epoll
+ * says there's room.
+ *
+ * @param sender The sender to send from.
+ * @param sock_fd Socket which to send the data over.
+ * @param max_bytes Most bytes of the sender's data to send in this call.
+ * @param header Bytes to send ahead of the chunk, or NULL.
+ * @param header_length Number of bytes in header.
+ * @return -1 if we couldn't send because of a full socket buffer, otherwise
+ * 	the number of bytes actually sent over the socket, counting the header
+ * 	(0 once there is nothing left).
+ */
+ssize_t send_next_chunk(ChunkedDataSender &sender, int sock_fd,
+		size_t max_bytes, const char *header = NULL, size_t header_length = 0);
+
+/**
+ * @param sender The sender to check.
+ * @return Number of bytes the sender has left to send.
+ */
+size_t bytes_remaining(const ChunkedDataSender &sender);
+
+/**
+ * Copies out the next bytes a sender would send, without sending them (e.g.
+ * to hand a half-sent reply over to another process).
+ *
+ * @param sender The sender to copy from.
+ * @param max_bytes Most bytes to copy.
+ * @return Up to max_bytes of what the sender has left to send.
+ */
+std::string peek_bytes(const ChunkedDataSender &sender, size_t max_bytes);
+
 #endif // CHUNKEDDATASENDER_H
@@ -0,0 +1,41 @@
+#include <algorithm>
+
+#include "ClientSlab.h"
+
+ClientSlab::ClientSlab(size_t initial_size) : slots(initial_size) {}
+
+ConnectedClient &ClientSlab::add(int fd, TimerWheel *timers,
+		SendScheduler *scheduler, IoCompletions *completions,
+		LoopStats *stats, IoUring *ring) {
+	if ((size_t)fd >= slots.size()) {
+		slots.resize(std::max((size_t)fd + 1, slots.size() * 2));
+	}
+
+	Slot &slot = slots[fd];
+	slot.generation++;
+	slot.client = ConnectedClient(fd, slot.generation, RECEIVING, timers,
+			scheduler, completions, stats, ring);
+	return slot.client;
+}
+
+ConnectedClient *ClientSlab::find(uint64_t epoll_key) {
+	ConnectedClient *client = find_fd((int)(uint32_t)epoll_key);
+	if (client == NULL || client->generation != (uint32_t)(epoll_key >> 32)) {
+		return NULL;
+	}
+	return client;
+}
+
+ConnectedClient *ClientSlab::find_fd(int fd) {
+	if (fd < 0 || (size_t)fd >= slots.size() || slots[fd].client.client_fd < 0) {
+		return NULL;
+	}
+	return &slots[fd].client;
+}
+
+void ClientSlab::remove(int fd) {
+	if (fd >= 0 && (size_t)fd < slots.size()) {
+		// Resetting the client also closes whatever it was sending.
+		slots[fd].client = ConnectedClient();
+	}
+}
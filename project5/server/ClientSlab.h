@@ -0,0 +1,92 @@
+#ifndef CLIENTSLAB_H
+#define CLIENTSLAB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ConnectedClient.h"
+
+/**
+ * Holds the clients of one event loop in a flat array indexed by their file
+ * descriptor, so finding the client for an event is a bounds check and an
+ * array index rather than a walk down a tree.
+ *
+ * Since the OS hands out the lowest free fd, a closed client's fd is soon
+ * reused. Each slot therefore counts how many clients it has held, and that
+ * generation goes in the epoll data alongside the fd; an event left over
+ * from an earlier client (e.g. later in the same batch of events that closed
+ * it) won't match and is dropped.
+ */
+class ClientSlab {
+  private:
+	struct Slot {
+		uint32_t generation = 0; // bumped every time the slot gets a new client
+		ConnectedClient client; // client_fd is -1 while the slot is free
+	};
+
+	std::vector<Slot> slots;
+
+  public:
+	/**
+	 * Constructor for ClientSlab class.
+	 *
+	 * @param initial_size Number of slots to start with (it grows to fit
+	 * 	whatever fds it is given).
+	 */
+	ClientSlab(size_t initial_size = 1024);
+
+	/**
+	 * Sets up a new client in the slot for its fd.
+	 *
+	 * @param fd The client's socket.
+	 * @param timers The timers of the event loop the client belongs to.
+	 * @param scheduler The send scheduler of that event loop.
+	 * @param completions Where that event loop gets its song loads.
+	 * @param stats That event loop's counters.
+	 * @param ring That event loop's io_uring, or NULL if it uses epoll.
+	 * @return The new client.
+	 */
+	ConnectedClient &add(int fd, TimerWheel *timers, SendScheduler *scheduler,
+			IoCompletions *completions, LoopStats *stats, IoUring *ring);
+
+	/**
+	 * Finds the client an epoll event is for.
+	 *
+	 * @param epoll_key The data.u64 of the event (see
+	 * 	ConnectedClient::epoll_key).
+	 * @return The client, or NULL if it has since been closed.
+	 */
+	ConnectedClient *find(uint64_t epoll_key);
+
+	/**
+	 * Finds the client currently using an fd.
+	 *
+	 * @param fd The client's socket.
+	 * @return The client, or NULL if there isn't one.
+	 */
+	ConnectedClient *find_fd(int fd);
+
+	/**
+	 * Frees the slot of a client that has been closed.
+	 *
+	 * @param fd The client's socket.
+	 */
+	void remove(int fd);
+
+	/**
+	 * Calls visit with every client in the slab.
+	 *
+	 * @param visit Function taking a ConnectedClient &.
+	 */
+	template <typename Visit>
+	void for_each(Visit visit) {
+		for (Slot &slot : slots) {
+			if (slot.client.client_fd >= 0) {
+				visit(slot.client);
+			}
+		}
+	}
+};
+
+#endif // CLIENTSLAB_H
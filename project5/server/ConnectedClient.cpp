@@ -1,18 +1,28 @@
+#include <algorithm>
 #include <iostream>
 
+#include <cstdio>
 #include <cstring>
 
 #include <unistd.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <linux/sockios.h>
 
 #include <vector>
 #include <filesystem>
 #include <fstream>
+#include <random>
+#include <sstream>
 #include <string>
 #include "ChunkedDataSender.h"
 #include "ConnectedClient.h"
+#include "Handover.h"
+#include "SongCache.h"
+#include "Mp3.h"
 
 using std::cout;
 using std::cerr;
@@ -21,248 +31,1354 @@ using std::string;
 using std::vector;
 namespace fs = std::filesystem;
 
-ConnectedClient::ConnectedClient(int fd, ClientState initial_state) :
-	client_fd(fd), sender(NULL), state(initial_state) {}
+// Paced mode is off unless turned on with -p
+bool ConnectedClient::pacing_enabled = false;
+double ConnectedClient::pace_lead_seconds = 0;
+
+// Leave send buffers to the kernel unless -b is given
+int ConnectedClient::send_buffer_request = 0;
+bool ConnectedClient::edge_triggered = false;
+
+// Defaults for -I and -W
+uint64_t ConnectedClient::idle_timeout_ms = 300 * 1000;
+uint64_t ConnectedClient::stall_timeout_ms = 30 * 1000;
+
+// Don't bother waking up to send less than this much of a paced song...
+const size_t PACE_MIN_SEND = 4096;
+// ...and when we do pause, wait until we can send this much audio.
+const double PACE_QUANTUM_SECONDS = 0.25;
+
+// Shortest audio frame we send in a session (unless the song or the pace
+// allowance runs out first). Frames are otherwise sized to the free space in
+// the socket buffer: nothing else can be sent until a frame is done, so a
+// frame that doesn't fit makes replies and stops wait behind it.
+const size_t AUDIO_FRAME_MIN = 16 * 1024;
+
+// How often to check whether the kernel has grown a client's send buffer
+const uint64_t SEND_BUFFER_RECHECK_MS = 100;
+
+// Most frames a session can have waiting to go out. Replies are small, so a
+// client only gets here by sending commands without reading the replies.
+const size_t MAX_QUEUED_FRAMES = 256;
+
+// Most songs a search replies with, and most bytes of each line, so a reply
+// is small however many songs match.
+const size_t MAX_SEARCH_RESULTS = 20;
+const size_t MAX_SEARCH_LINE_BYTES = 200;
+
+// Most bytes of commands we'll hold on to that we aren't ready to run yet:
+// one command as big as writeUTF can send. Outside a session commands wait
+// until the reply before them has gone out, and with io_uring we always
+// have a recv going, so a client that pipelines commands without reading
+// the replies would otherwise have us buffer all of them.
+const size_t MAX_INBUF_BYTES = 2 + 65535;
+
+std::map<string, ResumePoint> ConnectedClient::resume_points;
+std::mutex ConnectedClient::resume_lock;
+
+ConnectedClient::ConnectedClient(int fd, uint32_t fd_generation,
+		ClientState initial_state, TimerWheel *loop_timers,
+		SendScheduler *loop_scheduler, IoCompletions *loop_completions,
+		LoopStats *loop_stats, IoUring *loop_ring) :
+	client_fd(fd), generation(fd_generation), sender(), state(initial_state),
+	watched_events(EPOLLIN | EPOLLRDHUP | (edge_triggered ? (uint32_t)EPOLLET : 0)),
+	send_buffer(0),
+	send_buffer_checked_ms(0), timers(loop_timers), scheduler(loop_scheduler),
+	send_deficit(0), completions(loop_completions), stats(loop_stats), ring(loop_ring),
+	pace(), session(),
+	radio(), song_offset(0),
+	song_start_seconds(0), song_start_ms(0), load_token(0), loading(),
+	loads_started(0), readahead_end(0), play_queue(), prefetch_token(0), prefetched(),
+	info_token(0), info_song(0),
+	last_active_ms(monotonic_ms()), last_sent_ms(last_active_ms),
+	watchdog_token(0), watchdog_ms(0),
+	running_commands(false) {
+	if (send_buffer_request > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+				&send_buffer_request, sizeof(send_buffer_request)) < 0) {
+		perror("setsockopt SO_SNDBUF");
+	}
+	socklen_t size_length = sizeof(this->send_buffer);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &this->send_buffer,
+				&size_length) < 0) {
+		this->send_buffer = 0;
+	}
+	this->send_buffer_checked_ms = monotonic_ms();
+	this->stats->client_moved(-1, initial_state);
+
+	// Clients start out idle, so the first thing to watch for is one that
+	// never sends a command.
+	if (idle_timeout_ms > 0) {
+		arm_watchdog(this->last_active_ms + idle_timeout_ms);
+	}
+}
+
+size_t ConnectedClient::send_space() {
+	int queued = 0;
+	if (ioctl(this->client_fd, SIOCOUTQ, &queued) < 0) {
+		return 0;
+	}
+
+	uint64_t now = monotonic_ms();
+	if (send_buffer_request == 0
+			&& now - this->send_buffer_checked_ms >= SEND_BUFFER_RECHECK_MS) {
+		// Autotuning may have grown the buffer since we last looked.
+		socklen_t size_length = sizeof(this->send_buffer);
+		getsockopt(this->client_fd, SOL_SOCKET, SO_SNDBUF, &this->send_buffer,
+				&size_length);
+		this->send_buffer_checked_ms = now;
+	}
+
+	// SO_SNDBUF also covers the kernel's bookkeeping, so this is a bit on
+	// the high side. That's fine: the socket just takes less than we offer
+	// and the rest of the frame goes once there's room.
+	return std::max(this->send_buffer - queued, 0);
+}
+
+size_t ConnectedClient::pace_allowance() {
+	if (!this->pace.active) {
+		return NO_LIMIT;
+	}
+
+	double elapsed = (monotonic_ms() - this->pace.start_ms) / 1000.0;
+	double allowed = this->pace.lead_bytes + this->pace.byte_rate * elapsed
+		- this->pace.bytes_sent;
+	if (allowed < PACE_MIN_SEND) {
+		return 0;
+	}
+	return (size_t)allowed;
+}
+
+void ConnectedClient::set_current_song(const fs::path &song) {
+	ServerStats::instance().song_changed(this->current_song, song);
+	this->current_song = song;
+}
+
+void ConnectedClient::set_state(int epoll_fd, ClientState new_state) {
+	// Always watch for the client hanging up, and for room in the socket
+	// buffer when we're blocked on it (but not while waiting for a timer or
+	// our turn). Outside of a session we only read the next command once
+	// we're done with the last one.
+	uint32_t events = EPOLLRDHUP;
+	if (new_state == SENDING) {
+		events |= EPOLLOUT;
+		LoopStats::add(this->stats->send_stalls, (uint64_t)1);
+	}
+	if (new_state == RECEIVING || this->session.active) {
+		events |= EPOLLIN;
+	}
+	if (edge_triggered) {
+		events |= EPOLLET;
+	}
+	if (new_state == SENDING && this->state == RECEIVING) {
+		// We've only just had something to send, so it can't have stalled
+		// for longer than this.
+		this->last_sent_ms = monotonic_ms();
+	}
+	this->stats->client_moved(this->state, new_state);
+	this->state = new_state;
+
+	// Make sure the watchdog goes off in time to catch this send stalling,
+	// or the client going idle. It's usually set early enough already.
+	uint64_t limit = new_state == SENDING ? stall_timeout_ms
+		: new_state == RECEIVING ? idle_timeout_ms : 0;
+	uint64_t deadline = (new_state == SENDING ? this->last_sent_ms
+			: this->last_active_ms) + limit;
+	if (limit > 0 && (this->watchdog_ms == 0 || this->watchdog_ms > deadline)) {
+		arm_watchdog(deadline);
+	}
+
+	if (this->ring != NULL) {
+		// The ring always has a recv going on the socket, so all there is
+		// to watch for is room in the socket buffer, and only until the
+		// poll for it goes off.
+		if (new_state == SENDING && (this->watched_events & EPOLLOUT) == 0) {
+			this->ring->poll(this->client_fd, POLLOUT,
+					ring_key(WRITABLE_OP, epoll_key()), false);
+			this->watched_events |= EPOLLOUT;
+		}
+		return;
+	}
+
+	// A bulk transfer goes back and forth between SENDING, QUEUED and
+	// PAUSED a lot, and most of those switches watch for the same events.
+	if (events == this->watched_events) {
+		return;
+	}
+
+	struct epoll_event client_ev;
+	memset(&client_ev, 0, sizeof(client_ev));
+	client_ev.data.u64 = epoll_key();
+	client_ev.events = events;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, this->client_fd, &client_ev) == -1){
+		perror("Error updating epoll for new client state");
+		exit(1);
+	}
+	this->watched_events = events;
+}
+
+void ConnectedClient::wait_for_turn(int epoll_fd) {
+	set_state(epoll_fd, QUEUED);
+	this->scheduler->add(epoll_key());
+}
+
+void ConnectedClient::take_turn(int epoll_fd) {
+	if (this->state != QUEUED) {
+		return; // the response was stopped while we were in line
+	}
+	// PAUSED watches for the same events as QUEUED, so this doesn't touch
+	// epoll; continue_response will work out where to go from here.
+	set_state(epoll_fd, PAUSED);
+	continue_response(epoll_fd);
+}
+
+void ConnectedClient::pause_sending(int epoll_fd) {
+	// Nothing to send until the timer goes off.
+	set_state(epoll_fd, PAUSED);
+
+	// Wake up once playback has caught up enough for a decent sized send.
+	double quantum = std::max(this->pace.byte_rate * PACE_QUANTUM_SECONDS,
+								(double)PACE_MIN_SEND);
+	double elapsed = (monotonic_ms() - this->pace.start_ms) / 1000.0;
+	double allowed = this->pace.lead_bytes + this->pace.byte_rate * elapsed
+		- this->pace.bytes_sent;
+	uint64_t delay_ms = (uint64_t)((quantum - allowed) * 1000 / this->pace.byte_rate);
+
+	this->pace.timer_token = this->timers->new_token();
+	Timer t;
+	t.fd = this->client_fd;
+	t.kind = PACE_TIMER;
+	t.token = this->pace.timer_token;
+	t.expires_ms = monotonic_ms() + delay_ms;
+	this->timers->schedule(t);
+}
+
+void ConnectedClient::wait_for_broadcast(int epoll_fd) {
+	set_state(epoll_fd, PAUSED);
+
+	this->radio.timer_token = this->timers->new_token();
+	Timer t;
+	t.fd = this->client_fd;
+	t.kind = RADIO_TIMER;
+	t.token = this->radio.timer_token;
+	t.expires_ms = std::max(this->radio.channel->next_chunk_ms(), monotonic_ms());
+	this->timers->schedule(t);
+}
+
+bool ConnectedClient::next_radio_chunk() {
+	std::shared_ptr<const string> chunk =
+		this->radio.channel->chunk(this->radio.next_seq);
+	if (!chunk) {
+		return false;
+	}
+	this->radio.next_seq++;
+	this->sender.emplace<ArraySender>(std::move(chunk));
+	return true;
+}
+
+void ConnectedClient::arm_watchdog(uint64_t when_ms) {
+	this->watchdog_token = this->timers->new_token();
+	this->watchdog_ms = when_ms;
+	Timer t;
+	t.fd = this->client_fd;
+	t.kind = WATCHDOG_TIMER;
+	t.token = this->watchdog_token;
+	t.expires_ms = when_ms;
+	this->timers->schedule(t);
+}
+
+void ConnectedClient::hang_up() {
+	// With a zero linger, close sends a reset and throws away whatever the
+	// client never read, instead of holding on to it until the client
+	// takes it (which it may never do).
+	struct linger no_linger;
+	no_linger.l_onoff = 1;
+	no_linger.l_linger = 0;
+	setsockopt(this->client_fd, SOL_SOCKET, SO_LINGER, &no_linger,
+			sizeof(no_linger));
+	shutdown(this->client_fd, SHUT_RDWR);
+}
+
+void ConnectedClient::handle_timer(int epoll_fd, const Timer &timer) {
+	if (timer.kind == WATCHDOG_TIMER) {
+		if (timer.token != this->watchdog_token) {
+			return;
+		}
+
+		// Only a client with nothing on the go can be idle, and only one
+		// we're blocked on can be stalled. For others (e.g. paced or waiting
+		// on a load) set_state puts the watchdog back once that changes.
+		// A stall is timed from the last time we got anything out to the
+		// client, so one that keeps sending us bytes but never reads
+		// still gets hung up on.
+		uint64_t limit = 0;
+		uint64_t since = this->last_active_ms;
+		if (this->state == SENDING) {
+			limit = stall_timeout_ms;
+			since = this->last_sent_ms;
+		}
+		else if (this->state == RECEIVING && this->load_token == 0) {
+			limit = idle_timeout_ms;
+		}
+
+		uint64_t now = monotonic_ms();
+		if (limit > 0 && now >= since + limit) {
+			hang_up();
+		}
+		else if (limit > 0) {
+			arm_watchdog(since + limit);
+		}
+		else {
+			this->watchdog_ms = 0;
+		}
+		return;
+	}
+
+	if (this->state != PAUSED) {
+		return;
+	}
+	if ((timer.kind == PACE_TIMER && timer.token == this->pace.timer_token)
+			|| (timer.kind == RADIO_TIMER && this->radio.channel != NULL
+				&& timer.token == this->radio.timer_token)) {
+		continue_response(epoll_fd);
+	}
+}
 
 void ConnectedClient::continue_response(int epoll_fd) {
-	// Create a large array, just to make sure we can send a lot of data in
-	// smaller chunks.
-	ssize_t num_bytes_sent;
+	if (this->state == QUEUED) {
+		return; // we'll get to it on our next turn
+	}
+	read_ahead();
+
+	// Don't hog the event loop: send at most one quantum (plus whatever we
+	// were owed from last time), then let everyone else have a turn.
+	size_t turn_bytes = SendScheduler::QUANTUM + this->send_deficit;
+	size_t budget = turn_bytes;
+	if (this->session.active) {
+		continue_session(epoll_fd, budget);
+		this->send_deficit = this->state == SENDING
+			? std::min(budget, SendScheduler::QUANTUM) : 0;
+		if (budget < turn_bytes) {
+			this->last_active_ms = monotonic_ms();
+			this->last_sent_ms = this->last_active_ms;
+			LoopStats::add(this->stats->bytes_sent,
+					(uint64_t)(turn_bytes - budget));
+		}
+		return;
+	}
+
+	ssize_t num_bytes_sent = 0;
 	ssize_t total_bytes_sent = 0;
+	size_t allowance;
 
 	// keep sending the next chunk until it says we either didn't send
-	// anything (0 return indicates nothing left to send) or until we can't
-	// send anymore because of a full socket buffer (-1 return value)
-	while((num_bytes_sent = this->sender->send_next_chunk(this->client_fd)) > 0) {
+	// anything (0 return indicates nothing left to send), we can't send
+	// anymore because of a full socket buffer (-1 return value, or a short
+	// send), a paced song has gotten far enough ahead of playback, or we've
+	// used up our turn
+	while(budget > 0 && (allowance = pace_allowance()) > 0) {
+		size_t wanted = std::min({allowance, budget,
+				bytes_remaining(this->sender)});
+		if (wanted == 0 && this->radio.channel != NULL && next_radio_chunk()) {
+			continue; // the radio never runs out, it goes on to the next chunk
+		}
+		if (wanted == 0 && !this->play_queue.empty()) {
+			if (next_queued_song()) {
+				continue; // straight on to the next song in the queue
+			}
+			break; // it's still loading
+		}
+		num_bytes_sent = send_next_chunk(this->sender, this->client_fd,
+				wanted);
+		if (num_bytes_sent <= 0) {
+			break;
+		}
 		total_bytes_sent += num_bytes_sent;
+		budget -= num_bytes_sent;
+		this->pace.bytes_sent += num_bytes_sent;
+
+		if ((size_t)num_bytes_sent < wanted) {
+			// The socket took less than we offered, so its buffer is full.
+			// Trying again now would only get EAGAIN.
+			num_bytes_sent = -1;
+			break;
+		}
+	}
+
+	if (total_bytes_sent > 0) {
+		this->last_active_ms = monotonic_ms();
+		this->last_sent_ms = this->last_active_ms;
+		LoopStats::add(this->stats->bytes_sent, (uint64_t)total_bytes_sent);
 	}
 
-	/*
-	 * 1. update our state field to be sending
-	 * 2. set our sender field to be the ArraySender object we created
-	 * 3. update epoll so that it also watches for EPOLLOUT for this client
-	 *    socket (use epoll_ctl with EPOLL_CTL_MOD).
-	 */
-	if (num_bytes_sent >= 0) {
-		// Sent everything with no problem so we are done with our ArraySender
-		// object.
-		struct epoll_event client_ev;
-		client_ev.data.fd = this->client_fd;
-		client_ev.events = EPOLLOUT;
+	// The rest of the turn is owed to us if the socket filled up before we
+	// could use it, but not if we stopped for any other reason.
+	bool socket_full = budget > 0 && allowance > 0 && num_bytes_sent < 0;
+	this->send_deficit = socket_full
+		? std::min(budget, SendScheduler::QUANTUM) : 0;
 
-		if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, this->client_fd, &client_ev) == -1){
-			perror("Error updating epoll to watch for EPOLLOUT");
-			exit(1);	
+	if (budget == 0) {
+		wait_for_turn(epoll_fd);
+	}
+	else if (allowance == 0) {
+		pause_sending(epoll_fd);
+	}
+	else if (num_bytes_sent < 0) {
+		// The socket buffer is full, so watch for EPOLLOUT to know when we
+		// can continue (if we aren't already).
+		set_state(epoll_fd, SENDING);
+	}
+	else if (this->load_token != 0) {
+		// Waiting for the next song in the queue to load
+		set_state(epoll_fd, PAUSED);
+	}
+	else if (this->radio.channel != NULL) {
+		// Caught up with the live broadcast
+		wait_for_broadcast(epoll_fd);
+	}
+	else {
+		// Sent everything with no problem so we are done with our sender
+		// object, and can go back to waiting for commands.
+		set_state(epoll_fd, RECEIVING);
+		this->sender = std::monostate();
+		this->pace.active = false;
+
+		// Start on any commands that came in while we were sending.
+		if (!this->inbuf.empty()) {
+			run_commands(epoll_fd, *Catalog::current());
 		}
+	}
+}
 
-		delete this->sender;
+/**
+ * Builds the header of a session frame.
+ *
+ * @param type What kind of frame it is.
+ * @param length Length of the payload.
+ * @return The frame header.
+ */
+static string frame_header(uint8_t type, size_t length) {
+	string header(1, (char)type);
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		header += (char)((length >> shift) & 0xff);
 	}
+	return header;
 }
 
-void ConnectedClient::handle_input(int epoll_fd, vector<fs::path> song_list) {
-	char data[1024];
-	memset(data, 0, 1024);
-	ssize_t bytes_received = recv(this->client_fd, data, 1024, 0);
-	if (bytes_received < 0) {
-		perror("client_read recv");
-		exit(EXIT_FAILURE);
+void ConnectedClient::continue_session(int epoll_fd, size_t &budget) {
+	SessionState &s = this->session;
+
+	while (true) {
+		if (budget == 0) {
+			wait_for_turn(epoll_fd);
+			return;
+		}
+		else if (s.header_pos < s.header.size() || s.frame_left > 0) {
+			// Send what's left of the header along with as much of the
+			// payload as fits, in a single writev when the payload is in
+			// memory.
+			ChunkedDataSender &source = s.frame_is_audio ? this->sender
+				: s.frame_payload;
+			size_t header_left = s.header.size() - s.header_pos;
+			size_t payload_wanted = std::min(s.frame_left, budget);
+			ssize_t num_bytes_sent = send_next_chunk(source, this->client_fd,
+					payload_wanted, s.header.data() + s.header_pos,
+					header_left);
+			if (num_bytes_sent < 0) {
+				set_state(epoll_fd, SENDING);
+				return;
+			}
+			else if (num_bytes_sent == 0) {
+				// The song got shorter on disk partway through a frame, so
+				// there's no way to finish it. Hang up rather than leave the
+				// client waiting for bytes that will never come.
+				shutdown(this->client_fd, SHUT_RDWR);
+				return;
+			}
+
+			size_t header_sent = std::min((size_t)num_bytes_sent, header_left);
+			size_t payload_sent = num_bytes_sent - header_sent;
+			s.header_pos += header_sent;
+			s.frame_left -= payload_sent;
+			budget -= std::min(budget, (size_t)num_bytes_sent);
+			if (s.frame_is_audio) {
+				this->pace.bytes_sent += payload_sent;
+			}
+			else if (s.frame_left == 0) {
+				s.frame_payload = std::monostate();
+			}
+
+			if ((size_t)num_bytes_sent < header_left + payload_wanted) {
+				// A short send means the socket buffer is full.
+				set_state(epoll_fd, SENDING);
+				return;
+			}
+		}
+		else if (!s.queued.empty()) {
+			// Replies and song ends go out before any more audio.
+			QueuedFrame &frame = s.queued.front();
+			size_t length = frame.payload ? frame.payload->size() : 0;
+			s.header = frame_header(frame.type, length);
+			s.header_pos = 0;
+			s.frame_left = length;
+			s.frame_is_audio = false;
+			if (length > 0) {
+				s.frame_payload.emplace<ArraySender>(std::move(frame.payload));
+			}
+			s.queued.pop_front();
+		}
+		else if (!std::holds_alternative<std::monostate>(this->sender)
+				|| this->radio.channel != NULL) {
+			size_t remaining = bytes_remaining(this->sender);
+			if (remaining == 0 && this->radio.channel != NULL) {
+				if (!next_radio_chunk()) {
+					wait_for_broadcast(epoll_fd);
+					return;
+				}
+				continue;
+			}
+			else if (remaining == 0) {
+				// To the client a queue is one long song, so the next one's
+				// audio follows straight on (or as soon as it has loaded)
+				// and only the last one gets a SONG_END.
+				if (!next_queued_song() && this->load_token == 0) {
+					this->sender = std::monostate();
+					this->pace.active = false;
+					queue_frame(SONG_END_FRAME, NULL);
+				}
+				continue;
+			}
+
+			size_t allowance = pace_allowance();
+			if (allowance == 0) {
+				pause_sending(epoll_fd);
+				return;
+			}
+
+			// Size the frame to what the socket can take right now, so it
+			// goes out in one writev and doesn't hold up anything queued
+			// behind it.
+			size_t space = std::min(send_space(), SendScheduler::QUANTUM);
+			size_t length = std::min({remaining, allowance,
+					std::max(space, AUDIO_FRAME_MIN)});
+			s.header = frame_header(AUDIO_FRAME, length);
+			s.header_pos = 0;
+			s.frame_left = length;
+			s.frame_is_audio = true;
+		}
+		else {
+			// Nothing left to send
+			set_state(epoll_fd, RECEIVING);
+			return;
+		}
 	}
+}
 
-	//remove blank bytes of client input
-	int blank_bytes = 0;
-	while(!(isalpha(data[blank_bytes]))){
-		blank_bytes+=1;
-		if (blank_bytes > 500){
-			break;
+void ConnectedClient::queue_frame(uint8_t type,
+		std::shared_ptr<const string> payload) {
+	if (this->session.queued.size() >= MAX_QUEUED_FRAMES) {
+		hang_up();
+		return;
+	}
+	QueuedFrame frame;
+	frame.type = type;
+	frame.payload = std::move(payload);
+	this->session.queued.push_back(std::move(frame));
+}
+
+void ConnectedClient::stop_audio() {
+	// Whatever was queued after this song goes too. A prefetch that's still
+	// loading will see it isn't wanted any more when it finishes.
+	this->play_queue.clear();
+	this->prefetch_token = 0;
+	this->prefetched.reset();
+
+	if (this->load_token != 0) {
+		// Whenever the load finishes, it'll see it isn't wanted any more.
+		this->load_token = 0;
+		set_current_song(fs::path());
+		if (this->session.active) {
+			queue_frame(SONG_END_FRAME, NULL);
 		}
+		return;
+	}
+	if (std::holds_alternative<std::monostate>(this->sender)
+			&& this->radio.channel == NULL) {
+		return;
+	}
+
+	if (this->session.frame_is_audio && this->session.frame_left > 0) {
+		// We've promised the client the rest of this frame, so finish it
+		// from the old song.
+		this->session.frame_payload = std::move(this->sender);
+		this->session.frame_is_audio = false;
+	}
+	this->sender = std::monostate();
+	this->pace.active = false;
+	set_current_song(fs::path());
+	this->radio.channel = NULL;
+
+	if (this->session.active) {
+		queue_frame(SONG_END_FRAME, NULL);
 	}
-	char formatted[1024-blank_bytes];
-	memcpy(formatted, data+blank_bytes, 1024-blank_bytes);
+}
+
+void ConnectedClient::handle_input(int epoll_fd, const Catalog &catalog) {
+	// Read everything that's waiting: in edge-triggered mode epoll won't
+	// tell us about it again until more arrives.
+	char data[4096];
+	while (true) {
+		ssize_t bytes_received = recv(this->client_fd, data, sizeof(data), 0);
+		if (bytes_received < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == ECONNRESET) {
+				// Nothing (more) to read, or the client is gone (in which
+				// case epoll will tell the event loop to close it).
+				break;
+			}
+			// Something went wrong with just this connection (e.g.
+			// ETIMEDOUT), so drop it rather than everyone.
+			perror("client_read recv");
+			hang_up();
+			return;
+		}
+		else if (bytes_received == 0) {
+			break; // hung up; the event loop will see EPOLLRDHUP
+		}
 
-	// Replace the space with null terminator so that comparison will be succesufll and the second
-	// argument the song num is still the same
-	formatted[4] = '\0';
-	//play"\0"5"\0"
-	if (strcmp(formatted, "play") == 0){ // Bring pack
-		try{
-			int song_id = abs(std::stoi(formatted + 5) % (int)song_list.size()); // get the int starting at the 
-			send_audio(epoll_fd, song_list.at(song_id));
+		// Commands can be split across reads or several can arrive at
+		// once, so add what we got to whatever we had left over and handle
+		// all the complete ones once we've read it all.
+		this->inbuf.append(data, bytes_received);
+		this->last_active_ms = monotonic_ms();
+		if (this->inbuf.size() > MAX_INBUF_BYTES) {
+			run_commands(epoll_fd, catalog);
+			if (this->inbuf.size() > MAX_INBUF_BYTES) {
+				hang_up();
+				return;
+			}
 		}
-		catch(const std::invalid_argument &err){
-			cout << "Invalid data sent with play command: ";
-			std::cerr << err.what();
+
+		// A short read emptied the socket, so there's no need to make
+		// another call just to hear EAGAIN.
+		if ((size_t)bytes_received < sizeof(data)) {
+			break;
 		}
 	}
-	else if (strcmp(formatted, "list") == 0){ 
-		list(epoll_fd, song_list);
+
+	run_commands(epoll_fd, catalog);
+}
+
+void ConnectedClient::handle_received(int epoll_fd, const Catalog &catalog,
+		const char *data, size_t length) {
+	this->inbuf.append(data, length);
+	this->last_active_ms = monotonic_ms();
+	run_commands(epoll_fd, catalog);
+	if (this->inbuf.size() > MAX_INBUF_BYTES) {
+		hang_up();
 	}
-	else if (strcmp(formatted, "info") == 0){
-		try{
-			get_info(epoll_fd, song_list, std::stoi(formatted + 5));
-		}
-		catch(const std::invalid_argument &err){
-			cout << "Invalid data sent with play command: ";
-			std::cerr << err.what();
+}
+
+void ConnectedClient::run_commands(int epoll_fd, const Catalog &catalog) {
+	if (this->running_commands) {
+		return; // a reply finished while we were already in here
+	}
+	this->running_commands = true;
+
+	// Each command is sent with Java's writeUTF: a two byte, big-endian
+	// length followed by that many bytes of text. Outside of a session, only
+	// start a command once we're done sending the reply to the one before
+	// it, so replies go back in the same order the commands came in. In a
+	// session replies are framed, so commands are run as soon as they come
+	// in, even in the middle of a song. Either way, none are run while an
+	// info reply is being read in, so it can't fall behind the next reply.
+	size_t pos = 0;
+	while (this->info_token == 0
+			&& (this->session.active
+				|| (std::holds_alternative<std::monostate>(this->sender)
+					&& this->load_token == 0 && this->radio.channel == NULL))
+			&& this->inbuf.size() - pos >= 2) {
+		size_t length = ((uint8_t)this->inbuf[pos] << 8) | (uint8_t)this->inbuf[pos + 1];
+		if (this->inbuf.size() - pos - 2 < length) {
+			break; // the rest of the command hasn't arrived yet
 		}
+		string command = this->inbuf.substr(pos + 2, length);
+		pos += 2 + length;
+		run_command(epoll_fd, catalog, command);
 	}
-	// this->send_dummy_response(epoll_fd);
+	this->inbuf.erase(0, pos);
+
+	this->running_commands = false;
 }
 
-void ConnectedClient::send_audio(int epoll_fd, fs::path song_path){
-	// Create a large array, just to make sure we can send a lot of data in
-	// smaller chunks.
+/**
+ * @return A new resume token: 64 random bits, in hex, so one client can't
+ * 	guess another's.
+ */
+static string new_resume_token() {
+	std::random_device random;
+	uint64_t value = ((uint64_t)random() << 32) | random();
+	char token[17];
+	snprintf(token, sizeof(token), "%016llx", (unsigned long long)value);
+	return token;
+}
 
-	//The rest of this is not yet right
-	ifstream indata (song_path); // Create ifstram object from path
-	FileSender *file_sender = new FileSender(song_path); // pass this object to the File
+void ConnectedClient::run_command(int epoll_fd, const Catalog &catalog,
+		const string &command) {
+	const vector<fs::path> &song_list = catalog.song_list();
 
-	ssize_t num_bytes_sent;
-	ssize_t total_bytes_sent = 0;
+	std::istringstream args(command);
+	string name;
+	args >> name;
 
-	// keep sending the next chunk until it says we either didn't send
-	// anything (0 return indicates nothing left to send) or until we can't
-	// send anymore because of a full socket buffer (-1 return value)
-	while((num_bytes_sent = file_sender->send_next_chunk(this->client_fd)) > 0) {
-		total_bytes_sent += num_bytes_sent;
+	if (name == "resume") {
+		string token;
+		args >> token;
+		resume(epoll_fd, token);
 	}
+	else if (name == "session") {
+		// From now on everything we send is framed (see FrameType). The
+		// token goes out with the reply, so the client has it before it
+		// plays anything it might want to resume.
+		this->session.active = true;
+		if (this->resume_token.empty()) {
+			this->resume_token = new_resume_token();
+		}
+		send_message(epoll_fd,
+				"Session started. Resume token: " + this->resume_token);
+	}
+	else if (name == "stop") {
+		stop_audio();
+		continue_response(epoll_fd);
+	}
+	else if (name == "play" && song_list.empty()){
+		// The music directory may have been emptied out since the client
+		// last asked for the list.
+		reject_audio_command(epoll_fd, "No songs to play");
+	}
+	else if (name == "play"){
+		int song_id;
+		if (!(args >> song_id)) {
+			reject_audio_command(epoll_fd, "Invalid data sent with play command: " + command);
+			return;
+		}
+		song_id = abs(song_id % (int)song_list.size());
+		fs::path song_path = song_list[song_id];
 
-	/*
-	 * 1. update our state field to be sending
-	 * 2. set our sender field to be the ArraySender object we created
-	 * 3. update epoll so that it also watches for EPOLLOUT for this client
-	 *    socket (use epoll_ctl with EPOLL_CTL_MOD).
-	 */
-	if (num_bytes_sent < 0) {
-		// Fill this in with the three steps listed in the comment above.
-		// WARNING: Do NOT delete array_sender here (you'll need it to continue
-		// sending later).
-		this->state = SENDING;
-		this->sender = file_sender;
-		struct epoll_event client_ev;
-		client_ev.data.fd = this->client_fd;
-		client_ev.events = EPOLLOUT;
-		if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, this->client_fd, &client_ev) == -1){
-			perror("Error updating epoll to watch for EPOLLOUT");
-			exit(1);	
+		// "play N at <seconds>" starts partway through the song
+		string at;
+		double start;
+		if (args >> at) {
+			if (at != "at" || !(args >> start)) {
+				reject_audio_command(epoll_fd, "Invalid data sent with play command: " + command);
+				return;
+			}
+			send_audio(epoll_fd, song_path, std::max(start, 0.0));
 		}
+		else {
+			send_audio(epoll_fd, song_path);
+		}
+	}
+	else if (name == "queue" && song_list.empty()) {
+		reject_audio_command(epoll_fd, "No songs to play");
+	}
+	else if (name == "queue") {
+		// "queue 3 7 1" plays songs 3, 7 and 1 one after the other
+		vector<fs::path> songs;
+		int song_id;
+		while (args >> song_id) {
+			songs.push_back(song_list[abs(song_id % (int)song_list.size())]);
+		}
+		if (songs.empty() || !args.eof()) {
+			reject_audio_command(epoll_fd, "Invalid data sent with queue command: " + command);
+			return;
+		}
+		queue_songs(epoll_fd, songs);
+	}
+	else if (name == "radio") {
+		int channel_number;
+		if (!(args >> channel_number)) {
+			reject_audio_command(epoll_fd, "Invalid data sent with radio command: " + command);
+			return;
+		}
+		RadioChannel *channel = RadioChannel::find(channel_number);
+		if (channel == NULL) {
+			reject_audio_command(epoll_fd, "No such radio channel: " + std::to_string(channel_number));
+			return;
+		}
+		listen(epoll_fd, channel);
+	}
+	else if (name == "stats") {
+		send_message(epoll_fd, ServerStats::instance().report());
+	}
+	else if (name == "list"){
+		list(epoll_fd, catalog);
+	}
+	else if (name == "search") {
+		string query;
+		std::getline(args, query);
+		search(epoll_fd, catalog, query);
+	}
+	else if (name == "info"){
+		int song_id;
+		if (!(args >> song_id)) {
+			send_message(epoll_fd, "Invalid data sent with info command: " + command);
+			return;
+		}
+		get_info(epoll_fd, catalog, song_id);
 	}
 	else {
-		// Sent everything with no problem so we are done with our ArraySender
-		// object.
-		delete file_sender;
+		send_message(epoll_fd, "Unknown command: " + command);
 	}
 }
 
+void ConnectedClient::send_audio(int epoll_fd, fs::path song_path,
+		double start_seconds, size_t max_offset){
+	// Playing a new song stops whatever was playing.
+	stop_audio();
 
+	// Opening the song and finding where to start could mean waiting on the
+	// disk, so have the IoPool do it and pick up in handle_loaded.
+	this->load_token = start_load(song_path, start_seconds, max_offset);
+	this->loading = LoadRequest{song_path, start_seconds, max_offset};
+	set_current_song(song_path);
+	this->pace = PaceState(); // so no timer from the last song goes off
 
-// You likely should not need to modify this function.
-void ConnectedClient::handle_close(int epoll_fd) {
+	if (this->session.active) {
+		// Anything already queued (e.g. the end of the last song) can still
+		// go out in the meantime.
+		continue_response(epoll_fd);
+	}
+	else {
+		// Nothing to send and no commands to run until the song is ready.
+		set_state(epoll_fd, PAUSED);
+	}
+}
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, this->client_fd, NULL) == -1) {
-		perror("handle_close epoll_ctl");
-		exit(EXIT_FAILURE);
+void ConnectedClient::queue_songs(int epoll_fd,
+		const vector<fs::path> &songs) {
+	send_audio(epoll_fd, songs.front());
+
+	// The second song starts loading as soon as the first one is ready.
+	this->play_queue.assign(songs.begin() + 1, songs.end());
+}
+
+uint64_t ConnectedClient::start_load(const fs::path &song,
+		double start_seconds, size_t max_offset) {
+	std::shared_ptr<SongLoad> load = std::make_shared<SongLoad>();
+	load->client_key = epoll_key();
+	load->token = ++this->loads_started;
+	load->song = song;
+	load->seconds = start_seconds;
+	load->max_offset = max_offset;
+	IoPool::instance().load_song(load, this->completions);
+	return load->token;
+}
+
+void ConnectedClient::listen(int epoll_fd, RadioChannel *channel) {
+	// Tuning in stops whatever was playing.
+	stop_audio();
+
+	this->pace = PaceState(); // the channel sets the pace
+	this->radio.channel = channel;
+	this->radio.next_seq = channel->live_seq();
+	continue_response(epoll_fd);
+}
+
+void ConnectedClient::handle_loaded(int epoll_fd,
+		std::shared_ptr<SongLoad> load) {
+	if (load->token != 0 && load->token == this->info_token) {
+		this->info_token = 0;
+		send_message(epoll_fd, load->info);
+
+		// Outside of a session, the rest are run once the reply is sent.
+		if (this->session.active && !this->inbuf.empty()) {
+			run_commands(epoll_fd, *Catalog::current());
+		}
+		return;
+	}
+	if (load->token != 0 && load->token == this->prefetch_token) {
+		// The next song in the queue, ready for when this one ends.
+		this->prefetched = std::move(load);
+		return;
 	}
+	if (load->token != this->load_token) {
+		return; // stopped, or another song was asked for, while it loaded
+	}
+	this->load_token = 0;
 
-	close(this->client_fd);
+	start_song(*load);
+
+	if (this->state == QUEUED) {
+		return; // still waiting in line to finish a reply; it'll pick this up
+	}
+	continue_response(epoll_fd);
+}
+
+void ConnectedClient::start_song(SongLoad &load) {
+	PaceState last_pace = this->pace;
+
+	this->sender = std::move(load.sender);
+	set_current_song(load.song);
+	this->song_offset = load.start_offset;
+	this->song_start_seconds = load.start_seconds;
+	this->song_start_ms = monotonic_ms();
+	this->readahead_end = load.start_offset + READAHEAD_BYTES;
+
+	this->pace = PaceState();
+	if (pacing_enabled && load.byte_rate > 0) {
+		this->pace.active = true;
+		this->pace.start_ms = monotonic_ms();
+		this->pace.byte_rate = load.byte_rate;
+		this->pace.lead_bytes = load.byte_rate * pace_lead_seconds;
+
+		if (last_pace.active) {
+			// We're following straight on from a queued song, and the
+			// client still has the end of it to play, so only let it get
+			// as far ahead as it was allowed to before.
+			double elapsed = (monotonic_ms() - last_pace.start_ms) / 1000.0;
+			double ahead = last_pace.bytes_sent / last_pace.byte_rate - elapsed;
+			this->pace.lead_bytes = load.byte_rate
+				* std::max(pace_lead_seconds - ahead, 0.0);
+		}
+	}
+
+	if (!this->play_queue.empty() && this->prefetch_token == 0) {
+		this->prefetch_token = start_load(this->play_queue.front(), 0,
+				SIZE_MAX);
+	}
 }
 
-void ConnectedClient::list(int epoll_fd,vector<fs::path> song_list) {
-	std::stringstream ss;
-	for(size_t i = 0; i < song_list.size(); ++i){
-		ss << "(" << i << ") " << song_list[i] << "\n";
+bool ConnectedClient::next_queued_song() {
+	if (this->play_queue.empty()) {
+		return false;
+	}
+	fs::path next_song = this->play_queue.front();
+	this->play_queue.pop_front();
+	uint64_t token = this->prefetch_token;
+	this->prefetch_token = 0;
+
+	if (this->prefetched) {
+		std::shared_ptr<SongLoad> load = std::move(this->prefetched);
+		start_song(*load);
+		return true;
 	}
-	std::string file_list = ss.str();
-	send_message(epoll_fd, file_list);
+
+	// Not ready yet, so wait for it like any other load. The pace is kept
+	// for start_song to carry on from, but its timer is of no more use.
+	this->load_token = token;
+	this->loading = LoadRequest{next_song, 0, SIZE_MAX};
+	this->sender = std::monostate();
+	this->pace.timer_token = 0;
+	return false;
 }
 
+void ConnectedClient::read_ahead() {
+	std::shared_ptr<const MappedSong> song;
+	if (const MappedSender *mapped = std::get_if<MappedSender>(&this->sender)) {
+		song = mapped->mapped_song();
+	}
+	else if (!std::holds_alternative<FileSender>(this->sender)) {
+		return; // not sending a song
+	}
 
-void ConnectedClient::get_info(int epoll_fd, vector<fs::path> song_list, int song_index){
-	if (song_index < 0 || song_index >= (int)song_list.size()){
-		send_message(epoll_fd, "Invalid song index specified: " + std::to_string(song_index));
+	// Wait until we're halfway through what was read in last time, so each
+	// read is a decent size.
+	size_t position = this->song_offset + this->pace.bytes_sent;
+	size_t song_end = position + bytes_remaining(this->sender);
+	if (position + READAHEAD_BYTES / 2 < this->readahead_end
+			|| this->readahead_end >= song_end) {
 		return;
 	}
-	fs::path info_path = song_list[song_index].replace_extension(".mp3.info");
-	if (not(fs::exists(info_path))) {
-		send_message(epoll_fd, "Song does not have an info file.");
-		return;
+
+	IoPool::instance().read_ahead(song, this->current_song,
+			this->readahead_end, READAHEAD_BYTES);
+	this->readahead_end += READAHEAD_BYTES;
+}
+
+void ConnectedClient::resume(int epoll_fd, const string &token) {
+	ResumePoint point;
+	{
+		std::lock_guard<std::mutex> guard(resume_lock);
+		auto found = resume_points.find(token);
+		if (found == resume_points.end()) {
+			send_message(epoll_fd, "Nothing to resume");
+			return;
+		}
+		point = found->second;
+		resume_points.erase(found);
 	}
-	FileSender *file_sender = new FileSender(info_path); // pass this object to the File
 
-	ssize_t num_bytes_sent;
-	ssize_t total_bytes_sent = 0;
+	// Don't skip past anything the client never actually got.
+	send_audio(epoll_fd, point.song, point.seconds, point.max_offset);
+}
 
-	// keep sending the next chunk until it says we either didn't send
-	// anything (0 return indicates nothing left to send) or until we can't
-	// send anymore because of a full socket buffer (-1 return value)
-	while((num_bytes_sent = file_sender->send_next_chunk(this->client_fd)) > 0) {
-		total_bytes_sent += num_bytes_sent;
+void ConnectedClient::save_resume_point() {
+	if (this->current_song.empty() || this->load_token != 0
+			|| this->resume_token.empty()) {
+		return;
 	}
-	/*
-	 * 1. update our state field to be sending
-	 * 2. set our sender field to be the ArraySender object we created
-	 * 3. update epoll so that it also watches for EPOLLOUT for this client
-	 *    socket (use epoll_ctl with EPOLL_CTL_MOD).
-	 */
-	if (num_bytes_sent < 0) {
-		this->state = SENDING;
-		this->sender = file_sender;
-		struct epoll_event client_ev;
-		client_ev.data.fd = this->client_fd;
-		client_ev.events = EPOLLOUT;
-		if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, this->client_fd, &client_ev) == -1){
-			perror("Error updating epoll to watch for EPOLLOUT");
-			exit(1);	
+
+	fs::path song = this->current_song;
+	double seconds = this->song_start_seconds
+		+ (monotonic_ms() - this->song_start_ms) / 1000.0;
+	size_t offset_sent = this->song_offset + this->pace.bytes_sent;
+	string token = this->resume_token;
+
+	IoPool::instance().submit([song, seconds, offset_sent, token]() {
+		std::shared_ptr<const Mp3Index> index =
+			SongCache::instance().frame_index(song);
+		if (seconds >= index->duration()) {
+			return; // they got to the end of the song
 		}
+
+		ResumePoint point;
+		point.song = song;
+		point.seconds = seconds;
+		point.max_offset = index->frame_start_before(offset_sent);
+
+		std::lock_guard<std::mutex> guard(resume_lock);
+		resume_points[token] = point;
+	});
+}
+
+// What save_state puts first, for what's in the sender
+enum SavedSender : uint8_t { SAVED_NOTHING, SAVED_BYTES, SAVED_SONG };
+
+string ConnectedClient::save_state() const {
+	StateWriter w;
+
+	// What we're in the middle of sending. A song is picked back up from the
+	// file; anything else (a reply, a radio chunk) is copied across.
+	const FileSender *file = std::get_if<FileSender>(&this->sender);
+	const MappedSender *mapped = std::get_if<MappedSender>(&this->sender);
+	if (file != NULL || mapped != NULL) {
+		w.put_u64(SAVED_SONG);
+		w.put_u64(file != NULL ? file->position() : mapped->position());
+	}
+	else if (std::holds_alternative<ArraySender>(this->sender)) {
+		w.put_u64(SAVED_BYTES);
+		w.put_string(peek_bytes(this->sender, NO_LIMIT));
 	}
 	else {
-		delete file_sender;
+		w.put_u64(SAVED_NOTHING);
+	}
+
+	w.put_string(this->current_song.string());
+	w.put_u64(this->song_offset);
+	w.put_double(this->song_start_seconds);
+	w.put_u64(this->song_start_ms);
+
+	// The monotonic clock is the same in every process, so the pace carries
+	// straight on.
+	w.put_u64(this->pace.active);
+	w.put_u64(this->pace.start_ms);
+	w.put_double(this->pace.byte_rate);
+	w.put_double(this->pace.lead_bytes);
+	w.put_u64(this->pace.bytes_sent);
+
+	const SessionState &s = this->session;
+	w.put_u64(s.active);
+	w.put_string(s.header.substr(s.header_pos));
+	w.put_u64(s.frame_left);
+	w.put_u64(s.frame_is_audio);
+	if (!s.frame_is_audio) {
+		w.put_string(peek_bytes(s.frame_payload, s.frame_left));
+	}
+	w.put_u64(s.queued.size());
+	for (const QueuedFrame &frame : s.queued) {
+		w.put_u64(frame.type);
+		w.put_u64(frame.payload != NULL);
+		w.put_string(frame.payload ? *frame.payload : string());
+	}
+
+	w.put_u64(this->radio.channel ? this->radio.channel->channel_number() + 1
+			: 0);
+
+	w.put_u64(this->load_token != 0);
+	w.put_string(this->loading.song.string());
+	w.put_double(this->loading.seconds);
+	w.put_u64(this->loading.max_offset);
+
+	w.put_u64(this->play_queue.size());
+	for (const fs::path &song : this->play_queue) {
+		w.put_string(song.string());
+	}
+
+	// An info reply being read in doesn't survive the restart, so have the
+	// next server run the command again.
+	string info_command;
+	if (this->info_token != 0) {
+		string command = "info " + std::to_string(this->info_song);
+		info_command = string(1, (char)(command.size() >> 8))
+			+ (char)(command.size() & 0xff) + command;
 	}
+	w.put_string(info_command + this->inbuf);
+	w.put_string(this->resume_token);
+	return w.str();
 }
 
+bool ConnectedClient::restore_state(int epoll_fd, const string &saved) {
+	StateReader r(saved);
 
+	uint64_t sender_kind = r.get_u64();
+	size_t song_position = 0;
+	string bytes;
+	if (sender_kind == SAVED_SONG) {
+		song_position = r.get_u64();
+	}
+	else if (sender_kind == SAVED_BYTES) {
+		bytes = r.get_string();
+	}
 
-void ConnectedClient::send_message(int epoll_fd, string data_to_send) {
-	// Create a large array, just to make sure we can send a lot of data in
-	// smaller chunks.
-	const char *c_message = data_to_send.c_str();
+	set_current_song(r.get_string());
+	this->song_offset = r.get_u64();
+	this->song_start_seconds = r.get_double();
+	this->song_start_ms = r.get_u64();
 
+	this->pace.active = r.get_u64();
+	this->pace.start_ms = r.get_u64();
+	this->pace.byte_rate = r.get_double();
+	this->pace.lead_bytes = r.get_double();
+	this->pace.bytes_sent = r.get_u64();
 
-	ArraySender *array_sender = new ArraySender(c_message, data_to_send.length());
-	// delete[] c_message; // The ArraySender creates its own copy of the data so let's delete this copy
+	SessionState &s = this->session;
+	s.active = r.get_u64();
+	s.header = r.get_string();
+	s.header_pos = 0;
+	s.frame_left = r.get_u64();
+	s.frame_is_audio = r.get_u64();
+	if (!s.frame_is_audio) {
+		string payload = r.get_string();
+		if (!payload.empty()) {
+			s.frame_payload.emplace<ArraySender>(
+					std::make_shared<const string>(std::move(payload)));
+		}
+	}
+	uint64_t num_queued = r.get_u64();
+	for (uint64_t i = 0; i < num_queued && r.ok; i++) {
+		QueuedFrame frame;
+		frame.type = r.get_u64();
+		bool has_payload = r.get_u64();
+		string payload = r.get_string();
+		if (has_payload) {
+			frame.payload = std::make_shared<const string>(std::move(payload));
+		}
+		s.queued.push_back(std::move(frame));
+	}
 
-	ssize_t num_bytes_sent;
-	ssize_t total_bytes_sent = 0;
+	uint64_t channel = r.get_u64();
 
-	// keep sending the next chunk until it says we either didn't send
-	// anything (0 return indicates nothing left to send) or until we can't
-	// send anymore because of a full socket buffer (-1 return value)
-	while((num_bytes_sent = array_sender->send_next_chunk(this->client_fd)) > 0) {
-		total_bytes_sent += num_bytes_sent;
+	bool loading_song = r.get_u64();
+	this->loading.song = r.get_string();
+	this->loading.seconds = r.get_double();
+	this->loading.max_offset = r.get_u64();
+
+	uint64_t queue_length = r.get_u64();
+	for (uint64_t i = 0; i < queue_length && r.ok; i++) {
+		this->play_queue.push_back(r.get_string());
+	}
+
+	this->inbuf = r.get_string();
+	this->resume_token = r.get_string();
+	if (!r.ok) {
+		return false;
+	}
+
+	// Pick the song back up from the exact byte, the same way the IoPool
+	// would have opened it.
+	if (sender_kind == SAVED_SONG) {
+		std::shared_ptr<const MappedSong> song =
+			SongCache::instance().acquire(this->current_song);
+		if (song) {
+			this->sender.emplace<MappedSender>(song, song_position);
+		}
+		else {
+			this->sender.emplace<FileSender>(this->current_song, song_position);
+		}
+		this->readahead_end = song_position;
+		if (!this->play_queue.empty()) {
+			this->prefetch_token = start_load(this->play_queue.front(), 0,
+					SIZE_MAX);
+		}
+	}
+	else if (sender_kind == SAVED_BYTES) {
+		this->sender.emplace<ArraySender>(
+				std::make_shared<const string>(std::move(bytes)));
 	}
 
-	/*
-	 * 1. update our state field to be sending
-	 * 2. set our sender field to be the ArraySender object we created
-	 * 3. update epoll so that it also watches for EPOLLOUT for this client
-	 *    socket (use epoll_ctl with EPOLL_CTL_MOD).
-	 */
-	if (num_bytes_sent < 0) {
-		// Fill this in with the three steps listed in the comment above.
-		// WARNING: Do NOT delete array_sender here (you'll need it to continue
-		// sending later).
-		this->state = SENDING;
-		this->sender = array_sender;
-		struct epoll_event client_ev;
-		client_ev.data.fd = this->client_fd;
-		client_ev.events = EPOLLOUT;
-		if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, this->client_fd, &client_ev) == -1){
-			perror("Error updating epoll to watch for EPOLLOUT");
-			exit(1);	
+	// This server's broadcasts started over, so join the live edge once the
+	// chunk we were in the middle of is done. If it doesn't have the channel
+	// at all, the broadcast ends there.
+	if (channel > 0) {
+		this->radio.channel = RadioChannel::find(channel - 1);
+		if (this->radio.channel != NULL) {
+			this->radio.next_seq = this->radio.channel->live_seq();
+		}
+		else if (s.active) {
+			queue_frame(SONG_END_FRAME, NULL);
+		}
+	}
+
+	// Loads don't survive the restart, so ask for them again.
+	if (loading_song) {
+		this->load_token = start_load(this->loading.song,
+				this->loading.seconds, this->loading.max_offset);
+		if (!s.active) {
+			set_state(epoll_fd, PAUSED);
+			return true;
+		}
+	}
+
+	// Work out where we are from here.
+	set_state(epoll_fd, PAUSED);
+	continue_response(epoll_fd);
+	return true;
+}
+
+string ConnectedClient::save_resume_points() {
+	StateWriter w;
+	std::lock_guard<std::mutex> guard(resume_lock);
+	w.put_u64(resume_points.size());
+	for (const auto &entry : resume_points) {
+		w.put_string(entry.first);
+		w.put_string(entry.second.song.string());
+		w.put_double(entry.second.seconds);
+		w.put_u64(entry.second.max_offset);
+	}
+	return w.str();
+}
+
+void ConnectedClient::restore_resume_points(const string &saved) {
+	StateReader r(saved);
+	std::lock_guard<std::mutex> guard(resume_lock);
+	uint64_t count = r.get_u64();
+	for (uint64_t i = 0; i < count && r.ok; i++) {
+		string token = r.get_string();
+		ResumePoint point;
+		point.song = r.get_string();
+		point.seconds = r.get_double();
+		point.max_offset = r.get_u64();
+		if (r.ok) {
+			resume_points[token] = point;
+		}
+	}
+}
+
+// You likely should not need to modify this function.
+void ConnectedClient::handle_close(int epoll_fd) {
+	save_resume_point();
+	set_current_song(fs::path());
+	this->stats->client_moved(this->state, -1);
+
+	if (this->ring != NULL) {
+		// The requests hold on to the socket until they're cancelled, even
+		// once it's closed. Any that already finished just won't be found.
+		this->ring->cancel(ring_key(RECV_OP, epoll_key()));
+		if ((this->watched_events & EPOLLOUT) != 0) {
+			this->ring->cancel(ring_key(WRITABLE_OP, epoll_key()));
 		}
 	}
+	else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, this->client_fd, NULL) == -1) {
+		perror("handle_close epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+
+	close(this->client_fd);
+}
+
+void ConnectedClient::list(int epoll_fd, const Catalog &catalog) {
+	send_message(epoll_fd, catalog.list_response());
+}
+
+
+void ConnectedClient::get_info(int epoll_fd, const Catalog &catalog, int song_index){
+	if (song_index < 0 || song_index >= (int)catalog.size()){
+		send_message(epoll_fd, "Invalid song index specified: " + std::to_string(song_index));
+		return;
+	}
+	std::shared_ptr<const string> reply = catalog.info_response(song_index);
+	if (reply) {
+		send_message(epoll_fd, reply);
+		return;
+	}
+
+	// It hasn't been read in yet, and reading it could wait on the disk, so
+	// have the IoPool do it and pick up in handle_loaded.
+	std::shared_ptr<SongLoad> load = std::make_shared<SongLoad>();
+	load->client_key = epoll_key();
+	load->token = ++this->loads_started;
+	load->song = catalog.song_list()[song_index];
+	IoPool::instance().load_info(load, this->completions);
+	this->info_token = load->token;
+	this->info_song = song_index;
+	if (!this->session.active && this->state == RECEIVING) {
+		set_state(epoll_fd, PAUSED);
+	}
+}
+
+
+
+void ConnectedClient::search(int epoll_fd, const Catalog &catalog,
+		const string &query) {
+	std::shared_ptr<const SearchIndex> index = catalog.search_index();
+	vector<SearchResult> results;
+	size_t num_matches = index->search(query, MAX_SEARCH_RESULTS, results);
+
+	std::ostringstream reply;
+	if (num_matches == 0) {
+		reply << "No songs match that search.\n";
+	}
 	else {
-		// Sent everything with no problem so we are done with our ArraySender
-		// object.
-		delete array_sender;
+		reply << num_matches << (num_matches == 1 ? " song matches" : " songs match");
+		if (num_matches > results.size()) {
+			reply << " (showing the best " << results.size() << ")";
+		}
+		reply << ":\n";
+	}
+	for (const SearchResult &result : results) {
+		std::ostringstream line;
+		line << "(" << result.song << ") " << catalog.song_list()[result.song];
+		if (!index->label(result.song).empty()) {
+			line << "  " << index->label(result.song);
+		}
+		reply << line.str().substr(0, MAX_SEARCH_LINE_BYTES) << "\n";
+	}
+	if (!index->complete()) {
+		reply << "(Still reading tags and info files, so only file names were"
+			<< " searched.)\n";
 	}
+	send_message(epoll_fd, reply.str());
+}
+
+void ConnectedClient::reject_audio_command(int epoll_fd, const string &reason) {
+	if (!this->session.active) {
+		send_message(epoll_fd, reason);
+		return;
+	}
+	stop_audio();
+	queue_frame(MESSAGE_FRAME, std::make_shared<const string>(reason));
+	queue_frame(SONG_END_FRAME, NULL);
+	continue_response(epoll_fd);
+}
+
+void ConnectedClient::send_message(int epoll_fd, string data_to_send) {
+	send_message(epoll_fd, std::make_shared<const string>(std::move(data_to_send)));
+}
+
+void ConnectedClient::send_message(int epoll_fd,
+		std::shared_ptr<const string> data_to_send) {
+	if (this->session.active) {
+		// Goes out between audio frames, without stopping the song.
+		queue_frame(MESSAGE_FRAME, std::move(data_to_send));
+		continue_response(epoll_fd);
+		return;
+	}
+
+	// The sender lives inside this client and shares the data, so the only
+	// thing left to do is start sending.
+	this->sender.emplace<ArraySender>(std::move(data_to_send));
+	this->pace.active = false;
+	continue_response(epoll_fd);
 }
\ No newline at end of file
@@ -1,16 +1,114 @@
 #ifndef CONNECTEDCLIENT_H
 #define CONNECTEDCLIENT_H
 
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <vector>
 #include <string>
 
+#include "Catalog.h"
+#include "ChunkedDataSender.h"
+#include "IoPool.h"
+#include "IoUring.h"
+#include "RadioChannel.h"
+#include "SendScheduler.h"
+#include "Stats.h"
+#include "TimerWheel.h"
+
 using std::vector;
 using std::string;
 
 /**
- * Represents the state of a connected client.
+ * Represents the state of a connected client. A PAUSED client is in the
+ * middle of a paced song and is waiting for a timer before sending more, or
+ * is waiting for the IoPool to get a song ready. A QUEUED client has used up
+ * its turn and is waiting in the SendScheduler for another.
+ */
+enum ClientState { RECEIVING, SENDING, PAUSED, QUEUED };
+
+/**
+ * The kinds of timer a client can have on the TimerWheel.
+ */
+enum TimerKind { PACE_TIMER, RADIO_TIMER, WATCHDOG_TIMER };
+
+/**
+ * Keeps track of how far ahead of real-time playback a paced song is.
+ */
+struct PaceState {
+	bool active; // whether the current response is paced
+	uint64_t start_ms; // when we started sending the song
+	double byte_rate; // bytes per second of audio
+	double lead_bytes; // how far ahead of playback we're allowed to get
+	uint64_t bytes_sent; // bytes of the song sent so far
+	uint64_t timer_token; // token of the PACE_TIMER we're waiting on
+};
+
+/**
+ * Keeps track of where a client listening to a RadioChannel is in the
+ * broadcast.
+ */
+struct RadioState {
+	RadioChannel *channel; // channel being listened to, or NULL
+	uint64_t next_seq; // the chunk to send after the one in the sender
+	uint64_t timer_token; // token of the RADIO_TIMER we're waiting on
+};
+
+/**
+ * Kinds of frame sent to a client in a session. Each frame is the type (one
+ * byte), the payload length (four bytes, big-endian) and then the payload.
+ */
+enum FrameType : uint8_t {
+	AUDIO_FRAME = 1, // the next piece of the song
+	MESSAGE_FRAME = 2, // text reply to a command (e.g. list)
+	SONG_END_FRAME = 3, // the song finished or was stopped (no payload)
+};
+
+/**
+ * A frame waiting for its turn to be sent.
+ */
+struct QueuedFrame {
+	uint8_t type;
+	std::shared_ptr<const string> payload; // NULL if there's no payload
+};
+
+/**
+ * Keeps track of the frame being sent to a client in a session.
+ *
+ * Once a frame's header is out, the whole payload has to follow before
+ * anything else can go, so audio frames are only as big as what the socket
+ * buffer can take right away, letting replies and stops get in quickly.
+ */
+struct SessionState {
+	bool active; // whether the client has started a session
+	string header; // header of the current frame
+	size_t header_pos; // how much of the header has been sent
+	size_t frame_left; // payload bytes of the current frame left to send
+	bool frame_is_audio; // payload comes from the client's sender...
+	ChunkedDataSender frame_payload; // ...or from here
+	std::deque<QueuedFrame> queued; // frames waiting to go after this one
+};
+
+/**
+ * A song a client has asked the IoPool to load (see SongLoad), kept so the
+ * load can be asked for again after a hot restart.
+ */
+struct LoadRequest {
+	fs::path song;
+	double seconds; // where in the song to start
+	size_t max_offset; // never start past this offset
+};
+
+/**
+ * Where a client was in a song when it disconnected, so it can pick back up
+ * from there with the resume command.
  */
-enum ClientState { RECEIVING, SENDING };
+struct ResumePoint {
+	fs::path song;
+	double seconds; // how far into the song playback had got
+	size_t max_offset; // start of the last frame we actually sent
+};
 
 /**
  * Class that models a connected client.
@@ -22,46 +120,249 @@ class ConnectedClient {
   public:
 	// Member Variables (i.e. fields)
 	int client_fd;
-	ChunkedDataSender *sender;
+	uint32_t generation; // tells this client apart from others with its fd
+	ChunkedDataSender sender; // what we're in the middle of sending, if any
 	ClientState state;
+	uint32_t watched_events; // events epoll is watching for on client_fd
+	int send_buffer; // SO_SNDBUF of client_fd, as reported by the kernel
+	uint64_t send_buffer_checked_ms; // when we last asked for send_buffer
+	TimerWheel *timers; // the event loop's timers
+	SendScheduler *scheduler; // the event loop's turns at sending
+	size_t send_deficit; // bytes of its last turn the socket couldn't take
+	IoCompletions *completions; // where the event loop gets its song loads
+	LoopStats *stats; // the event loop's counters
+	IoUring *ring; // the event loop's io_uring, or NULL if it uses epoll
+	PaceState pace;
+	SessionState session;
+	RadioState radio;
+
+	// The song being streamed (empty if none), where in the file we started
+	// sending it from, and where that is in the song. It's only changed with
+	// set_current_song, so the stats can count its listeners.
+	fs::path current_song;
+	size_t song_offset;
+	double song_start_seconds;
+	uint64_t song_start_ms;
+	string resume_token; // handed out when a session starts (see resume)
+
+	uint64_t load_token; // token of the song being loaded, or 0 if none
+	LoadRequest loading; // what that song is
+	uint64_t loads_started; // how many songs we've asked the IoPool for
+	size_t readahead_end; // how far into current_song has been read ahead
+
+	// Songs to play after current_song, from the queue command. The first of
+	// them is loaded while current_song is still being sent, so it can
+	// follow on without a gap.
+	std::deque<fs::path> play_queue;
+	uint64_t prefetch_token; // token of play_queue.front()'s load, or 0
+	std::shared_ptr<SongLoad> prefetched; // that load, once it's finished
+
+	// The info reply the IoPool is reading in for us (see get_info), and
+	// which song it's for. No more commands are run until it's sent.
+	uint64_t info_token; // token of its load, or 0 if none
+	size_t info_song;
+
+	// When we last heard from the client or got anything more out to it,
+	// when we last got anything out to it, and the WATCHDOG_TIMER that
+	// checks on those.
+	uint64_t last_active_ms;
+	uint64_t last_sent_ms;
+	uint64_t watchdog_token;
+	uint64_t watchdog_ms; // when that timer goes off
+
+	string inbuf; // received bytes that aren't a whole command yet
+	bool running_commands; // whether run_commands is already on the stack
+
+	// Paced mode (-p): songs are sent at the rate they play, plus a lead of
+	// pace_lead_seconds, instead of as fast as the client can take them.
+	static bool pacing_enabled;
+	static double pace_lead_seconds;
+
+	// SO_SNDBUF to give each client's socket (-b), or 0 to leave it to the
+	// kernel's autotuning.
+	static int send_buffer_request;
+
+	// Edge-triggered mode (-e): clients are watched with EPOLLET, so epoll
+	// only reports each socket when it becomes readable or writable, and we
+	// read and write until EAGAIN every time it does.
+	static bool edge_triggered;
+
+	// A client with nothing on the go that sends us nothing for
+	// idle_timeout_ms (-I), or that takes none of a response for
+	// stall_timeout_ms while we're blocked sending it (-W), is hung up on.
+	// 0 turns the timeout off.
+	static uint64_t idle_timeout_ms;
+	static uint64_t stall_timeout_ms;
+
+	// Resume points of clients that disconnected mid-song, keyed by their
+	// resume tokens.
+	static std::map<string, ResumePoint> resume_points;
+	static std::mutex resume_lock;
 
 	// Constructors
 	/**
-	 * Constructor that takes the client's socket file descriptor and the
-	 * initial state of the client.
+	 * Constructor that takes the client's socket file descriptor, its
+	 * generation (see ClientSlab), the initial state of the client and the
+	 * timers, send scheduler, I/O completions, stats and io_uring (if any)
+	 * of its event loop.
 	 */
-	ConnectedClient(int fd, ClientState initial_state);
+	ConnectedClient(int fd, uint32_t fd_generation, ClientState initial_state,
+			TimerWheel *loop_timers, SendScheduler *loop_scheduler,
+			IoCompletions *loop_completions, LoopStats *loop_stats,
+			IoUring *loop_ring);
 
 	/**
 	 * No argument constructor.
 	 */
-	ConnectedClient() : client_fd(-1), sender(NULL), state(RECEIVING) {}
+	ConnectedClient() : client_fd(-1), generation(0), sender(), state(RECEIVING),
+		watched_events(0), send_buffer(0), send_buffer_checked_ms(0),
+		timers(NULL), scheduler(NULL), send_deficit(0), completions(NULL),
+		stats(NULL),
+		ring(NULL), pace(), session(),
+		radio(), song_offset(0), song_start_seconds(0), song_start_ms(0),
+		load_token(0), loading(), loads_started(0), readahead_end(0), play_queue(),
+		prefetch_token(0), prefetched(), info_token(0), info_song(0),
+		last_active_ms(0), last_sent_ms(0), watchdog_token(0),
+		watchdog_ms(0), running_commands(false) {}
 
 
 	// Member Functions (i.e. Methods)
+
+	/**
+	 * @return What to put in epoll_event.data for this client, so events
+	 * 	meant for an earlier client with the same fd can be spotted.
+	 */
+	uint64_t epoll_key() const {
+		return ((uint64_t)generation << 32) | (uint32_t)client_fd;
+	}
 	
 	/**
-	 * Sends a response of the current audio file to the client.
+	 * Sends a response of the current audio file to the client. The song is
+	 * got ready by the IoPool first, and sending starts in handle_loaded.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param file_path Path of the song.
+	 * @param start_seconds Where in the song to start.
+	 * @param max_offset Never start past this offset in the file.
+	 */
+	void send_audio(int epoll_fd, fs::path file_path, double start_seconds = 0,
+			size_t max_offset = SIZE_MAX);
+
+	/**
+	 * Sends several songs back to back on this connection, each starting as
+	 * soon as the one before it has been sent.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param songs Paths of the songs, in the order to play them.
+	 */
+	void queue_songs(int epoll_fd, const vector<fs::path> &songs);
+
+	/**
+	 * Starts sending a radio channel, from the chunk being heard right now.
+	 * The broadcast never ends, so it goes until the client stops it or
+	 * hangs up.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param channel The channel to listen to.
+	 */
+	void listen(int epoll_fd, RadioChannel *channel);
+
+	/**
+	 * Is called when the IoPool has got a song ready, and starts sending it
+	 * if it's still the one we want (or holds on to it, if it's the next
+	 * song in the queue). Info replies it has read in come back here too.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param load The song that was loaded.
+	 */
+	void handle_loaded(int epoll_fd, std::shared_ptr<SongLoad> load);
+
+	/**
+	 * Picks back up with the song a client was listening to when it
+	 * disconnected. Each session is given a token when it starts, which a
+	 * later connection hands back to say which client it was.
 	 *
 	 * @param epoll_fd File descriptor for epoll.
+	 * @param token The resume token the earlier session was given.
 	 */
-	void send_audio(int epoll_fd, fs::path file_path);
+	void resume(int epoll_fd, const string &token);
 	
 	/**
 	 * Is called after receiving an EPOLLOUT message and starts sending data
-	 * again.
+	 * again, up to one SendScheduler::QUANTUM plus the send_deficit left from
+	 * its last turn. Does nothing if the client is waiting for its turn.
 	 *
 	 * @param epoll_fd File descriptor for epoll.
 	 */
 	void continue_response(int epoll_fd);
 
+	/**
+	 * Is called by the SendScheduler when it's this client's turn to send.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 */
+	void take_turn(int epoll_fd);
+
+	/**
+	 * Is called when one of this client's timers goes off.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param timer The timer that went off.
+	 */
+	void handle_timer(int epoll_fd, const Timer &timer);
+
 
 	/**
 	 * Handles new input from the client.
 	 *
 	 * @param epoll_fd File descriptor for epoll.
+	 * @param catalog The songs being served.
+	 */
+	void handle_input(int epoll_fd, const Catalog &catalog);
+
+	/**
+	 * Handles input from the client that has already been read from its
+	 * socket (e.g. by a recv on the event loop's io_uring).
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param catalog The songs being served.
+	 * @param data What was read.
+	 * @param length How many bytes were read.
+	 */
+	void handle_received(int epoll_fd, const Catalog &catalog,
+			const char *data, size_t length);
+
+	/**
+	 * Saves everything about this client a new server process needs to
+	 * carry on exactly where we left off (see Handover). The client's
+	 * socket goes across separately.
+	 *
+	 * @return The saved state.
+	 */
+	string save_state() const;
+
+	/**
+	 * Picks up where a client of the old server process left off, from
+	 * what save_state saved there.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param saved The saved state.
+	 * @return false if the state couldn't be read, in which case the client
+	 * 	should be hung up on.
+	 */
+	bool restore_state(int epoll_fd, const string &saved);
+
+	/**
+	 * @return Every resume point, saved to hand over to a new server.
+	 */
+	static string save_resume_points();
+
+	/**
+	 * Adds the resume points handed over by the old server.
+	 *
+	 * @param saved What save_resume_points saved there.
 	 */
-	void handle_input(int epoll_fd, vector<fs::path> song_list);
+	static void restore_resume_points(const string &saved);
 
 	/**
 	 * Handles a close request from the client.
@@ -74,17 +375,27 @@ class ConnectedClient {
 	 * Lists songs from server.
 	 *
 	 * @param epoll_fd File descriptor for epoll.
-	 * @param song_list Paths to all songs
+	 * @param catalog The songs being served.
 	 */
-	void list(int epoll_fd, vector<fs::path> song_list);
+	void list(int epoll_fd, const Catalog &catalog);
 	/**
-	 * Gets .info file corresponding to .mp3, based off of index #
+	 * Gets .info file corresponding to .mp3, based off of index #. If it
+	 * hasn't been read in yet, the IoPool reads it and it's sent from
+	 * handle_loaded.
 	 *
 	 * @param epoll_fd File descriptor for epoll.
-	 * @param song_list Paths to all songs
+	 * @param catalog The songs being served.
 	 * @param song_index index of song
 	 */
-	void get_info(int epoll_fd, vector<fs::path> song_list, int song_index);
+	void get_info(int epoll_fd, const Catalog &catalog, int song_index);
+	/**
+	 * Sends the songs that best match a search, numbered as in the list.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param catalog The songs being served.
+	 * @param query What to search for.
+	 */
+	void search(int epoll_fd, const Catalog &catalog, const std::string &query);
 	/**
 	 * Server sending string to client
 	 *
@@ -92,6 +403,190 @@ class ConnectedClient {
 	 * @param DataToSend
 	 */
 	void send_message(int epoll_fd, string DataToSend);
+	/**
+	 * Server sending a string that may be shared with other clients (e.g.
+	 * a prebuilt reply from the Catalog), without copying it.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param data_to_send The string to send.
+	 */
+	void send_message(int epoll_fd, std::shared_ptr<const string> data_to_send);
+	/**
+	 * Turns down a play, queue or radio command, saying why. In a session
+	 * the client has already stopped its player and expects one SONG_END
+	 * for every such command, so whatever was playing is stopped (as the
+	 * command would have done) and a SONG_END follows the message.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param reason What was wrong with the command.
+	 */
+	void reject_audio_command(int epoll_fd, const string &reason);
+
+  private:
+	/**
+	 * Works out how many bytes we may send right now without getting too
+	 * far ahead of playback.
+	 *
+	 * @return 0 if we should wait, NO_LIMIT if the response isn't paced,
+	 * 	otherwise the number of bytes we may send.
+	 */
+	size_t pace_allowance();
+
+	/**
+	 * Works out how much more the socket buffer can take right now, from
+	 * SO_SNDBUF and how much is already queued in it (SIOCOUTQ).
+	 *
+	 * @return Estimate of the free space in the socket's send buffer.
+	 */
+	size_t send_space();
+
+	/**
+	 * Moves the sender on to the next chunk of the radio channel.
+	 *
+	 * @return false if that chunk hasn't been broadcast yet.
+	 */
+	bool next_radio_chunk();
+
+	/**
+	 * Stops sending until the radio channel broadcasts its next chunk,
+	 * setting a timer to pick back up.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 */
+	void wait_for_broadcast(int epoll_fd);
+
+	/**
+	 * Has the IoPool read the next part of the current song in, once we get
+	 * close enough to the end of what has been read ahead already.
+	 */
+	void read_ahead();
+
+	/**
+	 * Asks the IoPool to get a song ready to play.
+	 *
+	 * @param song Path of the song.
+	 * @param start_seconds Where in the song to start.
+	 * @param max_offset Never start past this offset in the file.
+	 * @return Token the load will come back to handle_loaded with.
+	 */
+	uint64_t start_load(const fs::path &song, double start_seconds,
+			size_t max_offset);
+
+	/**
+	 * Makes a loaded song the one being sent, then starts loading the song
+	 * queued up after it, if any. A paced song that follows straight on from
+	 * another picks up the pace where that one left off.
+	 *
+	 * @param load The song that was loaded.
+	 */
+	void start_song(SongLoad &load);
+
+	/**
+	 * Moves on to the next song in play_queue once the current one has all
+	 * been sent.
+	 *
+	 * @return true if the next song is ready to send now. If it's false and
+	 * 	load_token is set, the song is still loading and handle_loaded will
+	 * 	carry on with it.
+	 */
+	bool next_queued_song();
+
+	/**
+	 * Stops sending until we fall far enough behind our allowance, setting a
+	 * timer to pick back up.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 */
+	void pause_sending(int epoll_fd);
+
+	/**
+	 * Gets in line for another turn at sending.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 */
+	void wait_for_turn(int epoll_fd);
+
+	/**
+	 * Sets the WATCHDOG_TIMER to go off at the given time, replacing any
+	 * other.
+	 *
+	 * @param when_ms Monotonic time for it to go off.
+	 */
+	void arm_watchdog(uint64_t when_ms);
+
+	/**
+	 * Hangs up on the client without waiting for it to take what we've
+	 * already sent. The event loop cleans up once epoll reports the hang up.
+	 */
+	void hang_up();
+
+	/**
+	 * Changes current_song, keeping the count of each song's listeners up
+	 * to date.
+	 *
+	 * @param song The new song, or empty for none.
+	 */
+	void set_current_song(const fs::path &song);
+
+	/**
+	 * Switches to a new state, updating which events epoll watches for if
+	 * they changed.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param new_state The state to switch to.
+	 */
+	void set_state(int epoll_fd, ClientState new_state);
+
+	/**
+	 * Sends as many frames as we can to a client in a session.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param budget Most bytes to send. Whatever is sent is taken off it.
+	 */
+	void continue_session(int epoll_fd, size_t &budget);
+
+	/**
+	 * Adds a frame to the end of the queue of frames to send in a session.
+	 * A client that lets too many pile up isn't reading them, so it is hung
+	 * up on instead.
+	 *
+	 * @param type What kind of frame it is.
+	 * @param payload The payload of the frame (NULL if none).
+	 */
+	void queue_frame(uint8_t type, std::shared_ptr<const string> payload);
+
+	/**
+	 * Stops sending the current song (in a session, once the audio frame in
+	 * progress is finished), or forgets about the one being loaded, along
+	 * with any songs queued after it.
+	 */
+	void stop_audio();
+
+	/**
+	 * Runs every complete command in inbuf, stopping early if one of them
+	 * has a reply that can't be sent all at once.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param catalog The songs being served.
+	 */
+	void run_commands(int epoll_fd, const Catalog &catalog);
+
+	/**
+	 * Runs a single command.
+	 *
+	 * @param epoll_fd File descriptor for epoll.
+	 * @param catalog The songs being served.
+	 * @param command The text of the command (e.g. "play 3").
+	 */
+	void run_command(int epoll_fd, const Catalog &catalog,
+			const string &command);
+
+	/**
+	 * Saves where this client is in its song, if it was partway through
+	 * one, so it can resume from there after reconnecting. Working that out
+	 * needs the song's frame index, so it's done by the IoPool.
+	 */
+	void save_resume_point();
 };
 
 #endif
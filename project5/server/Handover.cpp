@@ -0,0 +1,491 @@
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "ConnectedClient.h"
+#include "Handover.h"
+
+using std::string;
+using std::vector;
+
+// Sent by the new server first, so the old one knows it's talking to a
+// server that saves and restores state the same way it does.
+const string HANDOVER_HELLO = "jukebox-handover-2";
+
+// How long the old server waits for whatever connects to the handover socket
+// to say hello, so something that connects and says nothing can't stop a
+// real new server from ever getting through.
+const int HELLO_TIMEOUT_SECONDS = 5;
+
+// Longest record we'll take before the other end has said hello, and after.
+// The length comes from the other end, so without a limit a bogus one could
+// have us try to allocate exabytes.
+const uint64_t MAX_HELLO_BYTES = 256;
+const uint64_t MAX_RECORD_BYTES = 1ULL << 30;
+
+// How long to wait before accepting again when accepting on the handover
+// socket failed (e.g. we're out of file descriptors), rather than spin
+const int HANDOVER_ACCEPT_RETRY_MS = 100;
+
+/**
+ * Kinds of record sent over the handover socket. Each record is its length
+ * (eight bytes), then its type (one byte), then its payload.
+ */
+enum HandoverRecord : uint8_t {
+	HELLO_RECORD = 1, // payload is HANDOVER_HELLO
+	LISTENER_RECORD = 2, // comes with a listening socket
+	CLIENT_RECORD = 3, // comes with a client socket; payload is its state
+	RESUME_RECORD = 4, // payload is the saved resume points
+	END_RECORD = 5, // nothing more to come
+};
+
+void StateWriter::put_u64(uint64_t value) {
+	data.append((const char *)&value, sizeof(value));
+}
+
+void StateWriter::put_double(double value) {
+	data.append((const char *)&value, sizeof(value));
+}
+
+void StateWriter::put_string(const string &value) {
+	put_u64(value.size());
+	data += value;
+}
+
+uint64_t StateReader::get_u64() {
+	uint64_t value = 0;
+	if (data.size() - pos < sizeof(value)) {
+		ok = false;
+		return 0;
+	}
+	memcpy(&value, data.data() + pos, sizeof(value));
+	pos += sizeof(value);
+	return value;
+}
+
+double StateReader::get_double() {
+	double value = 0;
+	if (data.size() - pos < sizeof(value)) {
+		ok = false;
+		return 0;
+	}
+	memcpy(&value, data.data() + pos, sizeof(value));
+	pos += sizeof(value);
+	return value;
+}
+
+string StateReader::get_string() {
+	uint64_t length = get_u64();
+	if (data.size() - pos < length) {
+		ok = false;
+		return string();
+	}
+	string value = data.substr(pos, length);
+	pos += length;
+	return value;
+}
+
+/**
+ * Sends a record over the handover socket.
+ *
+ * @param sock The handover socket (blocking).
+ * @param type What kind of record it is.
+ * @param payload The payload of the record.
+ * @param fd A descriptor to send along with it, or -1 for none.
+ * @return false if the other server has gone away.
+ */
+static bool send_record(int sock, uint8_t type, const string &payload,
+		int fd = -1) {
+	uint64_t length = payload.size() + 1;
+	string record((const char *)&length, sizeof(length));
+	record += (char)type;
+	record += payload;
+
+	struct iovec iov;
+	iov.iov_base = &record[0];
+	iov.iov_len = record.size();
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	if (fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (sent < 0) {
+		return false;
+	}
+
+	// A big record can still go in pieces; the descriptor went with the
+	// first one.
+	size_t total_sent = sent;
+	while (total_sent < record.size()) {
+		sent = send(sock, record.data() + total_sent,
+				record.size() - total_sent, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		total_sent += sent;
+	}
+	return true;
+}
+
+/**
+ * Reads exactly length bytes from a blocking socket.
+ *
+ * @return false if the other end went away first.
+ */
+static bool receive_all(int sock, char *data, size_t length) {
+	size_t total = 0;
+	while (total < length) {
+		ssize_t received = recv(sock, data + total, length - total, 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		total += received;
+	}
+	return true;
+}
+
+/**
+ * Receives a record sent with send_record.
+ *
+ * @param sock The handover socket (blocking).
+ * @param type Where to put the kind of record it is.
+ * @param payload Where to put the payload.
+ * @param fd Where to put the descriptor that came with it (-1 if none).
+ * @param max_length Longest record to accept.
+ * @return false if the other server has gone away (or sent a record longer
+ * 	than max_length).
+ */
+static bool receive_record(int sock, uint8_t &type, string &payload,
+		int &fd, uint64_t max_length = MAX_RECORD_BYTES) {
+	fd = -1;
+
+	// The descriptor comes with the first bytes of the record, so read
+	// those with recvmsg.
+	uint64_t length = 0;
+	struct iovec iov;
+	iov.iov_base = &length;
+	iov.iov_len = sizeof(length);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t received;
+	do {
+		received = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	} while (received < 0 && errno == EINTR);
+	if (received != (ssize_t)sizeof(length)) {
+		return false;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	if (length == 0 || length > max_length) {
+		return false;
+	}
+	string record(length, '\0');
+	if (!receive_all(sock, &record[0], length)) {
+		return false;
+	}
+	type = (uint8_t)record[0];
+	payload = record.substr(1);
+	return true;
+}
+
+/**
+ * Fills in the address of a Unix socket.
+ *
+ * @param path Path of the socket.
+ * @param addr The address to fill in.
+ */
+static void unix_address(const string &path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "ERROR: handover socket path is too long: " << path << "\n";
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path.c_str());
+}
+
+/**
+ * @param sock A connected Unix socket.
+ * @return Whether the process on the other end runs as the same user as us.
+ */
+static bool peer_is_us(int sock) {
+	struct ucred cred;
+	socklen_t cred_length = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_length) < 0) {
+		perror("handover SO_PEERCRED");
+		return false;
+	}
+	return cred.uid == geteuid();
+}
+
+Handover &Handover::instance() {
+	static Handover handover;
+	return handover;
+}
+
+bool Handover::take_over(const string &path, vector<int> &listeners,
+		vector<HandedOverClient> &clients) {
+	struct sockaddr_un addr;
+	unix_address(path, addr);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("handover socket");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return false; // nobody to take over from
+	}
+
+	if (!send_record(sock, HELLO_RECORD, HANDOVER_HELLO)) {
+		close(sock);
+		return false;
+	}
+
+	// Once the old server starts sending, its clients are ours: if it goes
+	// away partway through there's no way to get them back.
+	uint8_t type;
+	string payload;
+	int fd = -1;
+	while (true) {
+		if (!receive_record(sock, type, payload, fd)) {
+			std::cerr << "ERROR: old server went away during the handover\n";
+			exit(EXIT_FAILURE);
+		}
+		if (type == LISTENER_RECORD && fd >= 0) {
+			listeners.push_back(fd);
+		}
+		else if (type == CLIENT_RECORD && fd >= 0) {
+			HandedOverClient client;
+			client.fd = fd;
+			client.state = std::move(payload);
+			clients.push_back(std::move(client));
+		}
+		else if (type == RESUME_RECORD) {
+			ConnectedClient::restore_resume_points(payload);
+		}
+		else if (type == END_RECORD) {
+			break;
+		}
+		else if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	// Let the old server know it can go.
+	char ack = 1;
+	if (send(sock, &ack, 1, MSG_NOSIGNAL) < 0) {
+		perror("handover ack");
+	}
+	close(sock);
+	return true;
+}
+
+int Handover::add_loop() {
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+	wake_fds.push_back(fd);
+	return fd;
+}
+
+void Handover::start(const string &path) {
+	struct sockaddr_un addr;
+	unix_address(path, addr);
+
+	// If there was a server on the path, we've already taken over from it.
+	unlink(path.c_str());
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("handover socket");
+		exit(EXIT_FAILURE);
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("handover bind");
+		exit(EXIT_FAILURE);
+	}
+	// Whoever connects gets every client's socket, so only our own user may.
+	// (serve checks the peer's uid too, in case someone got in before this.)
+	if (chmod(path.c_str(), 0600) < 0) {
+		perror("handover chmod");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(sock, 1) < 0) {
+		perror("handover listen");
+		exit(EXIT_FAILURE);
+	}
+
+	std::thread(&Handover::serve, this, sock).detach();
+}
+
+/**
+ * Waits for a new server to connect, then hands everything over to it and
+ * exits. Runs in its own thread.
+ *
+ * @param listen_sock The handover socket.
+ */
+void Handover::serve(int listen_sock) {
+	int successor = -1;
+	while (true) {
+		successor = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (successor < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				perror("handover accept");
+				std::this_thread::sleep_for(
+						std::chrono::milliseconds(HANDOVER_ACCEPT_RETRY_MS));
+			}
+			continue;
+		}
+
+		struct timeval timeout;
+		timeout.tv_sec = HELLO_TIMEOUT_SECONDS;
+		timeout.tv_usec = 0;
+		if (setsockopt(successor, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+					sizeof(timeout)) < 0) {
+			perror("handover SO_RCVTIMEO");
+		}
+
+		uint8_t type;
+		string payload;
+		int fd = -1;
+		bool hello = peer_is_us(successor)
+			&& receive_record(successor, type, payload, fd, MAX_HELLO_BYTES)
+			&& type == HELLO_RECORD && payload == HANDOVER_HELLO;
+		if (fd >= 0) {
+			close(fd); // nothing should come with a hello
+		}
+		if (hello) {
+			break;
+		}
+		std::cerr << "Ignoring handover from something that isn't a"
+			<< " compatible server\n";
+		close(successor);
+	}
+
+	// From here on the new server may take a while (e.g. to restore every
+	// client before it acks), so wait for it as long as it takes.
+	struct timeval no_timeout;
+	no_timeout.tv_sec = 0;
+	no_timeout.tv_usec = 0;
+	setsockopt(successor, SOL_SOCKET, SO_RCVTIMEO, &no_timeout,
+			sizeof(no_timeout));
+
+	// Stop every event loop, and wait for them to give us their sockets.
+	uint64_t one = 1;
+	for (int fd : wake_fds) {
+		if (write(fd, &one, sizeof(one)) < 0) {
+			perror("handover wake");
+		}
+	}
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		loop_done.wait(guard, [this] { return loops_done == wake_fds.size(); });
+	}
+
+	char ack;
+	if (!send_everything(successor) || !receive_all(successor, &ack, 1)) {
+		std::cerr << "ERROR: new server went away during the handover\n";
+		_exit(EXIT_FAILURE);
+	}
+
+	std::cout << "Handed over " << clients.size() << " clients\n";
+	std::cout.flush();
+
+	// The new server holds its own references to every socket now, so ours
+	// can go with the process. Skip static destructors: the event loops and
+	// the IoPool's threads are still around.
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Sends the new server every listening socket and client the loops handed
+ * over, followed by the resume points.
+ *
+ * @param successor Socket connected to the new server.
+ * @return false if the new server went away.
+ */
+bool Handover::send_everything(int successor) {
+	for (int fd : listeners) {
+		if (!send_record(successor, LISTENER_RECORD, string(), fd)) {
+			return false;
+		}
+	}
+	for (const HandedOverClient &client : clients) {
+		if (!send_record(successor, CLIENT_RECORD, client.state, client.fd)) {
+			return false;
+		}
+	}
+	return send_record(successor, RESUME_RECORD,
+				ConnectedClient::save_resume_points())
+		&& send_record(successor, END_RECORD, string());
+}
+
+void Handover::hand_over(int listener, vector<HandedOverClient> loop_clients) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		listeners.push_back(listener);
+		for (HandedOverClient &client : loop_clients) {
+			clients.push_back(std::move(client));
+		}
+		loops_done++;
+	}
+	loop_done.notify_one();
+
+	// Our sockets aren't ours any more, so this loop is done. Wait here for
+	// the process to exit, rather than returning and having the loop's
+	// clients cleaned up while IoPool threads might still post to them.
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::hours(1));
+	}
+}
@@ -0,0 +1,138 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Builds up the saved state of something (e.g. a client) to hand over to a
+ * new server process.
+ */
+class StateWriter {
+  private:
+	std::string data;
+
+  public:
+	void put_u64(uint64_t value);
+	void put_double(double value);
+	void put_string(const std::string &value);
+
+	/**
+	 * @return Everything written so far.
+	 */
+	const std::string &str() const { return data; }
+};
+
+/**
+ * Reads back what a StateWriter wrote, in the same order. Reading past the
+ * end (e.g. state saved by a server that wrote something different) gives
+ * zeros and clears ok rather than crashing.
+ */
+class StateReader {
+  private:
+	const std::string &data;
+	size_t pos;
+
+  public:
+	bool ok; // false once we've tried to read past the end
+
+	/**
+	 * Constructor for StateReader class.
+	 *
+	 * @param saved What the StateWriter wrote.
+	 */
+	StateReader(const std::string &saved) : data(saved), pos(0), ok(true) {}
+
+	uint64_t get_u64();
+	double get_double();
+	std::string get_string();
+};
+
+/**
+ * A client handed over from the old server: its socket and its saved state
+ * (see ConnectedClient::save_state).
+ */
+struct HandedOverClient {
+	int fd;
+	std::string state;
+};
+
+/**
+ * Hot restart: hands the listening sockets and every connected client of a
+ * running server over to a new one, so a new build can be deployed without
+ * anyone's song being cut off.
+ *
+ * A server started with a handover socket path first tries to take over
+ * from a server already listening on it. The old server stops each of its
+ * event loops between events, then sends every listening socket and client
+ * socket across with SCM_RIGHTS, along with the client's saved state. The
+ * new server picks up each stream from the exact byte the old one got to.
+ * Connections that arrive in the meantime wait in the listening sockets'
+ * backlogs, which the new server inherits. Once it's done, the old server
+ * exits and the new one listens on the path for the next restart.
+ */
+class Handover {
+  private:
+	std::mutex lock;
+	std::condition_variable loop_done;
+	std::vector<int> wake_fds; // one eventfd per event loop
+	size_t loops_done; // loops that have handed over so far
+	std::vector<int> listeners; // handed over by the loops
+	std::vector<HandedOverClient> clients; // handed over by the loops
+
+	Handover() : loops_done(0) {}
+
+	void serve(int listen_sock);
+	bool send_everything(int successor);
+
+  public:
+	/**
+	 * @return The handover of the whole server.
+	 */
+	static Handover &instance();
+
+	/**
+	 * Takes over from the server listening on the given path, if there is
+	 * one.
+	 *
+	 * @param path Path of the handover socket.
+	 * @param listeners Where to put the old server's listening sockets.
+	 * @param clients Where to put the old server's clients.
+	 * @return false if no server was listening on the path.
+	 */
+	static bool take_over(const std::string &path, std::vector<int> &listeners,
+			std::vector<HandedOverClient> &clients);
+
+	/**
+	 * Makes an eventfd for an event loop to watch. It becomes readable when
+	 * a new server wants to take over, at which point the loop should call
+	 * hand_over. Must be called for every loop before start.
+	 *
+	 * @return The eventfd.
+	 */
+	int add_loop();
+
+	/**
+	 * Starts listening for a new server to hand over to.
+	 *
+	 * @param path Path of the handover socket.
+	 */
+	void start(const std::string &path);
+
+	/**
+	 * Is called by an event loop when its eventfd goes off. The loop's
+	 * sockets now belong to the new server, so this never returns; the
+	 * process exits once every loop has handed over.
+	 *
+	 * @param listener The loop's listening socket.
+	 * @param loop_clients The loop's clients.
+	 */
+	[[noreturn]] void hand_over(int listener,
+			std::vector<HandedOverClient> loop_clients);
+};
+
+#endif // HANDOVER_H
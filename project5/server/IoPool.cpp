@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "Catalog.h"
+#include "IoPool.h"
+#include "Mp3.h"
+#include "SongCache.h"
+
+// The first few KiB of frames is plenty to work out the bitrate.
+const size_t RATE_HEADER_BYTES = 64 * 1024;
+
+IoCompletions::IoCompletions() {
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+}
+
+IoCompletions::~IoCompletions() {
+	close(event_fd);
+}
+
+void IoCompletions::post(std::shared_ptr<SongLoad> load) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done.push_back(std::move(load));
+	}
+
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		perror("IoCompletions write");
+	}
+}
+
+void IoCompletions::take(std::vector<std::shared_ptr<SongLoad>> &loads) {
+	// Reset the eventfd before taking the loads, so one posted in between
+	// wakes the loop up again rather than being missed.
+	uint64_t count;
+	if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("IoCompletions read");
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	loads.insert(loads.end(), std::make_move_iterator(done.begin()),
+			std::make_move_iterator(done.end()));
+	done.clear();
+}
+
+IoPool &IoPool::instance() {
+	static IoPool pool;
+	return pool;
+}
+
+void IoPool::start(unsigned num_threads) {
+	for (unsigned i = 0; i < num_threads; i++) {
+		threads.emplace_back(&IoPool::run, this);
+	}
+}
+
+void IoPool::run() {
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			work_ready.wait(guard, [this] { return !jobs.empty(); });
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+	}
+}
+
+void IoPool::submit(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		jobs.push_back(std::move(job));
+	}
+	work_ready.notify_one();
+}
+
+/**
+ * Reads part of a song into the page cache, waiting until it's there. Must
+ * only be called from an I/O thread.
+ *
+ * @param song The song's mapping, or NULL if it is sent with sendfile.
+ * @param song_path Path of the song.
+ * @param offset Where to start reading.
+ * @param length How much to read.
+ */
+static void read_in(const std::shared_ptr<const MappedSong> &song,
+		const fs::path &song_path, size_t offset, size_t length) {
+	if (song) {
+		if (offset >= song->length) {
+			return;
+		}
+		length = std::min(length, song->length - offset);
+
+		// Start reading the whole range at once, then read through it so we
+		// don't return until it's all in memory and sending it can't wait on
+		// the disk. That's done with read() rather than by touching the
+		// mapped pages, which would crash us if the file had been truncated.
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t start = offset - offset % page;
+		madvise((void *)(song->data + start), offset + length - start,
+				MADV_WILLNEED);
+		std::vector<char> scratch(std::min(length, (size_t)64 * 1024));
+		for (size_t pos = offset; pos < offset + length; pos += scratch.size()) {
+			size_t wanted = std::min(scratch.size(), offset + length - pos);
+			if (song->read(pos, scratch.data(), wanted) < wanted) {
+				break; // the file got shorter
+			}
+		}
+	}
+	else {
+		// The page cache is shared, so reading ahead on our own fd warms it
+		// for the client's sendfile too.
+		int fd = open(song_path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+		readahead(fd, offset, length);
+		close(fd);
+	}
+}
+
+/**
+ * Does the work of IoPool::load_song.
+ *
+ * @param load The song to load.
+ */
+static void prepare_song(SongLoad &load) {
+	std::shared_ptr<const MappedSong> song =
+		SongCache::instance().acquire(load.song);
+
+	load.start_offset = 0;
+	load.start_seconds = 0;
+	if (load.seconds > 0) {
+		std::shared_ptr<const Mp3Index> index =
+			SongCache::instance().frame_index(load.song);
+		load.start_offset = std::min(index->offset_at(load.seconds),
+				load.max_offset);
+		load.start_seconds = std::min(load.seconds, index->duration());
+	}
+
+	// The rate is worked out from the first frames of audio, so look past
+	// the ID3v2 tag (which can be any size, e.g. with cover art) first.
+	int fd = song ? -1 : open(load.song.c_str(), O_RDONLY | O_CLOEXEC);
+	auto read_at = [&](size_t offset, std::vector<uint8_t> &buf) {
+		if (song) {
+			return song->read(offset, (char *)buf.data(), buf.size());
+		}
+		ssize_t num_read = fd >= 0
+			? pread(fd, buf.data(), buf.size(), offset) : 0;
+		return (size_t)std::max(num_read, (ssize_t)0);
+	};
+	std::vector<uint8_t> tag_header(10);
+	size_t audio_start = mp3_audio_start(tag_header.data(),
+			read_at(0, tag_header));
+	std::vector<uint8_t> frames(RATE_HEADER_BYTES);
+	load.byte_rate = mp3_byte_rate(frames.data(), read_at(audio_start, frames));
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	// Send from the shared mapping when the cache has room for this song,
+	// otherwise fall back to streaming the file on its own.
+	if (song) {
+		load.sender.emplace<MappedSender>(song, load.start_offset);
+	}
+	else {
+		load.sender.emplace<FileSender>(load.song, load.start_offset);
+	}
+
+	read_in(song, load.song, load.start_offset, READAHEAD_BYTES);
+}
+
+void IoPool::load_song(std::shared_ptr<SongLoad> load,
+		IoCompletions *completions) {
+	submit([load, completions]() {
+		prepare_song(*load);
+		completions->post(load);
+	});
+}
+
+void IoPool::load_info(std::shared_ptr<SongLoad> load,
+		IoCompletions *completions) {
+	submit([load, completions]() {
+		load->info = Catalog::read_info_response(load->song);
+		completions->post(load);
+	});
+}
+
+void IoPool::read_ahead(std::shared_ptr<const MappedSong> song,
+		const fs::path &song_path, size_t offset, size_t length) {
+	submit([song, song_path, offset, length]() {
+		read_in(song, song_path, offset, length);
+	});
+}
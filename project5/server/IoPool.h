@@ -0,0 +1,165 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ChunkedDataSender.h"
+
+namespace fs = std::filesystem;
+
+class MappedSong;
+
+// How much of a song to have read in ahead of where we're sending from
+const size_t READAHEAD_BYTES = 1024 * 1024;
+
+/**
+ * A song a client asked to play, being got ready by an IoPool thread: the
+ * file is opened (or mapped), the spot to start from is looked up in its
+ * frame index if needed, and the first READAHEAD_BYTES from there are read
+ * in, so the event loop can start sending without touching the disk. Or,
+ * for the info command, the song's .info file is read in (see
+ * IoPool::load_info).
+ */
+struct SongLoad {
+	uint64_t client_key; // ConnectedClient::epoll_key of who asked for it
+	uint64_t token; // tells this load apart from others by the same client
+	fs::path song;
+	double seconds; // where in the song to start (0 for the beginning)
+	size_t max_offset; // never start past this offset (e.g. for resume)
+
+	// Filled in by the I/O thread
+	ChunkedDataSender sender; // ready to send from start_offset
+	size_t start_offset; // offset of the frame we start at
+	double start_seconds; // where in the song that frame is
+	double byte_rate; // bytes per second of audio (0 if unknown)
+	std::shared_ptr<const std::string> info; // reply to info, for an info load
+};
+
+/**
+ * Where an IoPool sends back the song loads of one event loop. An eventfd
+ * in the loop's epoll becomes readable when there are loads waiting, so
+ * they are picked up by the loop thread along with its other events.
+ */
+class IoCompletions {
+  private:
+	int event_fd;
+	std::mutex lock;
+	std::vector<std::shared_ptr<SongLoad>> done; // finished, not yet taken
+
+  public:
+	/**
+	 * Constructor for IoCompletions class. Creates the eventfd.
+	 */
+	IoCompletions();
+
+	/**
+	 * Destructor for IoCompletions class. Closes the eventfd.
+	 */
+	~IoCompletions();
+
+	IoCompletions(const IoCompletions &) = delete;
+	IoCompletions &operator=(const IoCompletions &) = delete;
+
+	/**
+	 * @return The eventfd to watch for EPOLLIN.
+	 */
+	int fd() const { return event_fd; }
+
+	/**
+	 * Hands a finished load back to the event loop. Called from an I/O
+	 * thread.
+	 *
+	 * @param load The finished load.
+	 */
+	void post(std::shared_ptr<SongLoad> load);
+
+	/**
+	 * Takes every load that has finished since the last call. Called from
+	 * the event loop once the eventfd is readable.
+	 *
+	 * @param loads Where to put the finished loads.
+	 */
+	void take(std::vector<std::shared_ptr<SongLoad>> &loads);
+};
+
+/**
+ * A few threads that do the file work that could block: opening and
+ * mapping songs, building frame indexes and reading songs in ahead of the
+ * clients sending them. On a cold cache or a busy disk any of these can
+ * take a while, and doing them on an event loop would stall every one of
+ * its clients in the meantime.
+ */
+class IoPool {
+  private:
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable work_ready;
+	std::deque<std::function<void()>> jobs;
+
+	IoPool() {}
+
+	void run();
+
+  public:
+	/**
+	 * @return The pool shared by the whole server.
+	 */
+	static IoPool &instance();
+
+	/**
+	 * Starts the pool's threads. Must be called once, before anything is
+	 * submitted.
+	 *
+	 * @param num_threads Number of threads to run.
+	 */
+	void start(unsigned num_threads);
+
+	/**
+	 * Runs a job on one of the pool's threads.
+	 *
+	 * @param job The job.
+	 */
+	void submit(std::function<void()> job);
+
+	/**
+	 * Gets a song ready to play, then posts it to the given completions.
+	 *
+	 * @param load What to load. Only the fields up to max_offset need to be
+	 * 	filled in.
+	 * @param completions Where to send the load once it's ready.
+	 */
+	void load_song(std::shared_ptr<SongLoad> load, IoCompletions *completions);
+
+	/**
+	 * Reads the reply to info for a song, then posts it to the given
+	 * completions.
+	 *
+	 * @param load What to load. Only client_key, token and song need to be
+	 * 	filled in.
+	 * @param completions Where to send the load once it's ready.
+	 */
+	void load_info(std::shared_ptr<SongLoad> load, IoCompletions *completions);
+
+	/**
+	 * Reads part of a song in ahead of when it's going to be sent.
+	 *
+	 * @param song The song's mapping, or NULL if it is sent with sendfile.
+	 * @param song_path Path of the song.
+	 * @param offset Where to start reading.
+	 * @param length How much to read.
+	 */
+	void read_ahead(std::shared_ptr<const MappedSong> song,
+			const fs::path &song_path, size_t offset, size_t length);
+};
+
+#endif // IOPOOL_H
@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "IoUring.h"
+
+/*
+ * glibc has no wrappers for the io_uring system calls (that's what liburing
+ * is for), so these call them directly.
+ */
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit,
+		unsigned min_complete, unsigned flags, const void *arg,
+		size_t arg_size) {
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+			flags, arg, arg_size);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg,
+		unsigned nr_args) {
+	return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/**
+ * Makes a ring, asking for the kernel to leave completion work until we
+ * call enter (which we do every time around the loop anyway) if it can.
+ *
+ * @param entries Size of the submission queue.
+ * @param params Where to put what the kernel set up.
+ * @return The ring's file descriptor, or -1 if it couldn't be made.
+ */
+static int setup_ring(unsigned entries, struct io_uring_params &params) {
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER
+		| IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = entries * 4;
+	int fd = io_uring_setup(entries, &params);
+	if (fd < 0 && errno == EINVAL) {
+		// Older kernel: plain task work will do.
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 4;
+		fd = io_uring_setup(entries, &params);
+	}
+	return fd;
+}
+
+bool IoUring::supported() {
+	struct io_uring_params params;
+	int fd = setup_ring(4, params);
+	if (fd < 0) {
+		return false; // no io_uring at all, or it's been turned off
+	}
+
+	// IORING_REGISTER_SYNC_CANCEL came along in the same release as
+	// multishot recv. Asking it to cancel nothing gives ENOENT if it's
+	// there, and EINVAL if it isn't.
+	struct io_uring_sync_cancel_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = UINT64_MAX;
+	reg.fd = -1;
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	bool ok = (params.features & IORING_FEAT_SINGLE_MMAP)
+		&& (params.features & IORING_FEAT_EXT_ARG)
+		&& io_uring_register(fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0
+		&& errno == ENOENT;
+	close(fd);
+	return ok;
+}
+
+IoUring::IoUring(unsigned entries, unsigned buffer_count,
+		size_t buffer_bytes) :
+	to_submit(0), num_buffers(buffer_count), buffer_size(buffer_bytes),
+	buf_tail(0) {
+	struct io_uring_params params;
+	ring_fd = setup_ring(entries, params);
+	if (ring_fd < 0) {
+		perror("io_uring_setup");
+		exit(EXIT_FAILURE);
+	}
+
+	// With IORING_FEAT_SINGLE_MMAP (checked by supported), both queues'
+	// rings are in one mapping.
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	ring_mem_size = std::max(sq_size, cq_size);
+	ring_mem = mmap(NULL, ring_mem_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+			IORING_OFF_SQES);
+	if (ring_mem == MAP_FAILED || sqes == MAP_FAILED) {
+		perror("io_uring mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	char *ring = (char *)ring_mem;
+	sq_head = (unsigned *)(ring + params.sq_off.head);
+	sq_tail = (unsigned *)(ring + params.sq_off.tail);
+	sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+	sq_array = (unsigned *)(ring + params.sq_off.array);
+	cq_head = (unsigned *)(ring + params.cq_off.head);
+	cq_tail = (unsigned *)(ring + params.cq_off.tail);
+	cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	// Each SQE always sits in the same slot of the array.
+	for (unsigned i = 0; i < params.sq_entries; i++) {
+		sq_array[i] = i;
+	}
+
+	// Set up the buffers recvs go into, and tell the kernel about them.
+	buf_ring_size = num_buffers * sizeof(struct io_uring_buf);
+	buf_ring = (struct io_uring_buf_ring *)mmap(NULL, buf_ring_size,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	buffers = (char *)mmap(NULL, num_buffers * buffer_size,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf_ring == MAP_FAILED || buffers == MAP_FAILED) {
+		perror("io_uring buffers mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)buf_ring;
+	reg.ring_entries = num_buffers;
+	reg.bgid = BUFFER_GROUP;
+	if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		perror("io_uring_register PBUF_RING");
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned i = 0; i < num_buffers; i++) {
+		struct io_uring_buf &buf = buf_slot(i);
+		buf.addr = (uint64_t)(buffers + i * buffer_size);
+		buf.len = buffer_size;
+		buf.bid = i;
+	}
+	buf_tail = num_buffers;
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+IoUring::~IoUring() {
+	// Closing the ring cancels whatever is still going.
+	close(ring_fd);
+	munmap(sqes, sqes_size);
+	munmap(ring_mem, ring_mem_size);
+	munmap(buffers, num_buffers * buffer_size);
+	munmap(buf_ring, buf_ring_size);
+}
+
+/**
+ * @return A cleared SQE to fill in, which goes to the kernel on the next
+ * 	enter. If the submission queue is full, what's in it is sent now.
+ */
+struct io_uring_sqe *IoUring::next_sqe() {
+	unsigned tail = *sq_tail;
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) {
+		enter(0);
+	}
+
+	struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	to_submit++;
+	return sqe;
+}
+
+void IoUring::accept_multishot(int listen_fd, uint64_t user_data) {
+	struct io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = user_data;
+}
+
+void IoUring::recv_multishot(int fd, uint64_t user_data) {
+	struct io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->user_data = user_data;
+}
+
+void IoUring::poll(int fd, uint32_t events, uint64_t user_data,
+		bool multishot) {
+	struct io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = user_data;
+}
+
+void IoUring::cancel(uint64_t user_data) {
+	struct io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = ring_key(CANCEL_OP, 0);
+}
+
+void IoUring::cancel_all() {
+	// Send anything still queued, so it's cancelled along with the rest.
+	enter(0);
+
+	struct io_uring_sync_cancel_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.fd = -1;
+	reg.flags = IORING_ASYNC_CANCEL_ANY;
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	if (io_uring_register(ring_fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0
+			&& errno != ENOENT) {
+		perror("io_uring_register SYNC_CANCEL");
+		exit(EXIT_FAILURE);
+	}
+
+	// Get their completions into the queue.
+	enter(0);
+}
+
+void IoUring::enter(int timeout_ms) {
+	unsigned flags = IORING_ENTER_GETEVENTS;
+	unsigned min_complete = timeout_ms == 0 ? 0 : 1;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	const void *argp = NULL;
+	size_t arg_size = 0;
+	if (timeout_ms > 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		arg_size = sizeof(arg);
+	}
+
+	int submitted = io_uring_enter(ring_fd, to_submit, min_complete, flags,
+			argp, arg_size);
+	if (submitted < 0) {
+		// Timing out or being interrupted just means going around the
+		// loop again. EBUSY means completions need taking before the
+		// kernel can post more, which the loop is about to do.
+		if (errno != ETIME && errno != EINTR && errno != EBUSY
+				&& errno != EAGAIN) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else {
+		// Anything the kernel didn't take yet is still in the queue for
+		// next time.
+		to_submit -= std::min((unsigned)submitted, to_submit);
+	}
+}
+
+bool IoUring::next_completion(struct io_uring_cqe &cqe) {
+	unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	cqe = cqes[head & cq_mask];
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+struct io_uring_buf &IoUring::buf_slot(unsigned index) {
+	// Not buf_ring->bufs: in C++ the header's flexible array member ends up
+	// 8 bytes into the ring rather than at the start, where the kernel looks.
+	return ((struct io_uring_buf *)buf_ring)[index & (num_buffers - 1)];
+}
+
+const char *IoUring::buffer(const struct io_uring_cqe &cqe) const {
+	uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+	return buffers + bid * buffer_size;
+}
+
+void IoUring::recycle(const struct io_uring_cqe &cqe) {
+	uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+	struct io_uring_buf &buf = buf_slot(buf_tail);
+	buf.addr = (uint64_t)(buffers + bid * buffer_size);
+	buf.len = buffer_size;
+	buf.bid = bid;
+	buf_tail++;
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,209 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+
+/**
+ * What a request on an event loop's IoUring is for. It goes in the top byte
+ * of the request's user_data (see ring_key).
+ */
+enum RingOp : uint8_t {
+	ACCEPT_OP, // multishot accept on the loop's listening socket
+	RECV_OP, // multishot recv on a client's socket
+	WRITABLE_OP, // poll for room in a client's socket buffer
+	COMPLETIONS_OP, // multishot poll on the loop's IoCompletions eventfd
+	HANDOVER_OP, // poll on the loop's handover eventfd
+	CANCEL_OP, // cancelling one of the above
+};
+
+/**
+ * Makes the user_data for a request about a client: the RingOp, then the
+ * client's fd and generation (see ConnectedClient::epoll_key). The fd gets
+ * 24 bits, which is more than the kernel will hand out (see fs.nr_open).
+ *
+ * @param op What the request is for.
+ * @param epoll_key The client's epoll_key, or just an fd for requests that
+ * 	aren't about a client.
+ * @return The user_data.
+ */
+inline uint64_t ring_key(RingOp op, uint64_t epoll_key) {
+	return ((uint64_t)op << 56) | ((epoll_key & 0xffffff) << 32)
+		| (epoll_key >> 32);
+}
+
+/**
+ * @param user_data A request's user_data, as made by ring_key.
+ * @return What the request was for.
+ */
+inline RingOp ring_op(uint64_t user_data) {
+	return (RingOp)(user_data >> 56);
+}
+
+/**
+ * @param user_data A request's user_data, as made by ring_key.
+ * @return The epoll_key of the client the request was for.
+ */
+inline uint64_t ring_client_key(uint64_t user_data) {
+	return ((user_data & 0xffffffff) << 32) | ((user_data >> 32) & 0xffffff);
+}
+
+/**
+ * An io_uring, driven with the raw system calls, for an event loop that
+ * wants to hear about hundreds of sockets with a single io_uring_enter.
+ *
+ * Requests are queued up by the methods below and only go to the kernel on
+ * the next call to enter, which also waits for completions. Clients'
+ * sockets are read with multishot recvs into a ring of buffers the kernel
+ * picks from (a provided buffer ring), so a client that's sent nothing
+ * doesn't tie up a buffer.
+ *
+ * Only the thread that made the ring may use it.
+ */
+class IoUring {
+  private:
+	int ring_fd;
+
+	// Submission queue, shared with the kernel
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned to_submit; // queued since the last enter
+
+	// Completion queue, shared with the kernel
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_mem;
+	size_t ring_mem_size;
+	size_t sqes_size;
+
+	// The provided buffer ring, and the buffers in it
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *buffers;
+	unsigned num_buffers;
+	size_t buffer_size;
+	uint16_t buf_tail;
+
+	struct io_uring_sqe *next_sqe();
+	struct io_uring_buf &buf_slot(unsigned index);
+
+  public:
+	// Buffer group the buffer ring is registered as
+	static const uint16_t BUFFER_GROUP = 0;
+
+	/**
+	 * Constructor for IoUring class. Sets up the ring and registers the
+	 * buffer ring, exiting if the kernel can't (call supported first).
+	 *
+	 * @param entries Size of the submission queue (a power of two). The
+	 * 	completion queue is made bigger, since multishot requests can
+	 * 	complete many times.
+	 * @param buffer_count Number of buffers for recvs (a power of two).
+	 * @param buffer_bytes Size of each of those buffers.
+	 */
+	IoUring(unsigned entries = 1024, unsigned buffer_count = 512,
+			size_t buffer_bytes = 4096);
+
+	/**
+	 * Destructor for IoUring class. Anything still going is cancelled.
+	 */
+	~IoUring();
+
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+
+	/**
+	 * Checks whether this kernel has everything an event loop needs
+	 * (multishot recv, provided buffer rings and synchronous cancellation
+	 * all arrived in Linux 6.0), so the server can fall back to epoll if
+	 * not.
+	 *
+	 * @return true if it does.
+	 */
+	static bool supported();
+
+	/**
+	 * Accepts connections on a listening socket until cancelled, or until
+	 * the accept fails (the completion won't have IORING_CQE_F_MORE set).
+	 * Accepted sockets are non-blocking.
+	 *
+	 * @param listen_fd The listening socket.
+	 * @param user_data Comes back with each completion.
+	 */
+	void accept_multishot(int listen_fd, uint64_t user_data);
+
+	/**
+	 * Receives into the provided buffers whenever data arrives on a socket,
+	 * until cancelled, the peer hangs up, or we run out of buffers (the
+	 * completion won't have IORING_CQE_F_MORE set).
+	 *
+	 * @param fd The socket.
+	 * @param user_data Comes back with each completion.
+	 */
+	void recv_multishot(int fd, uint64_t user_data);
+
+	/**
+	 * Waits for a file descriptor to be ready.
+	 *
+	 * @param fd The file descriptor.
+	 * @param events Events to wait for (e.g. POLLOUT).
+	 * @param user_data Comes back with the completion.
+	 * @param multishot Whether to keep going after the first completion.
+	 */
+	void poll(int fd, uint32_t events, uint64_t user_data, bool multishot);
+
+	/**
+	 * Cancels a request. It completes with -ECANCELED (if it was still
+	 * going), and the cancel itself completes with CANCEL_OP.
+	 *
+	 * @param user_data The user_data the request was made with.
+	 */
+	void cancel(uint64_t user_data);
+
+	/**
+	 * Cancels every request, waiting until they have all stopped. Their
+	 * completions are then waiting to be taken with next_completion.
+	 */
+	void cancel_all();
+
+	/**
+	 * Sends the kernel everything queued since last time and waits for
+	 * completions, in a single system call.
+	 *
+	 * @param timeout_ms Most milliseconds to wait for a completion, 0 not
+	 * 	to wait, or -1 to wait for as long as it takes.
+	 */
+	void enter(int timeout_ms);
+
+	/**
+	 * Takes the next completion off the completion queue.
+	 *
+	 * @param cqe Where to put the completion.
+	 * @return false if there are no more.
+	 */
+	bool next_completion(struct io_uring_cqe &cqe);
+
+	/**
+	 * @param cqe A recv completion with IORING_CQE_F_BUFFER set.
+	 * @return The buffer the kernel received into.
+	 */
+	const char *buffer(const struct io_uring_cqe &cqe) const;
+
+	/**
+	 * Gives a buffer back to the kernel once we're done with what was
+	 * received into it.
+	 *
+	 * @param cqe The recv completion the buffer came with.
+	 */
+	void recycle(const struct io_uring_cqe &cqe);
+};
+
+#endif // IOURING_H
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include "Library.h"
+
+using std::string;
+using std::vector;
+
+// First line of an index file, so we don't go trusting something else
+const char INDEX_HEADER[] = "jukebox-index 1";
+
+Library::Library(fs::path music_dir, fs::path index_file, unsigned threads) :
+	root(std::move(music_dir)), index_path(std::move(index_file)),
+	num_threads(std::max(1u, threads)) {
+	if (!index_path.empty()) {
+		load_index();
+	}
+}
+
+/**
+ * Reads the index file into dirs. A missing or damaged index just means
+ * everything gets read again.
+ */
+void Library::load_index() {
+	std::ifstream index(index_path);
+	string line;
+	if (!index || !std::getline(index, line) || line != INDEX_HEADER) {
+		return;
+	}
+
+	// Each directory is a line with its mtime, how many songs and
+	// subdirectories it has, and its path, followed by their names one per
+	// line.
+	while (std::getline(index, line)) {
+		std::istringstream fields(line);
+		Directory dir;
+		size_t num_songs, num_subdirs;
+		string path;
+		if (!(fields >> dir.mtime_ns >> num_songs >> num_subdirs)
+				|| fields.get() != ' ' || !std::getline(fields, path)) {
+			break;
+		}
+		dir.songs.resize(num_songs);
+		dir.subdirs.resize(num_subdirs);
+		for (string &name : dir.songs) {
+			std::getline(index, name);
+		}
+		for (string &name : dir.subdirs) {
+			std::getline(index, name);
+		}
+		if (!index) {
+			break;
+		}
+		dirs.emplace(std::move(path), std::move(dir));
+	}
+
+	if (!index.eof()) {
+		std::cerr << "Ignoring damaged index file " << index_path << "\n";
+		dirs.clear();
+	}
+}
+
+/**
+ * Writes dirs to the index file. It's written to a temporary file that then
+ * replaces the old one, so a crash halfway through can't leave half an index.
+ */
+void Library::save_index() const {
+	fs::path temp_path = index_path;
+	temp_path += ".tmp";
+	std::ofstream index(temp_path, std::ios::trunc);
+	index << INDEX_HEADER << "\n";
+
+	for (const auto &entry : dirs) {
+		const Directory &dir = entry.second;
+
+		// Names are one per line, so a directory with a newline in a name
+		// is left out (and read again next time).
+		bool has_newline = entry.first.find('\n') != string::npos;
+		for (const string &name : dir.songs) {
+			has_newline |= name.find('\n') != string::npos;
+		}
+		for (const string &name : dir.subdirs) {
+			has_newline |= name.find('\n') != string::npos;
+		}
+		if (has_newline) {
+			continue;
+		}
+
+		index << dir.mtime_ns << " " << dir.songs.size() << " "
+			<< dir.subdirs.size() << " " << entry.first << "\n";
+		for (const string &name : dir.songs) {
+			index << name << "\n";
+		}
+		for (const string &name : dir.subdirs) {
+			index << name << "\n";
+		}
+	}
+
+	index.close();
+	if (!index) {
+		std::cerr << "Could not write index file " << temp_path << "\n";
+		return;
+	}
+	std::error_code err;
+	fs::rename(temp_path, index_path, err);
+	if (err) {
+		std::cerr << "Could not replace index file " << index_path << ": "
+			<< err.message() << "\n";
+	}
+}
+
+vector<fs::path> Library::scan(size_t &num_read) {
+	std::unordered_map<string, Directory> found;
+	std::atomic<size_t> reads(0);
+
+	// Directories waiting to be looked at, and how many threads are looking
+	// at one right now (and so might add more).
+	std::deque<string> to_visit = {root.string()};
+	unsigned busy = 0;
+	std::mutex lock;
+	std::condition_variable changed;
+
+	// Looks at one directory: the last scan's results if its mtime is the
+	// same, otherwise what's in it now. Returns false if it's gone.
+	auto visit = [&](const string &path, Directory &dir) {
+		struct stat info;
+		if (stat(path.c_str(), &info) < 0) {
+			return false;
+		}
+		dir.mtime_ns = (int64_t)info.st_mtim.tv_sec * 1000000000
+			+ info.st_mtim.tv_nsec;
+
+		// dirs isn't changed until every thread is done, so it's safe to
+		// read without the lock.
+		auto last = dirs.find(path);
+		if (last != dirs.end() && last->second.mtime_ns == dir.mtime_ns) {
+			dir.songs = last->second.songs;
+			dir.subdirs = last->second.subdirs;
+			return true;
+		}
+
+		reads++;
+		std::error_code err;
+		fs::directory_iterator it(path, err), end;
+		for (; !err && it != end; it.increment(err)) {
+			// Don't follow links to directories, which could lead round in
+			// circles.
+			std::error_code type_err;
+			fs::file_type type = it->symlink_status(type_err).type();
+			string name = it->path().filename().string();
+			if (type == fs::file_type::directory) {
+				dir.subdirs.push_back(std::move(name));
+			}
+			else if (it->path().extension() == ".mp3") {
+				dir.songs.push_back(std::move(name));
+			}
+		}
+		if (err) {
+			// Keep what we could read, but don't trust it next time.
+			std::cerr << "Could not read " << path << ": " << err.message()
+				<< "\n";
+			dir.mtime_ns = -1;
+		}
+		return true;
+	};
+
+	auto run = [&]() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			// Once nothing is waiting and nobody can add any more, we're done.
+			changed.wait(guard, [&] { return !to_visit.empty() || busy == 0; });
+			if (to_visit.empty()) {
+				return;
+			}
+			string path = std::move(to_visit.front());
+			to_visit.pop_front();
+			busy++;
+
+			guard.unlock();
+			Directory dir;
+			bool exists = visit(path, dir);
+			guard.lock();
+
+			busy--;
+			if (exists) {
+				for (const string &name : dir.subdirs) {
+					to_visit.push_back((fs::path(path) / name).string());
+				}
+				found.emplace(std::move(path), std::move(dir));
+			}
+			changed.notify_all();
+		}
+	};
+
+	vector<std::thread> threads;
+	for (unsigned i = 1; i < num_threads; i++) {
+		threads.emplace_back(run);
+	}
+	run();
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	vector<fs::path> songs;
+	for (const auto &entry : found) {
+		for (const string &name : entry.second.songs) {
+			songs.push_back(fs::path(entry.first) / name);
+		}
+	}
+
+	dirs = std::move(found);
+	if (!index_path.empty()) {
+		save_index();
+	}
+	num_read = reads;
+	return songs;
+}
+
+vector<fs::path> Library::directories() const {
+	vector<fs::path> paths;
+	for (const auto &entry : dirs) {
+		paths.push_back(entry.first);
+	}
+	return paths;
+}
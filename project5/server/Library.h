@@ -0,0 +1,69 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * Finds the songs in the music directory and everything below it.
+ *
+ * Directories are read by several threads at once, since with a big library
+ * on a slow disk most of the time goes on waiting for each directory to be
+ * read. What was found in each directory is remembered along with the
+ * directory's mtime, which changes whenever something in it is added,
+ * removed or renamed. A directory whose mtime hasn't changed since last time
+ * isn't read again, so a rescan after a change only reads the directories
+ * that changed, and (with an index file) a restart reads none at all.
+ */
+class Library {
+  private:
+	// What was found in one directory
+	struct Directory {
+		int64_t mtime_ns;
+		std::vector<std::string> songs; // names of the songs in it
+		std::vector<std::string> subdirs; // names of the directories in it
+	};
+
+	fs::path root;
+	fs::path index_path; // empty if there's no index file
+	unsigned num_threads;
+
+	// What we found last time, keyed by the directory's path
+	std::unordered_map<std::string, Directory> dirs;
+
+	void load_index();
+	void save_index() const;
+
+  public:
+	/**
+	 * Constructor for Library class. Loads the index file, if there is one.
+	 *
+	 * @param music_dir The music directory.
+	 * @param index_file Where to keep what was found between restarts, or
+	 * 	an empty path for nowhere.
+	 * @param threads Number of threads to read directories with.
+	 */
+	Library(fs::path music_dir, fs::path index_file, unsigned threads);
+
+	/**
+	 * Finds all the songs, reading only the directories that have changed
+	 * since the last scan, then saves the index file (if there is one).
+	 *
+	 * @param num_read Set to the number of directories that had to be read.
+	 * @return Paths of all the songs.
+	 */
+	std::vector<fs::path> scan(size_t &num_read);
+
+	/**
+	 * @return Paths of all the directories found by the last scan, including
+	 * 	the music directory itself.
+	 */
+	std::vector<fs::path> directories() const;
+};
+
+#endif // LIBRARY_H
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <cstring>
+
+#include "Mp3.h"
+
+// Bitrates in kbps, indexed by [table][bitrate index]. The tables are MPEG-1
+// layers I, II and III followed by MPEG-2/2.5 layer I and layers II/III.
+static const uint16_t BITRATES[5][16] = {
+	{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+	{0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+	{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+	{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+	{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+};
+
+// Sample rates indexed by [MPEG version bits][sample rate index]
+static const uint32_t SAMPLE_RATES[4][3] = {
+	{11025, 12000, 8000}, // MPEG 2.5
+	{0, 0, 0}, // reserved
+	{22050, 24000, 16000}, // MPEG 2
+	{44100, 48000, 32000}, // MPEG 1
+};
+
+// How many frames mp3_byte_rate looks at before settling on a rate.
+const int RATE_SAMPLE_FRAMES = 64;
+
+bool parse_mp3_frame(const uint8_t *data, size_t avail, Mp3Frame &frame) {
+	if (avail < 4 || data[0] != 0xff || (data[1] & 0xe0) != 0xe0) {
+		return false;
+	}
+
+	int version = (data[1] >> 3) & 0x3; // 0 = 2.5, 2 = 2, 3 = 1
+	int layer = (data[1] >> 1) & 0x3; // 1 = III, 2 = II, 3 = I
+	int bitrate_index = (data[2] >> 4) & 0xf;
+	int rate_index = (data[2] >> 2) & 0x3;
+	int padding = (data[2] >> 1) & 0x1;
+
+	if (version == 1 || layer == 0 || bitrate_index == 0
+			|| bitrate_index == 15 || rate_index == 3) {
+		// Reserved values, or "free format" which we can't size.
+		return false;
+	}
+
+	int table;
+	if (version == 3) {
+		table = 3 - layer; // layer I -> 0, II -> 1, III -> 2
+	}
+	else {
+		table = layer == 3 ? 3 : 4;
+	}
+
+	frame.bitrate = BITRATES[table][bitrate_index] * 1000;
+	frame.sample_rate = SAMPLE_RATES[version][rate_index];
+
+	if (layer == 3) {
+		frame.samples = 384;
+		frame.length = (12 * frame.bitrate / frame.sample_rate + padding) * 4;
+	}
+	else {
+		frame.samples = (layer == 1 && version != 3) ? 576 : 1152;
+		frame.length = frame.samples / 8 * frame.bitrate / frame.sample_rate
+			+ padding;
+	}
+	return true;
+}
+
+size_t mp3_audio_start(const uint8_t *data, size_t length) {
+	if (length < 10 || data[0] != 'I' || data[1] != 'D' || data[2] != '3') {
+		return 0;
+	}
+
+	// The tag size is stored as four 7-bit bytes ("syncsafe" integer) and
+	// doesn't include the 10 byte header, or the footer if there is one.
+	size_t tag_size = ((size_t)(data[6] & 0x7f) << 21)
+		| ((size_t)(data[7] & 0x7f) << 14)
+		| ((size_t)(data[8] & 0x7f) << 7)
+		| (size_t)(data[9] & 0x7f);
+	tag_size += 10;
+	if (data[5] & 0x10) {
+		tag_size += 10;
+	}
+	return tag_size;
+}
+
+/**
+ * Adds a Unicode code point to a UTF-8 string.
+ */
+static void append_utf8(std::string &out, uint32_t code) {
+	if (code < 0x80) {
+		out += (char)code;
+	}
+	else if (code < 0x800) {
+		out += (char)(0xc0 | (code >> 6));
+		out += (char)(0x80 | (code & 0x3f));
+	}
+	else if (code < 0x10000) {
+		out += (char)(0xe0 | (code >> 12));
+		out += (char)(0x80 | ((code >> 6) & 0x3f));
+		out += (char)(0x80 | (code & 0x3f));
+	}
+	else {
+		out += (char)(0xf0 | (code >> 18));
+		out += (char)(0x80 | ((code >> 12) & 0x3f));
+		out += (char)(0x80 | ((code >> 6) & 0x3f));
+		out += (char)(0x80 | (code & 0x3f));
+	}
+}
+
+/**
+ * Converts the text of an ID3 text frame to UTF-8. Several values (which
+ * ID3v2.4 separates with NULs) are joined with slashes.
+ *
+ * @param encoding The frame's encoding byte: 0 for ISO-8859-1, 1 for UTF-16
+ * 	with a byte order mark, 2 for UTF-16BE, 3 for UTF-8.
+ * @param data The text, after the encoding byte.
+ * @param length Number of bytes of text.
+ * @return The text in UTF-8.
+ */
+static std::string id3_text(uint8_t encoding, const uint8_t *data,
+		size_t length) {
+	std::string text;
+	if (encoding == 1 || encoding == 2) {
+		bool big_endian = encoding == 2;
+		uint32_t high_surrogate = 0;
+		for (size_t i = 0; i + 1 < length; i += 2) {
+			uint16_t unit = big_endian ? (data[i] << 8 | data[i + 1])
+				: (data[i + 1] << 8 | data[i]);
+			if (unit == 0xfeff || unit == 0xfffe) {
+				// A byte order mark, which starts each value
+				big_endian = unit == 0xfffe ? !big_endian : big_endian;
+				continue;
+			}
+			if (unit >= 0xd800 && unit < 0xdc00) {
+				high_surrogate = unit;
+				continue;
+			}
+			if (unit >= 0xdc00 && unit < 0xe000) {
+				if (high_surrogate != 0) {
+					append_utf8(text, 0x10000 + ((high_surrogate - 0xd800) << 10)
+							+ (unit - 0xdc00));
+				}
+				high_surrogate = 0;
+				continue;
+			}
+			high_surrogate = 0;
+			if (unit == 0) {
+				text += '/';
+			}
+			else {
+				append_utf8(text, unit);
+			}
+		}
+	}
+	else {
+		for (size_t i = 0; i < length; i++) {
+			if (data[i] == 0) {
+				text += '/';
+			}
+			else if (encoding == 0) {
+				append_utf8(text, data[i]);
+			}
+			else {
+				text += (char)data[i];
+			}
+		}
+	}
+
+	// Values end with a NUL, which shouldn't leave a slash behind.
+	while (!text.empty() && (text.back() == '/' || text.back() == ' ')) {
+		text.pop_back();
+	}
+	return text;
+}
+
+void parse_id3v2_tags(const uint8_t *data, size_t length, Mp3Tags &tags) {
+	if (length < 10 || data[0] != 'I' || data[1] != 'D' || data[2] != '3') {
+		return;
+	}
+	int version = data[3];
+	uint8_t flags = data[5];
+	if (version < 2 || version > 4 || (flags & 0x80)) {
+		// Unknown, or unsynchronised (which hardly anything writes).
+		return;
+	}
+
+	size_t end = std::min(length, mp3_audio_start(data, length));
+	size_t pos = 10;
+	if (version >= 3 && (flags & 0x40)) {
+		// Skip the extended header. Its size includes itself in 2.4 (where
+		// it's syncsafe) but not in 2.3.
+		if (pos + 4 > end) {
+			return;
+		}
+		if (version == 4) {
+			pos += ((size_t)(data[pos] & 0x7f) << 21)
+				| ((size_t)(data[pos + 1] & 0x7f) << 14)
+				| ((size_t)(data[pos + 2] & 0x7f) << 7)
+				| (size_t)(data[pos + 3] & 0x7f);
+		}
+		else {
+			pos += 4 + ((size_t)data[pos] << 24 | (size_t)data[pos + 1] << 16
+					| (size_t)data[pos + 2] << 8 | (size_t)data[pos + 3]);
+		}
+	}
+
+	// Frame IDs are three letters in 2.2 and four after that.
+	size_t id_length = version == 2 ? 3 : 4;
+	size_t header_length = version == 2 ? 6 : 10;
+	while (pos + header_length <= end && data[pos] != 0) {
+		const uint8_t *size = data + pos + id_length;
+		size_t frame_size;
+		if (version == 2) {
+			frame_size = (size_t)size[0] << 16 | (size_t)size[1] << 8 | size[2];
+		}
+		else if (version == 3) {
+			frame_size = (size_t)size[0] << 24 | (size_t)size[1] << 16
+				| (size_t)size[2] << 8 | size[3];
+		}
+		else {
+			frame_size = ((size_t)(size[0] & 0x7f) << 21)
+				| ((size_t)(size[1] & 0x7f) << 14)
+				| ((size_t)(size[2] & 0x7f) << 7) | (size_t)(size[3] & 0x7f);
+		}
+
+		std::string id((const char *)data + pos, id_length);
+		const uint8_t *body = data + pos + header_length;
+		pos += header_length + frame_size;
+		if (pos > end || frame_size < 2) {
+			break;
+		}
+
+		std::string *field = NULL;
+		if (id == "TIT2" || id == "TT2") {
+			field = &tags.title;
+		}
+		else if (id == "TPE1" || id == "TP1") {
+			field = &tags.artist;
+		}
+		else if (id == "TALB" || id == "TAL") {
+			field = &tags.album;
+		}
+		if (field != NULL && field->empty()) {
+			*field = id3_text(body[0], body + 1, frame_size - 1);
+		}
+	}
+}
+
+void parse_id3v1_tags(const uint8_t *data, size_t length, Mp3Tags &tags) {
+	if (length < 128) {
+		return;
+	}
+	data += length - 128;
+	if (data[0] != 'T' || data[1] != 'A' || data[2] != 'G') {
+		return;
+	}
+
+	// Title, artist and album are 30 bytes each, padded with NULs or spaces.
+	std::string *fields[] = {&tags.title, &tags.artist, &tags.album};
+	for (int i = 0; i < 3; i++) {
+		if (fields[i]->empty()) {
+			*fields[i] = id3_text(0, data + 3 + i * 30, 30);
+		}
+	}
+}
+
+double mp3_byte_rate(const uint8_t *data, size_t length) {
+	size_t pos = mp3_audio_start(data, length);
+	uint64_t total_bytes = 0;
+	double total_seconds = 0;
+	int frames_found = 0;
+
+	while (pos + 4 <= length && frames_found < RATE_SAMPLE_FRAMES) {
+		Mp3Frame frame;
+		Mp3Frame next;
+		// A lone 0xFF in the audio data can look like a header, so only
+		// trust frames that are followed by another frame (or the end).
+		if (parse_mp3_frame(data + pos, length - pos, frame)
+				&& (pos + frame.length + 4 > length
+					|| parse_mp3_frame(data + pos + frame.length,
+						length - pos - frame.length, next))) {
+			total_bytes += frame.length;
+			total_seconds += (double)frame.samples / frame.sample_rate;
+			frames_found++;
+			pos += frame.length;
+		}
+		else {
+			pos++;
+		}
+	}
+
+	if (total_seconds == 0) {
+		return 0;
+	}
+	return total_bytes / total_seconds;
+}
+
+Mp3Index::Mp3Index(const uint8_t *data, size_t length) : frame_seconds(0) {
+	size_t pos = mp3_audio_start(data, length);
+	size_t expected_pos = pos; // where the next frame is if there's no gap
+	size_t since_checkpoint = 0;
+
+	while (pos + 4 <= length) {
+		Mp3Frame frame;
+		Mp3Frame next;
+		if (parse_mp3_frame(data + pos, length - pos, frame)
+				&& frame.length <= UINT16_MAX
+				&& (pos + frame.length + 4 > length
+					|| parse_mp3_frame(data + pos + frame.length,
+						length - pos - frame.length, next))) {
+			// Bytes skipped to find this frame aren't in frame_lengths, so
+			// start a new run from here rather than count across them.
+			if (since_checkpoint == INTERVAL || pos != expected_pos
+					|| checkpoints.empty()) {
+				checkpoints.push_back(Checkpoint{
+						(uint32_t)frame_lengths.size(), (uint32_t)pos});
+				since_checkpoint = 0;
+			}
+			since_checkpoint++;
+			if (frame_seconds == 0) {
+				frame_seconds = (double)frame.samples / frame.sample_rate;
+			}
+			frame_lengths.push_back(frame.length);
+			pos += frame.length;
+			expected_pos = pos;
+		}
+		else {
+			// Lost sync (or haven't found it yet), so jump to the next 0xFF,
+			// which could be a sync word. memchr checks many bytes at a time
+			// with SIMD instructions, so this is much faster than stepping
+			// through one byte at a time.
+			const void *next_ff = memchr(data + pos + 1, 0xff, length - pos - 1);
+			if (next_ff == NULL) {
+				break;
+			}
+			pos = (const uint8_t *)next_ff - data;
+		}
+	}
+
+	this->checkpoints.shrink_to_fit();
+	this->frame_lengths.shrink_to_fit();
+}
+
+size_t Mp3Index::offset_at(double seconds) const {
+	if (frame_lengths.empty()) {
+		return 0;
+	}
+
+	size_t frame = 0;
+	if (seconds > 0) {
+		frame = (size_t)(seconds / frame_seconds);
+	}
+	// Past the end we give the offset just after the last frame, so there is
+	// nothing left to play.
+	bool past_end = frame >= frame_lengths.size();
+	if (past_end) {
+		frame = frame_lengths.size() - 1;
+	}
+
+	// Find the last checkpoint at or before the frame, then add up the
+	// lengths of the frames from there.
+	auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(),
+			frame, [](size_t f, const Checkpoint &c) { return f < c.frame; });
+	const Checkpoint &start = *(after - 1);
+	size_t offset = start.offset;
+	for (size_t i = start.frame; i < frame; i++) {
+		offset += frame_lengths[i];
+	}
+	if (past_end) {
+		offset += frame_lengths[frame];
+	}
+	return offset;
+}
+
+size_t Mp3Index::frame_start_before(size_t offset) const {
+	if (checkpoints.empty() || offset < checkpoints[0].offset) {
+		return 0;
+	}
+
+	// Find the last checkpoint at or before offset, then walk forward, but
+	// not past the next checkpoint, since there may be a gap before it.
+	auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(),
+			offset, [](size_t o, const Checkpoint &c) { return o < c.offset; });
+	const Checkpoint &start = *(after - 1);
+	size_t end_frame = after == checkpoints.end() ? frame_lengths.size()
+		: after->frame;
+	size_t frame_offset = start.offset;
+	for (size_t i = start.frame; i + 1 < end_frame; i++) {
+		if (frame_offset + frame_lengths[i] > offset) {
+			break;
+		}
+		frame_offset += frame_lengths[i];
+	}
+	return frame_offset;
+}
@@ -0,0 +1,143 @@
+#ifndef MP3_H
+#define MP3_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * The parts of an MPEG audio frame header that we care about.
+ */
+struct Mp3Frame {
+	uint32_t bitrate; // bits per second
+	uint32_t sample_rate; // samples per second
+	uint32_t samples; // samples in this frame
+	uint32_t length; // bytes in this frame, including the header
+};
+
+/**
+ * Parses the MPEG audio frame header at the given position.
+ *
+ * @param data Pointer to the possible start of a frame.
+ * @param avail Number of bytes available at data.
+ * @param frame Filled in with the frame's details if it is valid.
+ * @return true if data starts with a valid frame header.
+ */
+bool parse_mp3_frame(const uint8_t *data, size_t avail, Mp3Frame &frame);
+
+/**
+ * Finds where the audio frames start, skipping an ID3v2 tag if the file
+ * starts with one.
+ *
+ * @param data The start of the file.
+ * @param length Number of bytes available.
+ * @return Offset of the first byte after the tag (0 if there is no tag).
+ */
+size_t mp3_audio_start(const uint8_t *data, size_t length);
+
+/**
+ * What an MP3's ID3 tags say it is, in UTF-8. Anything the tags don't say is
+ * left empty.
+ */
+struct Mp3Tags {
+	std::string title;
+	std::string artist;
+	std::string album;
+};
+
+/**
+ * Reads the title, artist and album out of an ID3v2 tag (versions 2.2 to
+ * 2.4) at the start of a file. Fields already filled in are left alone.
+ *
+ * @param data The start of the file.
+ * @param length Number of bytes available (the whole tag, ideally, though
+ * 	the text frames usually come first).
+ * @param tags Filled in with what the tag says.
+ */
+void parse_id3v2_tags(const uint8_t *data, size_t length, Mp3Tags &tags);
+
+/**
+ * Reads the title, artist and album out of an ID3v1 tag, which is the last
+ * 128 bytes of a file. Fields already filled in are left alone.
+ *
+ * @param data The last 128 bytes of the file.
+ * @param length Number of bytes available (less than 128 means no tag).
+ * @param tags Filled in with what the tag says.
+ */
+void parse_id3v1_tags(const uint8_t *data, size_t length, Mp3Tags &tags);
+
+/**
+ * Works out how many bytes per second of audio an MP3 plays, averaged over
+ * the frames found in the given data (so VBR files get a sensible rate).
+ *
+ * @param data The start of the file, or of its audio (past any ID3v2 tag).
+ * @param length Number of bytes available (the first few KiB is enough).
+ * @return Bytes per second, or 0 if no frames could be found.
+ */
+double mp3_byte_rate(const uint8_t *data, size_t length);
+
+/**
+ * Index of where each frame of an MP3 starts, so we can start streaming from
+ * any point in a song without reading what comes before it.
+ *
+ * To keep it small, only every INTERVAL-th frame's offset is stored in full;
+ * the frames in between are found by adding up their lengths, which fit in
+ * two bytes each.
+ */
+class Mp3Index {
+  private:
+	static const size_t INTERVAL = 32;
+
+	// Where a run of frames starts. The frames after it follow one another
+	// with nothing in between, so their offsets are found by adding up their
+	// lengths.
+	struct Checkpoint {
+		uint32_t frame; // index of the frame
+		uint32_t offset; // its offset in the file
+	};
+
+	// Every INTERVAL-th frame, plus the first frame after any junk between
+	// frames (where the lengths no longer add up)
+	std::vector<Checkpoint> checkpoints;
+	std::vector<uint16_t> frame_lengths; // length of every frame
+	double frame_seconds; // how long one frame plays for
+
+  public:
+	/**
+	 * Builds the index by scanning the whole file for frames.
+	 *
+	 * @param data The start of the file.
+	 * @param length Length of the file.
+	 */
+	Mp3Index(const uint8_t *data, size_t length);
+
+	/**
+	 * @return Number of frames found in the file.
+	 */
+	size_t num_frames() const { return frame_lengths.size(); }
+
+	/**
+	 * @return How long the song plays for, in seconds.
+	 */
+	double duration() const { return frame_lengths.size() * frame_seconds; }
+
+	/**
+	 * Finds the frame that is playing at the given time.
+	 *
+	 * @param seconds Time from the start of the song.
+	 * @return Byte offset of the start of that frame (or the end of the
+	 * 	audio if seconds is past the end of the song).
+	 */
+	size_t offset_at(double seconds) const;
+
+	/**
+	 * Finds the last frame that starts at or before the given offset.
+	 *
+	 * @param offset Any byte offset in the file.
+	 * @return Byte offset of the start of that frame.
+	 */
+	size_t frame_start_before(size_t offset) const;
+};
+
+#endif // MP3_H
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include "Catalog.h"
+#include "Mp3.h"
+#include "RadioChannel.h"
+#include "TimerWheel.h"
+
+using std::string;
+using std::shared_ptr;
+
+// How far ahead of real time chunks are broadcast, so listeners have a bit
+// buffered up in case the network hiccups.
+const uint64_t RADIO_LEAD_MS = 2000;
+
+// A listener this far behind the live edge isn't really listening live any
+// more, so it's moved up to the chunk being heard right now.
+const uint64_t RADIO_MAX_LAG_MS = 10000;
+
+std::vector<std::unique_ptr<RadioChannel>> RadioChannel::channels;
+
+RadioChannel::RadioChannel(int channel_number) :
+	number(channel_number), ring(RING_CHUNKS), next_seq(0),
+	next_publish_ms(monotonic_ms()) {}
+
+void RadioChannel::start_channels(int num_channels) {
+	for (int i = 0; i < num_channels; i++) {
+		channels.emplace_back(new RadioChannel(i));
+	}
+	// Don't start any producers until the vector is done growing, since
+	// find is called from the event loops without a lock.
+	for (std::unique_ptr<RadioChannel> &channel : channels) {
+		std::thread(&RadioChannel::produce, channel.get()).detach();
+	}
+}
+
+RadioChannel *RadioChannel::find(int channel_number) {
+	if (channel_number < 0 || (size_t)channel_number >= channels.size()) {
+		return NULL;
+	}
+	return channels[channel_number].get();
+}
+
+/**
+ * Plays the catalog in order, starting with song number, forever. Runs in
+ * its own thread for the life of the server.
+ */
+void RadioChannel::produce() {
+	size_t song_number = this->number;
+	uint64_t play_ms = monotonic_ms() + RADIO_LEAD_MS;
+
+	while (true) {
+		shared_ptr<const Catalog> catalog = Catalog::current();
+		if (catalog->size() == 0) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			continue;
+		}
+		const fs::path &song =
+			catalog->song_list()[song_number % catalog->size()];
+		song_number++;
+
+		std::ifstream file(song, std::ios::binary);
+		string contents((std::istreambuf_iterator<char>(file)),
+				std::istreambuf_iterator<char>());
+		const uint8_t *data = (const uint8_t *)contents.data();
+
+		// Only the audio goes out, not the ID3v2 tag at the start or an
+		// ID3v1 tag at the end, which would be heard as noise between songs.
+		size_t pos = mp3_audio_start(data, contents.size());
+		size_t end = contents.size();
+		if (end - pos >= 128 && memcmp(data + end - 128, "TAG", 3) == 0) {
+			end -= 128;
+		}
+
+		// If nobody was around to keep up (e.g. the catalog was empty for a
+		// while), start again from now rather than bursting to catch up.
+		play_ms = std::max(play_ms, monotonic_ms() + RADIO_LEAD_MS);
+		uint64_t song_start_ms = play_ms;
+		double song_ms = 0; // how long the chunks so far play for
+
+		while (pos < end) {
+			// Chunks end on frame boundaries, so a listener who tunes in
+			// starts on a whole frame, and each chunk's length in time comes
+			// from the frames in it.
+			string chunk;
+			while (pos < end) {
+				Mp3Frame frame;
+				Mp3Frame next;
+				if (parse_mp3_frame(data + pos, end - pos, frame)
+						&& pos + frame.length <= end
+						&& (pos + frame.length + 4 > end
+							|| parse_mp3_frame(data + pos + frame.length,
+								end - pos - frame.length, next))) {
+					if (!chunk.empty()
+							&& chunk.size() + frame.length > CHUNK_BYTES) {
+						break;
+					}
+					chunk.append((const char *)data + pos, frame.length);
+					song_ms += frame.samples * 1000.0 / frame.sample_rate;
+					pos += frame.length;
+				}
+				else {
+					// Not a frame, so skip to the next 0xFF, which could be
+					// the start of one.
+					const void *next_ff = memchr(data + pos + 1, 0xff,
+							end - pos - 1);
+					pos = next_ff == NULL ? end
+						: (const uint8_t *)next_ff - data;
+				}
+			}
+			if (chunk.empty()) {
+				break;
+			}
+
+			uint64_t chunk_end_ms = song_start_ms + (uint64_t)song_ms;
+			uint64_t duration_ms = chunk_end_ms - play_ms;
+			uint64_t publish_ms = play_ms - RADIO_LEAD_MS;
+			uint64_t now = monotonic_ms();
+			if (publish_ms > now) {
+				std::this_thread::sleep_for(
+						std::chrono::milliseconds(publish_ms - now));
+			}
+
+			publish(std::make_shared<const string>(std::move(chunk)),
+					chunk_end_ms, publish_ms + duration_ms);
+			play_ms = chunk_end_ms;
+		}
+
+		if (play_ms == song_start_ms) {
+			// Not something we can play; don't spin if none of them are.
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+	}
+}
+
+/**
+ * Adds a chunk to the ring, replacing the oldest one.
+ *
+ * @param data The audio in the chunk.
+ * @param end_ms When the chunk after it is due to be heard.
+ * @param next_ms When the chunk after it will be broadcast.
+ */
+void RadioChannel::publish(shared_ptr<const string> data, uint64_t end_ms,
+		uint64_t next_ms) {
+	std::lock_guard<std::mutex> guard(lock);
+	Chunk &chunk = this->ring[this->next_seq % RING_CHUNKS];
+	chunk.data = std::move(data);
+	chunk.end_ms = end_ms;
+	this->next_seq++;
+	this->next_publish_ms = next_ms;
+}
+
+uint64_t RadioChannel::live_seq() {
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t now = monotonic_ms();
+	uint64_t oldest = this->next_seq - std::min(this->next_seq,
+			(uint64_t)RING_CHUNKS);
+	for (uint64_t seq = oldest; seq < this->next_seq; seq++) {
+		if (this->ring[seq % RING_CHUNKS].end_ms > now) {
+			return seq;
+		}
+	}
+	return this->next_seq;
+}
+
+shared_ptr<const string> RadioChannel::chunk(uint64_t &seq) {
+	uint64_t now = monotonic_ms();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		uint64_t oldest = this->next_seq - std::min(this->next_seq,
+				(uint64_t)RING_CHUNKS);
+		if (seq >= this->next_seq) {
+			return NULL; // not broadcast yet
+		}
+		if (seq >= oldest
+				&& this->ring[seq % RING_CHUNKS].end_ms + RADIO_MAX_LAG_MS > now) {
+			return this->ring[seq % RING_CHUNKS].data;
+		}
+	}
+
+	// They've fallen too far behind, so skip them up to the live edge.
+	seq = live_seq();
+	return chunk(seq);
+}
+
+uint64_t RadioChannel::next_chunk_ms() {
+	std::lock_guard<std::mutex> guard(lock);
+	return this->next_publish_ms;
+}
@@ -0,0 +1,97 @@
+#ifndef RADIOCHANNEL_H
+#define RADIOCHANNEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A live broadcast: one producer thread reads songs from the catalog, one
+ * after another, and cuts them into chunks at the rate they play. Every
+ * listener sends from the same chunks (see ArraySender), each at its own
+ * position, so a channel costs one read of each song no matter how many
+ * people are tuned in.
+ *
+ * The newest RING_CHUNKS chunks are kept in a ring. A listener that falls
+ * too far behind the live broadcast (or out of the ring altogether) is moved
+ * up to the live edge.
+ */
+class RadioChannel {
+  private:
+	struct Chunk {
+		std::shared_ptr<const std::string> data;
+		uint64_t end_ms; // when the chunk after it is due to be heard
+	};
+
+	int number; // which channel this is
+	std::mutex lock;
+	std::vector<Chunk> ring; // chunk seq is kept in ring[seq % RING_CHUNKS]
+	uint64_t next_seq; // sequence number the next chunk will get
+	uint64_t next_publish_ms; // when the producer will add the next chunk
+
+	void produce();
+	void publish(std::shared_ptr<const std::string> data, uint64_t end_ms,
+			uint64_t next_ms);
+
+	static std::vector<std::unique_ptr<RadioChannel>> channels;
+
+  public:
+	// Number of chunks kept for listeners to catch up on
+	static const size_t RING_CHUNKS = 64;
+
+	// Most bytes of audio in each chunk. Chunks are cut on frame
+	// boundaries, so most are a little shorter.
+	static const size_t CHUNK_BYTES = 16 * 1024;
+
+	/**
+	 * Constructor for RadioChannel class. The producer isn't started until
+	 * start_channels is called.
+	 *
+	 * @param channel_number Which channel this is. Channel N starts with the
+	 * 	catalog's song N.
+	 */
+	RadioChannel(int channel_number);
+
+	/**
+	 * @return Which channel this is.
+	 */
+	int channel_number() const { return number; }
+
+	/**
+	 * Creates the server's channels and starts their producers.
+	 *
+	 * @param num_channels Number of channels to broadcast.
+	 */
+	static void start_channels(int num_channels);
+
+	/**
+	 * @param channel_number The channel to look up.
+	 * @return The channel, or NULL if there is no such channel.
+	 */
+	static RadioChannel *find(int channel_number);
+
+	/**
+	 * @return Sequence number of the chunk being heard right now, which is
+	 * 	where a new listener starts.
+	 */
+	uint64_t live_seq();
+
+	/**
+	 * Gets the chunk a listener should send next.
+	 *
+	 * @param seq Sequence number of the chunk the listener wants. If it has
+	 * 	already dropped out of the ring, this is moved up to the live edge.
+	 * @return The chunk, or NULL if it hasn't been broadcast yet.
+	 */
+	std::shared_ptr<const std::string> chunk(uint64_t &seq);
+
+	/**
+	 * @return Monotonic time when the next chunk will be broadcast.
+	 */
+	uint64_t next_chunk_ms();
+};
+
+#endif // RADIOCHANNEL_H
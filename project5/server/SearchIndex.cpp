@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Mp3.h"
+#include "SearchIndex.h"
+
+using std::string;
+using std::vector;
+
+// Words are cut off at this many bytes (the query's too, so they still
+// match).
+const size_t MAX_TERM_BYTES = 32;
+// How much of an ID3v2 tag we read looking for the title, artist and album.
+// The text frames come first; what's past them is mostly cover art.
+const size_t MAX_TAG_BYTES = 64 * 1024;
+// How much of a .info file gets indexed
+const size_t MAX_INFO_BYTES = 16 * 1024;
+// Most terms a query word can match (the word itself, then the ones after it
+// in sorted order), so searching for "a" doesn't mean going through most of
+// the index.
+const uint32_t MAX_PREFIX_TERMS = 1024;
+// Words of a query past this many are ignored.
+const size_t MAX_QUERY_WORDS = 8;
+
+// Where in a song a term was found, kept in the bottom bits of each entry of
+// a posting list.
+const uint32_t IN_NAME = 1; // file name, directory name or tags
+const uint32_t IN_INFO = 2; // .info file
+const int FIELD_BITS = 2;
+
+// What a query word matching a term is worth
+const uint32_t NAME_SCORE = 4;
+const uint32_t INFO_SCORE = 1;
+const uint32_t WHOLE_WORD_FACTOR = 2; // the word is the whole term
+
+/**
+ * Splits text into lower case words. Anything that isn't an ASCII letter or
+ * digit separates words, except that bytes of UTF-8 characters are kept, so
+ * words with accents in them stay whole.
+ *
+ * @param text The text.
+ * @param words Where to add the words.
+ */
+static void split_words(const string &text, vector<string> &words) {
+	string word;
+	for (char c : text) {
+		unsigned char byte = c;
+		if ((byte >= 'a' && byte <= 'z') || (byte >= '0' && byte <= '9')
+				|| byte >= 0x80) {
+			if (word.size() < MAX_TERM_BYTES) {
+				word += c;
+			}
+		}
+		else if (byte >= 'A' && byte <= 'Z') {
+			if (word.size() < MAX_TERM_BYTES) {
+				word += (char)(byte - 'A' + 'a');
+			}
+		}
+		else if (!word.empty()) {
+			words.push_back(std::move(word));
+			word.clear();
+		}
+	}
+	if (!word.empty()) {
+		words.push_back(std::move(word));
+	}
+}
+
+/**
+ * Adds a number to a posting list, seven bits per byte with the top bit set
+ * on all but the last.
+ */
+static void put_varint(vector<uint8_t> &out, uint32_t value) {
+	while (value >= 0x80) {
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+/**
+ * Reads a number written by put_varint, moving pos past it.
+ */
+static uint32_t get_varint(const uint8_t *&pos) {
+	uint32_t value = 0;
+	int shift = 0;
+	while (*pos & 0x80) {
+		value |= (uint32_t)(*pos++ & 0x7f) << shift;
+		shift += 7;
+	}
+	return value | (uint32_t)*pos++ << shift;
+}
+
+SearchIndex::SearchIndex(const vector<fs::path> &songs,
+		const vector<SongText> &texts) : has_text(!texts.empty()) {
+	labels.resize(songs.size());
+
+	// The songs each term is in, in order, with the fields it was found in
+	// (in the bottom FIELD_BITS of each entry).
+	std::unordered_map<string, vector<uint32_t>> found;
+	vector<string> words;
+	auto add = [&](uint32_t song, const string &text, uint32_t field) {
+		words.clear();
+		split_words(text, words);
+		for (const string &word : words) {
+			vector<uint32_t> &songs_with = found[word];
+			if (!songs_with.empty() && songs_with.back() >> FIELD_BITS == song) {
+				songs_with.back() |= field;
+			}
+			else {
+				songs_with.push_back(song << FIELD_BITS | field);
+			}
+		}
+	};
+
+	for (uint32_t i = 0; i < songs.size(); i++) {
+		// The directory a song is in is often named after its album.
+		add(i, songs[i].stem().string(), IN_NAME);
+		add(i, songs[i].parent_path().filename().string(), IN_NAME);
+		if (has_text) {
+			add(i, texts[i].tags, IN_NAME);
+			add(i, texts[i].info, IN_INFO);
+			labels[i] = texts[i].label;
+		}
+	}
+
+	terms.reserve(found.size());
+	for (const auto &entry : found) {
+		terms.push_back(entry.first);
+	}
+	std::sort(terms.begin(), terms.end());
+
+	// Each posting list is the gaps between the songs rather than the songs
+	// themselves, since small numbers take fewer bytes.
+	posting_start.reserve(terms.size() + 1);
+	for (const string &term : terms) {
+		posting_start.push_back(postings.size());
+		auto entry = found.find(term);
+		uint32_t last_song = 0;
+		for (uint32_t song_field : entry->second) {
+			uint32_t song = song_field >> FIELD_BITS;
+			put_varint(postings, (song - last_song) << FIELD_BITS
+					| (song_field & (IN_NAME | IN_INFO)));
+			last_song = song;
+		}
+		found.erase(entry);
+	}
+	posting_start.push_back(postings.size());
+	postings.shrink_to_fit();
+
+	nodes.push_back(TrieNode{0, 0, (uint32_t)terms.size(), 0, 0});
+	build_trie(0, 0);
+	nodes.shrink_to_fit();
+}
+
+/**
+ * Adds the children of a trie node (and their children, and so on).
+ *
+ * @param node Index of the node, whose terms are already set.
+ * @param depth Length of the prefix the node stands for.
+ */
+void SearchIndex::build_trie(uint32_t node, size_t depth) {
+	uint32_t first = nodes[node].first_term;
+	uint32_t end = nodes[node].end_term;
+
+	// A term that is just the prefix sorts before all the longer ones.
+	if (first < end && terms[first].size() == depth) {
+		first++;
+	}
+
+	// Each run of terms with the same next byte gets a child.
+	uint32_t first_child = nodes.size();
+	while (first < end) {
+		uint8_t byte = terms[first][depth];
+		uint32_t next = first + 1;
+		while (next < end && (uint8_t)terms[next][depth] == byte) {
+			next++;
+		}
+		nodes.push_back(TrieNode{0, first, next, 0, byte});
+		first = next;
+	}
+	uint32_t num_children = nodes.size() - first_child;
+	nodes[node].first_child = first_child;
+	nodes[node].num_children = num_children;
+
+	for (uint32_t child = first_child; child < first_child + num_children;
+			child++) {
+		build_trie(child, depth + 1);
+	}
+}
+
+/**
+ * Finds the terms a query word matches: the ones that start with it, or at
+ * least the first MAX_PREFIX_TERMS of them.
+ *
+ * @param word The query word.
+ * @param matched Set to the terms.
+ * @return false if there aren't any.
+ */
+bool SearchIndex::word_terms(const string &word, WordTerms &matched) const {
+	uint32_t node = 0;
+	for (char c : word) {
+		const TrieNode &parent = nodes[node];
+		auto children = nodes.begin() + parent.first_child;
+		auto children_end = children + parent.num_children;
+		auto child = std::lower_bound(children, children_end, (uint8_t)c,
+				[](const TrieNode &n, uint8_t byte) { return n.byte < byte; });
+		if (child == children_end || child->byte != (uint8_t)c) {
+			return false;
+		}
+		node = child - nodes.begin();
+	}
+
+	matched.first = nodes[node].first_term;
+	matched.end = std::min(nodes[node].end_term,
+			matched.first + MAX_PREFIX_TERMS);
+	matched.whole_word = matched.first < matched.end
+		&& terms[matched.first] == word;
+	return matched.first < matched.end;
+}
+
+/**
+ * Goes through a posting list, calling visit(song, fields) for each song in
+ * it, in order.
+ */
+template <typename Visit>
+static void read_postings(const uint8_t *pos, const uint8_t *end,
+		Visit visit) {
+	uint32_t song = 0;
+	while (pos < end) {
+		uint32_t value = get_varint(pos);
+		song += value >> FIELD_BITS;
+		visit(song, value & (IN_NAME | IN_INFO));
+	}
+}
+
+/**
+ * @param fields Where a term was found in a song.
+ * @param whole_word Whether the query word was the whole term.
+ * @return What the query word matching the term is worth.
+ */
+static uint32_t match_score(uint32_t fields, bool whole_word) {
+	return ((fields & IN_NAME) ? NAME_SCORE : INFO_SCORE)
+		* (whole_word ? WHOLE_WORD_FACTOR : 1);
+}
+
+/**
+ * Finds the songs a query word matches.
+ *
+ * @param word The terms the word matches.
+ * @param matches Set to the songs, in order, with the best score any of
+ * 	their terms got.
+ */
+void SearchIndex::match_word(const WordTerms &word,
+		vector<SearchResult> &matches) const {
+	matches.clear();
+	if (word.end - word.first == 1) {
+		// A single posting list is already in order.
+		read_postings(postings.data() + posting_start[word.first],
+				postings.data() + posting_start[word.end],
+				[&](uint32_t song, uint32_t fields) {
+					matches.push_back(SearchResult{song,
+							match_score(fields, word.whole_word)});
+				});
+		return;
+	}
+
+	// Best score so far for each song, or 0. This is kept (and zeroed again)
+	// between searches, as every event loop searches over and over.
+	thread_local vector<uint32_t> best;
+	thread_local vector<uint32_t> touched;
+	size_t num_songs = labels.size();
+	if (best.size() < num_songs) {
+		best.resize(num_songs);
+	}
+	touched.clear();
+	for (uint32_t term = word.first; term < word.end; term++) {
+		bool whole_word = word.whole_word && term == word.first;
+		read_postings(postings.data() + posting_start[term],
+				postings.data() + posting_start[term + 1],
+				[&](uint32_t song, uint32_t fields) {
+					if (best[song] == 0) {
+						touched.push_back(song);
+					}
+					best[song] = std::max(best[song],
+							match_score(fields, whole_word));
+				});
+	}
+
+	// Put the songs in order. Sorting a few is quicker than going through
+	// every song, but not sorting a lot.
+	if (touched.size() * 16 < num_songs) {
+		std::sort(touched.begin(), touched.end());
+		for (uint32_t song : touched) {
+			matches.push_back(SearchResult{song, best[song]});
+			best[song] = 0;
+		}
+	}
+	else {
+		for (uint32_t song = 0; song < num_songs; song++) {
+			if (best[song] != 0) {
+				matches.push_back(SearchResult{song, best[song]});
+				best[song] = 0;
+			}
+		}
+	}
+}
+
+/**
+ * Keeps only the songs a query word also matches.
+ *
+ * @param word The terms the word matches.
+ * @param matches The songs matched so far, in order. The ones the word
+ * 	doesn't match are removed, and the others have the best score any of
+ * 	their terms got added.
+ */
+void SearchIndex::narrow_matches(const WordTerms &word,
+		vector<SearchResult> &matches) const {
+	vector<uint32_t> best(matches.size(), 0);
+	for (uint32_t term = word.first; term < word.end; term++) {
+		bool whole_word = word.whole_word && term == word.first;
+		// Both are in order, so walk along them together.
+		size_t i = 0;
+		read_postings(postings.data() + posting_start[term],
+				postings.data() + posting_start[term + 1],
+				[&](uint32_t song, uint32_t fields) {
+					while (i < matches.size() && matches[i].song < song) {
+						i++;
+					}
+					if (i < matches.size() && matches[i].song == song) {
+						best[i] = std::max(best[i],
+								match_score(fields, whole_word));
+					}
+				});
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < matches.size(); i++) {
+		if (best[i] != 0) {
+			matches[kept] = matches[i];
+			matches[kept++].score += best[i];
+		}
+	}
+	matches.resize(kept);
+}
+
+size_t SearchIndex::search(const string &query, size_t max_results,
+		vector<SearchResult> &results) const {
+	results.clear();
+	vector<string> words;
+	split_words(query, words);
+	if (words.empty()) {
+		return 0;
+	}
+	words.resize(std::min(words.size(), MAX_QUERY_WORDS));
+
+	vector<WordTerms> matched(words.size());
+	for (size_t i = 0; i < words.size(); i++) {
+		if (!word_terms(words[i], matched[i])) {
+			return 0; // nothing has every word
+		}
+	}
+
+	// Start with the word in the fewest songs (going by the size of its
+	// posting lists), so there are as few songs as can be to check the
+	// other words against.
+	auto posting_bytes = [this](const WordTerms &word) {
+		return posting_start[word.end] - posting_start[word.first];
+	};
+	std::sort(matched.begin(), matched.end(),
+			[&](const WordTerms &a, const WordTerms &b) {
+				return posting_bytes(a) < posting_bytes(b);
+			});
+	vector<SearchResult> matches;
+	match_word(matched[0], matches);
+	for (size_t i = 1; i < matched.size() && !matches.empty(); i++) {
+		narrow_matches(matched[i], matches);
+	}
+
+	auto better = [](const SearchResult &a, const SearchResult &b) {
+		return a.score != b.score ? a.score > b.score : a.song < b.song;
+	};
+	size_t count = std::min(max_results, matches.size());
+	if (count < matches.size()) {
+		std::nth_element(matches.begin(), matches.begin() + count,
+				matches.end(), better);
+	}
+	std::sort(matches.begin(), matches.begin() + count, better);
+	results.assign(matches.begin(), matches.begin() + count);
+	return matches.size();
+}
+
+SongText SearchIndex::read_song_text(const fs::path &song,
+		const string &info) {
+	SongText text;
+
+	Mp3Tags tags;
+	int fd = open(song.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		// An ID3v2 tag is at the start, and an ID3v1 tag the last 128 bytes.
+		vector<uint8_t> buf(10);
+		if (pread(fd, buf.data(), buf.size(), 0) == (ssize_t)buf.size()) {
+			size_t tag_size = mp3_audio_start(buf.data(), buf.size());
+			if (tag_size > 0) {
+				buf.resize(std::min(tag_size, MAX_TAG_BYTES));
+				ssize_t num_read = pread(fd, buf.data(), buf.size(), 0);
+				parse_id3v2_tags(buf.data(), std::max(num_read, (ssize_t)0),
+						tags);
+			}
+		}
+		struct stat info;
+		uint8_t tail[128];
+		if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(tail)
+				&& pread(fd, tail, sizeof(tail), info.st_size - sizeof(tail))
+					== (ssize_t)sizeof(tail)) {
+			parse_id3v1_tags(tail, sizeof(tail), tags);
+		}
+		close(fd);
+	}
+	text.tags = tags.title + " " + tags.artist + " " + tags.album;
+
+	// The label goes on a line of the reply, so no control characters.
+	text.label = tags.artist.empty() || tags.title.empty()
+		? tags.artist + tags.title : tags.artist + " - " + tags.title;
+	for (char &c : text.label) {
+		if ((unsigned char)c < 0x20 || c == 0x7f) {
+			c = ' ';
+		}
+	}
+
+	text.info = info.substr(0, MAX_INFO_BYTES);
+	return text;
+}
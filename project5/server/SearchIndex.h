@@ -0,0 +1,125 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * What there is to search in a song besides its file name.
+ */
+struct SongText {
+	std::string tags; // title, artist and album from its ID3 tags
+	std::string label; // "artist - title", or empty if the tags don't say
+	std::string info; // what's in its .info file
+};
+
+/**
+ * A song that matched a search.
+ */
+struct SearchResult {
+	uint32_t song; // index of the song in the catalog
+	uint32_t score; // how well it matched (higher is better)
+};
+
+/**
+ * Index of the words in a catalog's songs, for the search command.
+ *
+ * Every distinct word (a "term") is kept once, in sorted order, with a trie
+ * over them, so all the terms starting with what the user typed are found by
+ * following one path down the trie. Each term has a posting list of the songs
+ * it appears in, stored as the gaps between their indexes in variable-length
+ * bytes, so a word in every song costs about a byte per song.
+ *
+ * A SearchIndex never changes once built, so any number of threads can
+ * search it at once.
+ */
+class SearchIndex {
+  private:
+	// A node of the trie. A node's children are next to each other in
+	// nodes, sorted by byte, and the terms under a node are next to each
+	// other in terms.
+	struct TrieNode {
+		uint32_t first_child;
+		uint32_t first_term;
+		uint32_t end_term;
+		uint16_t num_children;
+		uint8_t byte; // byte on the edge from the parent
+	};
+
+	std::vector<std::string> terms; // sorted
+	std::vector<TrieNode> nodes; // the root is nodes[0]
+	std::vector<uint8_t> postings; // every term's posting list
+	std::vector<uint32_t> posting_start; // where each term's list starts
+	std::vector<std::string> labels; // each song's SongText::label
+	bool has_text; // whether tags and .info files were indexed
+
+	// The terms one word of a query matches
+	struct WordTerms {
+		uint32_t first;
+		uint32_t end;
+		bool whole_word; // terms[first] is the word itself
+	};
+
+	void build_trie(uint32_t node, size_t depth);
+	bool word_terms(const std::string &word, WordTerms &matched) const;
+	void match_word(const WordTerms &word,
+			std::vector<SearchResult> &matches) const;
+	void narrow_matches(const WordTerms &word,
+			std::vector<SearchResult> &matches) const;
+
+  public:
+	/**
+	 * Constructor for SearchIndex class.
+	 *
+	 * @param songs Paths of the catalog's songs, in catalog order.
+	 * @param texts What else there is to search in each song (in the same
+	 * 	order), or empty to index just the file names.
+	 */
+	SearchIndex(const std::vector<fs::path> &songs,
+			const std::vector<SongText> &texts);
+
+	/**
+	 * Reads a song's ID3 tags. This waits on the disk, so it shouldn't be
+	 * called from an event loop.
+	 *
+	 * @param song Path of the song.
+	 * @param info What's in its .info file (empty if it doesn't have one),
+	 * 	which the caller reads since the info command wants it too.
+	 * @return What there is to search in it.
+	 */
+	static SongText read_song_text(const fs::path &song,
+			const std::string &info);
+
+	/**
+	 * Finds the songs with every word of a query in them. Each word matches
+	 * any word that starts with it, but a whole word scores higher, as does
+	 * a word in a song's name or tags rather than its info.
+	 *
+	 * @param query What to look for.
+	 * @param max_results Most results to return.
+	 * @param results Set to the best matches, best first.
+	 * @return Number of songs that matched (which may be more than
+	 * 	max_results).
+	 */
+	size_t search(const std::string &query, size_t max_results,
+			std::vector<SearchResult> &results) const;
+
+	/**
+	 * @param song Index of a song in the catalog.
+	 * @return "artist - title" for the song, or empty if it's not known.
+	 */
+	const std::string &label(size_t song) const { return labels[song]; }
+
+	/**
+	 * @return Whether tags and .info files were indexed, rather than just
+	 * 	file names.
+	 */
+	bool complete() const { return has_text; }
+};
+
+#endif // SEARCHINDEX_H
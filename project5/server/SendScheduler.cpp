@@ -0,0 +1,15 @@
+#include "SendScheduler.h"
+#include "ClientSlab.h"
+
+void SendScheduler::run_round(ClientSlab &clients, int epoll_fd) {
+	for (size_t waiting = turns.size(); waiting > 0; waiting--) {
+		uint64_t key = turns.front();
+		turns.pop_front();
+
+		// The client may have been closed since it got in line.
+		ConnectedClient *client = clients.find(key);
+		if (client != NULL) {
+			client->take_turn(epoll_fd);
+		}
+	}
+}
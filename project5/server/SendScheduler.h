@@ -0,0 +1,53 @@
+#ifndef SENDSCHEDULER_H
+#define SENDSCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+class ClientSlab;
+
+/**
+ * Takes turns between the clients of one event loop that have more to send,
+ * so a client on a fast link can't hog the loop for a whole song while
+ * everyone else waits.
+ *
+ * This is deficit round-robin: each turn adds QUANTUM bytes to what a client
+ * may send (its ConnectedClient::send_deficit), and if it still has more to
+ * send once that's used up it goes to the back of the line. A client whose
+ * socket fills up before it has used its turn keeps the rest (up to one more
+ * QUANTUM) for its next turn, so over many rounds every busy client gets the
+ * same share of bytes, not just the same number of turns. A client that runs
+ * out of things to send, or is held back by pacing, starts again from zero.
+ */
+class SendScheduler {
+  private:
+	std::deque<uint64_t> turns; // epoll keys of the clients waiting
+
+  public:
+	// Most bytes a client sends in one turn
+	static const size_t QUANTUM = 64 * 1024;
+
+	/**
+	 * Puts a client at the back of the line.
+	 *
+	 * @param epoll_key The client's ConnectedClient::epoll_key.
+	 */
+	void add(uint64_t epoll_key) { turns.push_back(epoll_key); }
+
+	/**
+	 * @return Whether no one is waiting for a turn.
+	 */
+	bool empty() const { return turns.empty(); }
+
+	/**
+	 * Gives every client that was waiting one turn. Clients that need
+	 * another turn are added back for the next round.
+	 *
+	 * @param clients The event loop's clients.
+	 * @param epoll_fd File descriptor for epoll.
+	 */
+	void run_round(ClientSlab &clients, int epoll_fd);
+};
+
+#endif // SENDSCHEDULER_H
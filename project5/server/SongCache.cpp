@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SongCache.h"
+
+using std::string;
+using std::shared_ptr;
+
+// How much of a newly mapped song to ask the kernel to start reading in right
+// away, so the first sends don't wait on the disk.
+const size_t WILLNEED_BYTES = 256 * 1024;
+
+MappedSong::~MappedSong() {
+	munmap((void *)data, length);
+	close(fd);
+}
+
+size_t MappedSong::read(size_t offset, char *buffer, size_t max_bytes) const {
+	if (offset >= length) {
+		return 0;
+	}
+	max_bytes = std::min(max_bytes, length - offset);
+
+	size_t total_read = 0;
+	while (total_read < max_bytes) {
+		ssize_t num_read = pread(fd, buffer + total_read,
+				max_bytes - total_read, offset + total_read);
+		if (num_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (num_read <= 0) {
+			break; // the file got shorter
+		}
+		total_read += num_read;
+	}
+	return total_read;
+}
+
+SongCache &SongCache::instance() {
+	static SongCache cache;
+	return cache;
+}
+
+void SongCache::set_budget(size_t budget_bytes) {
+	std::lock_guard<std::mutex> guard(lock);
+	budget = budget_bytes;
+	make_room(0);
+}
+
+/**
+ * Unmaps songs nobody is using, least recently used first, until there is
+ * room for needed more bytes. Must be called with the lock held.
+ *
+ * @param needed Number of bytes we want to map.
+ * @return true if there is now enough room.
+ */
+bool SongCache::make_room(size_t needed) {
+	// Forgotten songs stop counting once their last client is done.
+	for (auto it = retired.begin(); it != retired.end(); ) {
+		if (it->use_count() == 1) {
+			mapped_bytes -= (*it)->length;
+			it = retired.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	auto it = lru.end();
+	while (mapped_bytes + needed > budget && it != lru.begin()) {
+		--it;
+		Entry &entry = songs[*it];
+
+		// The cache's own reference is the only one left, so no client is
+		// sending from this mapping.
+		if (entry.song.use_count() == 1) {
+			mapped_bytes -= entry.song->length;
+			songs.erase(*it);
+			it = lru.erase(it);
+		}
+	}
+	return mapped_bytes + needed <= budget;
+}
+
+shared_ptr<const MappedSong> SongCache::acquire(const fs::path &song_path) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto found = songs.find(song_path.string());
+	if (found != songs.end()) {
+		lru.splice(lru.begin(), lru, found->second.lru_pos);
+		return found->second.song;
+	}
+
+	int fd = open(song_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		perror("SongCache open");
+		return NULL;
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) < 0 || file_info.st_size == 0
+			|| !make_room(file_info.st_size)) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t length = file_info.st_size;
+	void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("SongCache mmap");
+		close(fd);
+		return NULL;
+	}
+
+	// Songs are streamed front to back, so let the kernel read ahead
+	// aggressively and drop pages behind us, and start on the beginning now.
+	madvise(data, length, MADV_SEQUENTIAL);
+	madvise(data, std::min(length, WILLNEED_BYTES), MADV_WILLNEED);
+
+	shared_ptr<const MappedSong> song =
+		std::make_shared<const MappedSong>((const char *)data, length, fd);
+	lru.push_front(song_path.string());
+	songs[song_path.string()] = Entry{song, lru.begin()};
+	mapped_bytes += length;
+	return song;
+}
+
+std::shared_ptr<const Mp3Index> SongCache::frame_index(const fs::path &song_path) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = indexes.find(song_path.string());
+		if (found != indexes.end()) {
+			return found->second;
+		}
+	}
+
+	// Build the index without holding the lock, since it means reading the
+	// whole song. It's read rather than parsed straight out of a mapping, so
+	// the file changing underneath us can't crash the server.
+	std::ifstream file(song_path, std::ios::binary);
+	std::vector<char> contents((std::istreambuf_iterator<char>(file)),
+			std::istreambuf_iterator<char>());
+	shared_ptr<const Mp3Index> index = std::make_shared<const Mp3Index>(
+			(const uint8_t *)contents.data(), contents.size());
+
+	std::lock_guard<std::mutex> guard(lock);
+	indexes[song_path.string()] = index;
+	return index;
+}
+
+void SongCache::forget(const fs::path &song_path) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto found = songs.find(song_path.string());
+	if (found != songs.end()) {
+		// The mapping only goes away once no client is sending from it, so
+		// until then it still counts against the budget.
+		if (found->second.song.use_count() == 1) {
+			mapped_bytes -= found->second.song->length;
+		}
+		else {
+			retired.push_back(found->second.song);
+		}
+		lru.erase(found->second.lru_pos);
+		songs.erase(found);
+	}
+	indexes.erase(song_path.string());
+}
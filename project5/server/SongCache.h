@@ -0,0 +1,130 @@
+#ifndef SONGCACHE_H
+#define SONGCACHE_H
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Mp3.h"
+
+namespace fs = std::filesystem;
+
+/**
+ * A song file that has been mapped into memory. The mapping is removed when
+ * the last reference to it goes away.
+ *
+ * If the file is truncated while it's mapped, touching the pages past its new
+ * end kills us with SIGBUS, so only the kernel (e.g. writev, which fails with
+ * EFAULT instead) reads from the mapping. Anything we read ourselves goes
+ * through read() on the open file.
+ */
+class MappedSong {
+  public:
+	const char *data; // start of the mapped file
+	size_t length; // length of the file when it was mapped (in bytes)
+	int fd; // the open file
+
+	/**
+	 * Constructor for MappedSong class. Takes ownership of the mapping and
+	 * the file.
+	 */
+	MappedSong(const char *mapped_data, size_t mapped_length, int file_fd) :
+		data(mapped_data), length(mapped_length), fd(file_fd) {}
+
+	/**
+	 * Destructor for MappedSong class. Unmaps and closes the file.
+	 */
+	~MappedSong();
+
+	/**
+	 * Copies part of the song out of the file (not the mapping).
+	 *
+	 * @param offset Offset in the song to start at.
+	 * @param buffer Where to copy it to.
+	 * @param max_bytes Most bytes to copy.
+	 * @return Number of bytes copied, which is less than max_bytes if the
+	 * 	song ends first (including if the file got shorter).
+	 */
+	size_t read(size_t offset, char *buffer, size_t max_bytes) const;
+
+	MappedSong(const MappedSong &) = delete;
+	MappedSong &operator=(const MappedSong &) = delete;
+};
+
+/**
+ * Process-wide cache of memory-mapped songs.
+ *
+ * Every client playing the same song gets a reference to the same mapping,
+ * so a song is read from disk once no matter how many people listen to it.
+ * Songs nobody is listening to are unmapped, least recently used first, once
+ * the total mapped size goes over the budget.
+ */
+class SongCache {
+  private:
+	struct Entry {
+		std::shared_ptr<const MappedSong> song;
+		std::list<std::string>::iterator lru_pos;
+	};
+
+	size_t budget; // most bytes we want mapped at once
+	size_t mapped_bytes; // bytes currently mapped by the cache
+	std::map<std::string, Entry> songs; // keyed by path
+	std::list<std::string> lru; // most recently used at the front
+	std::map<std::string, std::shared_ptr<const Mp3Index>> indexes; // by path
+	// Forgotten songs that clients were still sending when they were
+	// forgotten. They count against the budget until the last client is done.
+	std::vector<std::shared_ptr<const MappedSong>> retired;
+	std::mutex lock;
+
+	SongCache() : budget(256 * 1024 * 1024), mapped_bytes(0) {}
+
+	bool make_room(size_t needed);
+
+  public:
+	/**
+	 * @return The cache shared by the whole server.
+	 */
+	static SongCache &instance();
+
+	/**
+	 * Sets how many bytes of songs may stay mapped.
+	 *
+	 * @param budget_bytes The new budget.
+	 */
+	void set_budget(size_t budget_bytes);
+
+	/**
+	 * Gets the mapping for a song, mapping it if it isn't already.
+	 *
+	 * @param song_path Path of the song.
+	 * @return The mapped song, or NULL if it couldn't be mapped (e.g. the
+	 * 	budget is used up by songs that are all being listened to).
+	 */
+	std::shared_ptr<const MappedSong> acquire(const fs::path &song_path);
+
+	/**
+	 * Gets the frame index for a song, building it the first time it is
+	 * asked for. Indexes are small so they stay around even when the song
+	 * itself is unmapped.
+	 *
+	 * @param song_path Path of the song.
+	 * @return The song's frame index.
+	 */
+	std::shared_ptr<const Mp3Index> frame_index(const fs::path &song_path);
+
+	/**
+	 * Drops the cached mapping and index of a song that has changed on disk,
+	 * so the next client gets the new version. Clients already sending the
+	 * old version keep their mapping.
+	 *
+	 * @param song_path Path of the song.
+	 */
+	void forget(const fs::path &song_path);
+};
+
+#endif // SONGCACHE_H
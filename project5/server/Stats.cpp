@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "Stats.h"
+#include "TimerWheel.h"
+
+using std::string;
+
+// Rates are worked out over at least this long, so asking for stats twice
+// in quick succession doesn't give nonsense.
+const uint64_t RATE_INTERVAL_MS = 1000;
+
+// How long to wait before accepting again when accepting on the admin socket
+// failed (e.g. we're out of file descriptors), rather than spin
+const int ADMIN_ACCEPT_RETRY_MS = 100;
+
+// Names of the ClientStates, in the same order as the enum
+static const char *const STATE_NAMES[LoopStats::NUM_STATES] = {
+	"receiving", "sending", "paused", "queued"
+};
+
+LoopStats::LoopStats() : bytes_sent(0), send_stalls(0), wakeups(0),
+	events(0) {
+	for (std::atomic<int64_t> &count : clients) {
+		count.store(0, std::memory_order_relaxed);
+	}
+	for (std::atomic<uint64_t> &count : iteration_us) {
+		count.store(0, std::memory_order_relaxed);
+	}
+}
+
+void LoopStats::client_moved(int from, int to) {
+	if (from >= 0) {
+		add(clients[from], (int64_t)-1);
+	}
+	if (to >= 0) {
+		add(clients[to], (int64_t)1);
+	}
+}
+
+void LoopStats::record_iteration(uint64_t elapsed_us, int num_events) {
+	add(wakeups, (uint64_t)1);
+	add(events, (uint64_t)num_events);
+
+	// The bucket is the number of bits needed to hold elapsed_us.
+	int bucket = elapsed_us == 0 ? 0 : 64 - __builtin_clzll(elapsed_us);
+	add(iteration_us[std::min(bucket, HISTOGRAM_BUCKETS - 1)], (uint64_t)1);
+}
+
+ServerStats::ServerStats() : sample_ms(monotonic_ms()), sample_bytes(0),
+	sample_stalls(0), sample_wakeups(0), sample_events(0), bytes_rate(0),
+	stalls_rate(0), wakeups_rate(0), events_per_wakeup(0) {}
+
+ServerStats &ServerStats::instance() {
+	static ServerStats stats;
+	return stats;
+}
+
+LoopStats *ServerStats::add_loop() {
+	std::lock_guard<std::mutex> guard(lock);
+	loops.emplace_back(new LoopStats());
+	return loops.back().get();
+}
+
+void ServerStats::song_changed(const fs::path &from, const fs::path &to) {
+	if (from == to) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	if (!from.empty()) {
+		auto it = listeners.find(from);
+		if (it != listeners.end() && --it->second <= 0) {
+			listeners.erase(it);
+		}
+	}
+	if (!to.empty()) {
+		listeners[to]++;
+	}
+}
+
+string ServerStats::report() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	// Add up the counters of every loop.
+	int64_t clients[LoopStats::NUM_STATES] = {};
+	uint64_t histogram[LoopStats::HISTOGRAM_BUCKETS] = {};
+	uint64_t bytes = 0, stalls = 0, wakeups = 0, events = 0;
+	for (std::unique_ptr<LoopStats> &loop : loops) {
+		for (int i = 0; i < LoopStats::NUM_STATES; i++) {
+			clients[i] += loop->clients[i].load(std::memory_order_relaxed);
+		}
+		for (int i = 0; i < LoopStats::HISTOGRAM_BUCKETS; i++) {
+			histogram[i] += loop->iteration_us[i].load(std::memory_order_relaxed);
+		}
+		bytes += loop->bytes_sent.load(std::memory_order_relaxed);
+		stalls += loop->send_stalls.load(std::memory_order_relaxed);
+		wakeups += loop->wakeups.load(std::memory_order_relaxed);
+		events += loop->events.load(std::memory_order_relaxed);
+	}
+
+	uint64_t now = monotonic_ms();
+	if (now - sample_ms >= RATE_INTERVAL_MS) {
+		double seconds = (now - sample_ms) / 1000.0;
+		bytes_rate = (bytes - sample_bytes) / seconds;
+		stalls_rate = (stalls - sample_stalls) / seconds;
+		wakeups_rate = (wakeups - sample_wakeups) / seconds;
+		events_per_wakeup = wakeups == sample_wakeups ? 0
+			: (double)(events - sample_events) / (wakeups - sample_wakeups);
+		sample_ms = now;
+		sample_bytes = bytes;
+		sample_stalls = stalls;
+		sample_wakeups = wakeups;
+		sample_events = events;
+	}
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(1);
+
+	int64_t total_clients = 0;
+	for (int64_t count : clients) {
+		total_clients += count;
+	}
+	out << "Clients: " << total_clients << " (";
+	for (int i = 0; i < LoopStats::NUM_STATES; i++) {
+		out << (i > 0 ? ", " : "") << STATE_NAMES[i] << " " << clients[i];
+	}
+	out << ")\n";
+
+	out << "Sent: " << bytes << " bytes, " << bytes_rate << " bytes/s\n";
+	out << "Send stalls (socket buffer full): " << stalls << ", "
+		<< stalls_rate << "/s\n";
+	out << "Epoll: " << wakeups_rate << " wakeups/s, " << events_per_wakeup
+		<< " events per wakeup\n";
+
+	out << "Listeners:\n";
+	if (listeners.empty()) {
+		out << "  (none)\n";
+	}
+	for (const auto &song : listeners) {
+		out << "  " << song.second << "  " << song.first.filename().string()
+			<< "\n";
+	}
+
+	out << "Event loop iteration times:\n";
+	for (int i = 0; i < LoopStats::HISTOGRAM_BUCKETS; i++) {
+		if (histogram[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			out << "  under 1 us";
+		}
+		else if (i == LoopStats::HISTOGRAM_BUCKETS - 1) {
+			out << "  " << (1ull << (i - 1)) << " us and up";
+		}
+		else {
+			out << "  " << (1ull << (i - 1)) << "-" << (1ull << i) << " us";
+		}
+		out << ": " << histogram[i] << "\n";
+	}
+
+	return out.str();
+}
+
+void ServerStats::start_admin(const string &path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "ERROR: admin socket path is too long: " << path << "\n";
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	// Left over from the last server to use the path (if any)
+	unlink(path.c_str());
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("admin socket");
+		exit(EXIT_FAILURE);
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("admin bind");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(sock, 16) < 0) {
+		perror("admin listen");
+		exit(EXIT_FAILURE);
+	}
+
+	std::thread(&ServerStats::serve_admin, this, sock).detach();
+}
+
+/**
+ * Sends the report to everything that connects to the admin socket, then
+ * hangs up. Runs in its own thread.
+ *
+ * @param listen_sock The admin socket.
+ */
+void ServerStats::serve_admin(int listen_sock) {
+	while (true) {
+		int admin = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (admin < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				perror("admin accept");
+				std::this_thread::sleep_for(
+						std::chrono::milliseconds(ADMIN_ACCEPT_RETRY_MS));
+			}
+			continue;
+		}
+
+		// Don't let someone who never reads hold up everyone after them.
+		struct timeval timeout = {1, 0};
+		setsockopt(admin, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		string text = report();
+		size_t pos = 0;
+		while (pos < text.size()) {
+			ssize_t num_bytes_sent = send(admin, text.data() + pos,
+					text.size() - pos, MSG_NOSIGNAL);
+			if (num_bytes_sent < 0 && errno == EINTR) {
+				continue;
+			}
+			if (num_bytes_sent <= 0) {
+				break;
+			}
+			pos += num_bytes_sent;
+		}
+		close(admin);
+	}
+}
@@ -0,0 +1,126 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * Counters kept by one event loop. Only the loop's own thread changes them,
+ * so they're bumped with a relaxed load and store rather than a locked add:
+ * on x86 that's the same plain mov an ordinary variable would get. The stats
+ * command reads them from whatever thread it runs on, and may see one loop's
+ * counters a moment out of date, which is fine for stats.
+ */
+struct LoopStats {
+	// One for each ClientState
+	static const int NUM_STATES = 4;
+
+	// Bucket 0 counts iterations under 1 us, and bucket i > 0 those from
+	// 2^(i-1) us up to 2^i us. The last bucket takes everything longer.
+	static const int HISTOGRAM_BUCKETS = 20;
+
+	std::atomic<int64_t> clients[NUM_STATES]; // clients in each state
+	std::atomic<uint64_t> bytes_sent; // to clients, headers and all
+	std::atomic<uint64_t> send_stalls; // times a socket buffer filled up
+	std::atomic<uint64_t> wakeups; // returns from epoll_wait
+	std::atomic<uint64_t> events; // events those returned
+	std::atomic<uint64_t> iteration_us[HISTOGRAM_BUCKETS];
+
+	LoopStats();
+
+	/**
+	 * Adds to one of the counters. Must only be called by the loop's thread.
+	 *
+	 * @param counter The counter.
+	 * @param amount How much to add (negative to take away).
+	 */
+	template <typename T>
+	static void add(std::atomic<T> &counter, T amount) {
+		counter.store(counter.load(std::memory_order_relaxed) + amount,
+				std::memory_order_relaxed);
+	}
+
+	/**
+	 * Counts a client moving from one state to another.
+	 *
+	 * @param from The state it was in, or -1 for a new client.
+	 * @param to The state it's in now, or -1 for a client that's gone.
+	 */
+	void client_moved(int from, int to);
+
+	/**
+	 * Counts one trip around the event loop.
+	 *
+	 * @param elapsed_us How long handling the batch of events took.
+	 * @param num_events How many events epoll_wait returned.
+	 */
+	void record_iteration(uint64_t elapsed_us, int num_events);
+};
+
+/**
+ * Stats for the whole server, for the stats command and the admin socket:
+ * each event loop's counters, plus how many clients are listening to each
+ * song. Rates are worked out from the difference between two looks at the
+ * counters at least a second apart.
+ */
+class ServerStats {
+  private:
+	std::mutex lock;
+	std::vector<std::unique_ptr<LoopStats>> loops;
+	std::map<fs::path, int> listeners; // clients with each song as current_song
+
+	// Totals when we last worked out the rates, and the rates we got
+	uint64_t sample_ms;
+	uint64_t sample_bytes, sample_stalls, sample_wakeups, sample_events;
+	double bytes_rate, stalls_rate, wakeups_rate, events_per_wakeup;
+
+	ServerStats();
+
+	void serve_admin(int listen_sock);
+
+  public:
+	/**
+	 * @return The stats of the whole server.
+	 */
+	static ServerStats &instance();
+
+	/**
+	 * Makes the counters for a new event loop.
+	 *
+	 * @return The counters, which last as long as the server.
+	 */
+	LoopStats *add_loop();
+
+	/**
+	 * Counts a client moving from one song to another.
+	 *
+	 * @param from The song it was listening to, or empty if none.
+	 * @param to The song it's listening to now, or empty if none.
+	 */
+	void song_changed(const fs::path &from, const fs::path &to);
+
+	/**
+	 * @return Human-readable report of everything we keep track of.
+	 */
+	std::string report();
+
+	/**
+	 * Starts answering connections on a Unix socket with the report, so the
+	 * stats can be checked without being a client (e.g. with
+	 * "nc -U socket_path").
+	 *
+	 * @param path Path of the admin socket.
+	 */
+	void start_admin(const std::string &path);
+};
+
+#endif // STATS_H
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <ctime>
+
+#include "TimerWheel.h"
+
+using std::vector;
+
+uint64_t monotonic_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+TimerWheel::TimerWheel(size_t num_slots, uint64_t tick_length_ms) :
+	slots(num_slots), tick_ms(tick_length_ms),
+	current_tick(monotonic_ms() / tick_length_ms), num_timers(0),
+	last_token(0) {}
+
+void TimerWheel::schedule(const Timer &timer) {
+	uint64_t tick = timer.expires_ms / tick_ms;
+	if (tick < current_tick) {
+		// Already due, so make it go off on the next expire.
+		tick = current_tick;
+	}
+	Slot &slot = slots[tick % slots.size()];
+	slot.timers.push_back(timer);
+	slot.earliest_ms = std::min(slot.earliest_ms, timer.expires_ms);
+	num_timers++;
+}
+
+void TimerWheel::expire(uint64_t now_ms, vector<Timer> &expired) {
+	uint64_t now_tick = now_ms / tick_ms;
+	if (now_tick < current_tick) {
+		return; // this tick has already been expired
+	}
+
+	// If we slept for more than a revolution, one pass over every slot is
+	// enough to catch everything.
+	if (now_tick - current_tick >= slots.size()) {
+		current_tick = now_tick - slots.size() + 1;
+	}
+
+	for (; current_tick <= now_tick && num_timers > 0; current_tick++) {
+		Slot &slot = slots[current_tick % slots.size()];
+		vector<Timer> &timers = slot.timers;
+		size_t kept = 0;
+		slot.earliest_ms = UINT64_MAX;
+		for (size_t i = 0; i < timers.size(); i++) {
+			if (timers[i].expires_ms / tick_ms <= now_tick) {
+				expired.push_back(timers[i]);
+				num_timers--;
+			}
+			else {
+				// Belongs to a later revolution of the wheel.
+				slot.earliest_ms = std::min(slot.earliest_ms,
+						timers[i].expires_ms);
+				timers[kept++] = timers[i];
+			}
+		}
+		timers.resize(kept);
+	}
+	current_tick = now_tick + 1;
+}
+
+int TimerWheel::next_timeout(uint64_t now_ms) const {
+	if (num_timers == 0) {
+		return -1;
+	}
+
+	// Find the next slot with a timer due this revolution. Slots whose
+	// timers are all a revolution (or more) away are skipped, but the
+	// soonest of those is kept in case nothing is due sooner; long timers
+	// (like idle timeouts) would otherwise wake us up every revolution.
+	uint64_t when = UINT64_MAX;
+	for (uint64_t tick = current_tick; tick < current_tick + slots.size(); tick++) {
+		const Slot &slot = slots[tick % slots.size()];
+		if (slot.timers.empty()) {
+			continue;
+		}
+		if (slot.earliest_ms / tick_ms <= tick) {
+			when = tick * tick_ms;
+			break;
+		}
+		when = std::min(when, slot.earliest_ms / tick_ms * tick_ms);
+	}
+	if (when <= now_ms) {
+		return 0;
+	}
+	return (int)std::min(when - now_ms, (uint64_t)INT32_MAX);
+}
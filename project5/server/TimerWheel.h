@@ -0,0 +1,91 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A timer for one client. Timers are never removed from the wheel; instead
+ * the client keeps the token of the timer it is waiting for and ignores any
+ * that fire with a different token.
+ */
+struct Timer {
+	int fd; // client the timer belongs to
+	int kind; // what the timer is for (see TimerKind in ConnectedClient.h)
+	uint64_t token; // lets the client recognise stale timers
+	uint64_t expires_ms; // monotonic time the timer goes off
+};
+
+/**
+ * Hashed timer wheel: scheduling a timer and expiring a tick are both O(1)
+ * (per timer), no matter how many timers are pending.
+ *
+ * Time is split into ticks of tick_ms milliseconds, and each slot of the
+ * wheel holds the timers that go off on a tick with that number modulo the
+ * number of slots. Timers more than one revolution away just stay in their
+ * slot until their time comes around.
+ */
+class TimerWheel {
+  private:
+	struct Slot {
+		std::vector<Timer> timers;
+		uint64_t earliest_ms = UINT64_MAX; // soonest expires_ms in timers
+	};
+
+	std::vector<Slot> slots;
+	uint64_t tick_ms; // length of one tick
+	uint64_t current_tick; // next tick that hasn't been expired yet
+	size_t num_timers; // pending timers, over all slots
+	uint64_t last_token; // last token handed out by new_token
+
+  public:
+	/**
+	 * Constructor for TimerWheel class.
+	 *
+	 * @param num_slots Number of slots in the wheel.
+	 * @param tick_length_ms Length of one tick in milliseconds.
+	 */
+	TimerWheel(size_t num_slots = 512, uint64_t tick_length_ms = 10);
+
+	/**
+	 * @return A token no other timer on this wheel has used.
+	 */
+	uint64_t new_token() { return ++last_token; }
+
+	/**
+	 * Adds a timer to the wheel.
+	 *
+	 * @param timer The timer. Its expires_ms must already be set.
+	 */
+	void schedule(const Timer &timer);
+
+	/**
+	 * Removes every timer that has gone off by the given time.
+	 *
+	 * @param now_ms The current monotonic time.
+	 * @param expired Where to put the timers that went off.
+	 */
+	void expire(uint64_t now_ms, std::vector<Timer> &expired);
+
+	/**
+	 * Works out how long epoll_wait can sleep before a timer needs to go
+	 * off.
+	 *
+	 * @param now_ms The current monotonic time.
+	 * @return Milliseconds to wait, or -1 if there are no timers.
+	 */
+	int next_timeout(uint64_t now_ms) const;
+};
+
+/**
+ * @return Milliseconds on the monotonic clock.
+ */
+uint64_t monotonic_ms();
+
+/**
+ * @return Microseconds on the monotonic clock.
+ */
+uint64_t monotonic_us();
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,968 @@
+/*
+ * File: jukebox-bench.cpp
+ *
+ * Load generator for the Internet Jukebox server. Opens lots of connections
+ * at once, has each of them run through a random mix of commands (the same
+ * writeUTF-framed commands the AudioClient sends), and drains whatever
+ * audio comes back without playing it. When it's done it prints what it
+ * measured as JSON, so runs against different builds of the server can be
+ * compared.
+ *
+ * Every connection starts a session (see FrameType in ConnectedClient.h),
+ * since the frames tell us exactly when each reply or song starts and ends.
+ */
+
+// C++ standard libraries
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// C standard libraries
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+
+// POSIX and OS-specific libraries
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "TimerWheel.h"
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::vector;
+
+const int MAX_EVENTS = 256;
+
+// Biggest read we do at once. The audio is thrown away, so one buffer does
+// for every connection.
+const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+// Frame types, as in ConnectedClient.h
+const uint8_t AUDIO_FRAME = 1;
+const uint8_t MESSAGE_FRAME = 2;
+const uint8_t SONG_END_FRAME = 3;
+const size_t FRAME_HEADER_SIZE = 5;
+
+/**
+ * The things a connection can do. STOP_OP plays a song and stops it after
+ * stop_seconds (if it hasn't finished by then).
+ */
+enum OpKind { PLAY_OP, LIST_OP, INFO_OP, STOP_OP, NUM_OPS };
+
+const char *const OP_NAMES[NUM_OPS] = { "play", "list", "info", "stop" };
+
+/**
+ * What a connection is up to.
+ */
+enum Phase {
+	CONNECTING, // waiting for connect to finish
+	STARTING, // sent "session", waiting for the reply
+	THINKING, // between commands
+	WAITING, // waiting for a command to finish
+	CLOSED,
+};
+
+/**
+ * Settings for the whole run, from the command line.
+ */
+struct BenchConfig {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	unsigned connections = 100;
+	unsigned threads = 1;
+	double duration_seconds = 10;
+	double stop_seconds = 5;
+	uint64_t think_ms = 0;
+	int weights[NUM_OPS] = { 70, 10, 10, 10 };
+	int num_songs = 0; // learnt from the server's list
+};
+
+/**
+ * One connection to the server.
+ */
+struct Connection {
+	int fd = -1;
+	Phase phase = CONNECTING;
+	OpKind op = PLAY_OP;
+	uint64_t op_start_us = 0; // when the current command was sent
+	uint64_t first_byte_us = 0; // when its first byte of audio came, or 0
+	uint64_t stream_bytes = 0; // audio received for it so far
+	bool stop_sent = false;
+	bool refused = false; // the server said why it won't play the song
+	uint64_t timer_token = 0; // token of the timer we're waiting on
+	string outbuf; // commands the socket couldn't take yet
+	uint32_t watched_events = 0; // events epoll is watching for on fd
+
+	// Frame being received
+	uint8_t header[FRAME_HEADER_SIZE];
+	size_t header_got = 0;
+	size_t payload_left = 0;
+};
+
+/**
+ * A connection's timer: either the end of its think time, or when to stop
+ * its song. Like the server's timers, they're never cancelled; one whose
+ * token doesn't match the connection's is ignored.
+ */
+struct BenchTimer {
+	uint64_t when_us;
+	size_t conn;
+	uint64_t token;
+
+	bool operator>(const BenchTimer &other) const {
+		return when_us > other.when_us;
+	}
+};
+
+/**
+ * Everything one thread measured. The threads' results are merged at the
+ * end.
+ */
+struct BenchResults {
+	uint64_t connected = 0;
+	uint64_t connect_failures = 0;
+	uint64_t rejected = 0; // hung up on before the session started
+	uint64_t disconnects = 0; // hung up on partway through
+	uint64_t protocol_errors = 0;
+	uint64_t error_replies = 0; // e.g. "No songs to play" instead of audio
+	uint64_t ops[NUM_OPS] = {};
+	uint64_t bytes_received = 0;
+	vector<double> ttfb_ms; // from a play command to its first audio byte
+	vector<double> list_ms; // from a list command to the end of the reply
+	vector<double> info_ms; // from an info command to the end of the reply
+	// bytes per second of each song, from the command (up to the end of the
+	// run for songs that hadn't finished)
+	vector<double> stream_rates;
+
+	/**
+	 * Adds another thread's results to these.
+	 *
+	 * @param other The other thread's results.
+	 */
+	void merge(const BenchResults &other) {
+		connected += other.connected;
+		connect_failures += other.connect_failures;
+		rejected += other.rejected;
+		disconnects += other.disconnects;
+		protocol_errors += other.protocol_errors;
+		error_replies += other.error_replies;
+		for (int i = 0; i < NUM_OPS; i++) {
+			ops[i] += other.ops[i];
+		}
+		bytes_received += other.bytes_received;
+		ttfb_ms.insert(ttfb_ms.end(), other.ttfb_ms.begin(), other.ttfb_ms.end());
+		list_ms.insert(list_ms.end(), other.list_ms.begin(), other.list_ms.end());
+		info_ms.insert(info_ms.end(), other.info_ms.begin(), other.info_ms.end());
+		stream_rates.insert(stream_rates.end(), other.stream_rates.begin(),
+				other.stream_rates.end());
+	}
+};
+
+/**
+ * Runs a share of the connections on its own epoll. Each thread has one of
+ * these, and shares nothing with the others.
+ */
+class BenchLoop {
+  private:
+	const BenchConfig &config;
+	int epoll_fd;
+	vector<Connection> conns;
+	std::priority_queue<BenchTimer, vector<BenchTimer>,
+		std::greater<BenchTimer>> timers;
+	std::mt19937 rng;
+	uint64_t end_us; // no new commands are started after this
+	BenchResults results;
+
+	void start_connection(size_t index);
+	void finish_connect(size_t index);
+	void handle_input(size_t index);
+	void handle_frame_data(size_t index, uint8_t type, size_t length);
+	void handle_frame_end(size_t index, uint8_t type);
+	void start_op(size_t index);
+	void finish_op(size_t index);
+	void send_command(size_t index, const string &command);
+	void flush(size_t index);
+	void watch(size_t index, bool want_out);
+	void set_timer(size_t index, uint64_t when_us);
+	void close_connection(size_t index);
+
+  public:
+	/**
+	 * Constructor for BenchLoop class.
+	 *
+	 * @param bench_config Settings for the run.
+	 * @param num_connections How many connections this loop runs.
+	 * @param seed Seed for picking commands, so runs can be repeated.
+	 */
+	BenchLoop(const BenchConfig &bench_config, unsigned num_connections,
+			unsigned seed);
+
+	/**
+	 * Runs the connections until the run's duration is up.
+	 *
+	 * @param run_end_us Monotonic time to stop at.
+	 * @return What was measured.
+	 */
+	BenchResults run(uint64_t run_end_us);
+};
+
+// forward declarations
+void usage(const char *prog_name);
+void parse_mix(const char *mix, BenchConfig &config);
+int count_songs(const BenchConfig &config);
+string summary_json(vector<double> &values, int precision);
+
+/**
+ * Prints how to run the benchmark then exits.
+ *
+ * @param prog_name Name the program was run with (i.e. argv[0]).
+ */
+void usage(const char *prog_name) {
+	cerr << "Usage: " << prog_name << " [-c connections] [-d seconds]"
+		<< " [-m mix] [-s stop_seconds] [-t threads] [-w think_ms]"
+		<< " <host> <port>\n";
+	cerr << "  -c connections   number of connections to open (default 100)\n";
+	cerr << "  -d seconds       how long to run for (default 10)\n";
+	cerr << "  -m mix           relative weights of each command (default"
+		<< " play=70,list=10,info=10,stop=10)\n";
+	cerr << "  -s stop_seconds  how long \"stop\" plays a song before stopping"
+		<< " it (default 5)\n";
+	cerr << "  -t threads       number of threads to spread the connections"
+		<< " over (default 1)\n";
+	cerr << "  -w think_ms      pause between one command finishing and the"
+		<< " next (default 0)\n";
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Reads the mix of commands, e.g. "play=50,stop=50".
+ *
+ * @param mix The mix, as given on the command line.
+ * @param config Where to put the weights.
+ */
+void parse_mix(const char *mix, BenchConfig &config) {
+	std::fill(config.weights, config.weights + NUM_OPS, 0);
+	std::istringstream items(mix);
+	string item;
+	while (std::getline(items, item, ',')) {
+		size_t equals = item.find('=');
+		int op = std::find(OP_NAMES, OP_NAMES + NUM_OPS,
+				item.substr(0, equals)) - OP_NAMES;
+		if (equals == string::npos || op == NUM_OPS) {
+			cerr << "ERROR: bad command mix: " << mix << "\n";
+			exit(EXIT_FAILURE);
+		}
+		config.weights[op] = std::max(0, std::stoi(item.substr(equals + 1)));
+	}
+	if (*std::max_element(config.weights, config.weights + NUM_OPS) == 0) {
+		cerr << "ERROR: command mix has nothing in it: " << mix << "\n";
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Sends a command the way AudioClient does (DataOutputStream.writeUTF: a
+ * two-byte big-endian length, then the text).
+ *
+ * @param command The command.
+ * @return The bytes to send.
+ */
+static string utf_frame(const string &command) {
+	string framed;
+	framed += (char)((command.size() >> 8) & 0xff);
+	framed += (char)(command.size() & 0xff);
+	return framed + command;
+}
+
+/**
+ * Reads exactly len bytes from a blocking socket.
+ *
+ * @return false if the connection closed first.
+ */
+static bool read_fully(int sock, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = recv(sock, buf, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Asks the server for its song list, so info commands can ask about songs
+ * that exist.
+ *
+ * @param config Settings for the run.
+ * @return Number of songs the server has, or -1 if we couldn't find out.
+ */
+int count_songs(const BenchConfig &config) {
+	int sock = socket(config.addr.ss_family, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sock, (struct sockaddr *)&config.addr, config.addr_len) < 0) {
+		perror("connect");
+		close(sock);
+		return -1;
+	}
+
+	string commands = utf_frame("session") + utf_frame("list");
+	if (send(sock, commands.data(), commands.size(), MSG_NOSIGNAL)
+			!= (ssize_t)commands.size()) {
+		close(sock);
+		return -1;
+	}
+
+	// The first reply is "Session started", the second is the list.
+	int num_songs = -1;
+	for (int reply = 0; reply < 2; reply++) {
+		char header[FRAME_HEADER_SIZE];
+		if (!read_fully(sock, header, sizeof(header))
+				|| header[0] != MESSAGE_FRAME) {
+			break;
+		}
+		uint32_t length = 0;
+		for (size_t i = 1; i < FRAME_HEADER_SIZE; i++) {
+			length = (length << 8) | (uint8_t)header[i];
+		}
+		string payload(length, '\0');
+		if (!read_fully(sock, &payload[0], length)) {
+			break;
+		}
+		if (reply == 1) {
+			// One line per song
+			num_songs = std::count(payload.begin(), payload.end(), '\n');
+		}
+	}
+	close(sock);
+	return num_songs;
+}
+
+BenchLoop::BenchLoop(const BenchConfig &bench_config,
+		unsigned num_connections, unsigned seed) :
+	config(bench_config), epoll_fd(-1), conns(num_connections), rng(seed),
+	end_us(0) {}
+
+BenchResults BenchLoop::run(uint64_t run_end_us) {
+	this->end_us = run_end_us;
+	this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (this->epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < conns.size(); i++) {
+		start_connection(i);
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t now;
+	while ((now = monotonic_us()) < this->end_us) {
+		// Sleep until the next timer, or the end of the run.
+		uint64_t wake_us = this->end_us;
+		if (!timers.empty()) {
+			wake_us = std::min(wake_us, timers.top().when_us);
+		}
+		int timeout = wake_us <= now ? 0 : (wake_us - now + 999) / 1000;
+
+		int num_events = epoll_wait(this->epoll_fd, events, MAX_EVENTS, timeout);
+		if (num_events < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int n = 0; n < num_events; n++) {
+			size_t index = events[n].data.u64;
+			Connection &conn = conns[index];
+			if (conn.phase == CLOSED) {
+				continue;
+			}
+			if (conn.phase == CONNECTING) {
+				finish_connect(index);
+				continue;
+			}
+			if ((events[n].events & EPOLLIN) != 0) {
+				handle_input(index);
+			}
+			if (conn.phase != CLOSED && (events[n].events & EPOLLOUT) != 0) {
+				flush(index);
+			}
+			if (conn.phase != CLOSED
+					&& (events[n].events & (EPOLLHUP | EPOLLERR)) != 0) {
+				// Anything the server sent before hanging up has been read
+				// by now.
+				if (conn.phase == STARTING) {
+					results.rejected++;
+				}
+				else {
+					results.disconnects++;
+				}
+				close_connection(index);
+			}
+		}
+
+		// Start the next command of everyone who's done thinking, and stop
+		// the songs that have played long enough.
+		now = monotonic_us();
+		while (!timers.empty() && timers.top().when_us <= now) {
+			BenchTimer timer = timers.top();
+			timers.pop();
+			Connection &conn = conns[timer.conn];
+			if (timer.token != conn.timer_token) {
+				continue;
+			}
+			if (conn.phase == THINKING) {
+				start_op(timer.conn);
+			}
+			else if (conn.phase == WAITING && conn.op == STOP_OP
+					&& !conn.stop_sent) {
+				conn.stop_sent = true;
+				send_command(timer.conn, "stop");
+			}
+		}
+	}
+
+	// Songs still playing at the deadline count too, going by what arrived
+	// so far. Leaving them out would only count the songs that were short
+	// or fast enough to finish, and make streaming look better than it is.
+	now = monotonic_us();
+	for (size_t i = 0; i < conns.size(); i++) {
+		Connection &conn = conns[i];
+		if (conn.phase == WAITING && (conn.op == PLAY_OP || conn.op == STOP_OP)
+				&& conn.first_byte_us != 0 && now > conn.op_start_us) {
+			results.stream_rates.push_back(
+					conn.stream_bytes * 1e6 / (now - conn.op_start_us));
+		}
+		if (conn.phase != CLOSED) {
+			close_connection(i);
+		}
+	}
+	close(this->epoll_fd);
+	return results;
+}
+
+/**
+ * Starts connecting to the server, without waiting for it to finish.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::start_connection(size_t index) {
+	Connection &conn = conns[index];
+	conn.fd = socket(config.addr.ss_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn.fd < 0) {
+		perror("socket");
+		results.connect_failures++;
+		conn.phase = CLOSED;
+		return;
+	}
+
+	if (connect(conn.fd, (struct sockaddr *)&config.addr, config.addr_len) < 0
+			&& errno != EINPROGRESS) {
+		results.connect_failures++;
+		close(conn.fd);
+		conn.phase = CLOSED;
+		return;
+	}
+
+	// Writable once the connection is made (or has failed).
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.u64 = index;
+	if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	conn.watched_events = ev.events;
+	conn.phase = CONNECTING;
+}
+
+/**
+ * Is called once a connection has been made (or has failed), and starts a
+ * session on it.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::finish_connect(size_t index) {
+	Connection &conn = conns[index];
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+	if (getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0
+			|| error != 0) {
+		results.connect_failures++;
+		close_connection(index);
+		return;
+	}
+
+	results.connected++;
+	conn.phase = STARTING;
+	watch(index, false);
+	send_command(index, "session");
+}
+
+/**
+ * Reads everything waiting on a connection and picks the frames out of it.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::handle_input(size_t index) {
+	static thread_local char buf[READ_BUFFER_SIZE];
+	Connection &conn = conns[index];
+
+	while (conn.phase != CLOSED) {
+		ssize_t num_bytes = recv(conn.fd, buf, sizeof(buf), 0);
+		if (num_bytes < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+			num_bytes = 0; // treat it like a hang up
+		}
+		if (num_bytes == 0) {
+			if (conn.phase == STARTING) {
+				results.rejected++;
+			}
+			else {
+				results.disconnects++;
+			}
+			close_connection(index);
+			return;
+		}
+		results.bytes_received += num_bytes;
+
+		const char *data = buf;
+		size_t left = num_bytes;
+		while (left > 0 && conn.phase != CLOSED) {
+			if (conn.header_got < FRAME_HEADER_SIZE) {
+				size_t n = std::min(left, FRAME_HEADER_SIZE - conn.header_got);
+				memcpy(conn.header + conn.header_got, data, n);
+				conn.header_got += n;
+				data += n;
+				left -= n;
+				if (conn.header_got < FRAME_HEADER_SIZE) {
+					break;
+				}
+
+				uint8_t type = conn.header[0];
+				if (type != AUDIO_FRAME && type != MESSAGE_FRAME
+						&& type != SONG_END_FRAME) {
+					// Most likely "Server is full", which isn't framed.
+					if (conn.phase == STARTING) {
+						results.rejected++;
+					}
+					else {
+						results.protocol_errors++;
+					}
+					close_connection(index);
+					return;
+				}
+				conn.payload_left = 0;
+				for (size_t i = 1; i < FRAME_HEADER_SIZE; i++) {
+					conn.payload_left = (conn.payload_left << 8) | conn.header[i];
+				}
+			}
+			else {
+				size_t n = std::min(left, conn.payload_left);
+				handle_frame_data(index, conn.header[0], n);
+				conn.payload_left -= n;
+				data += n;
+				left -= n;
+			}
+
+			if (conn.payload_left == 0) {
+				conn.header_got = 0;
+				handle_frame_end(index, conn.header[0]);
+			}
+		}
+	}
+}
+
+/**
+ * Is called with each piece of a frame's payload as it arrives.
+ *
+ * @param index The connection.
+ * @param type The frame's type.
+ * @param length How much of the payload just arrived.
+ */
+void BenchLoop::handle_frame_data(size_t index, uint8_t type, size_t length) {
+	Connection &conn = conns[index];
+	if (type != AUDIO_FRAME || length == 0) {
+		return;
+	}
+	if (conn.first_byte_us == 0) {
+		conn.first_byte_us = monotonic_us();
+		if (conn.phase == WAITING) {
+			results.ttfb_ms.push_back(
+					(conn.first_byte_us - conn.op_start_us) / 1000.0);
+		}
+	}
+	conn.stream_bytes += length;
+}
+
+/**
+ * Is called once a whole frame has arrived.
+ *
+ * @param index The connection.
+ * @param type The frame's type.
+ */
+void BenchLoop::handle_frame_end(size_t index, uint8_t type) {
+	Connection &conn = conns[index];
+	if (conn.phase == STARTING) {
+		if (type == MESSAGE_FRAME) {
+			// "Session started"
+			finish_op(index);
+		}
+		return;
+	}
+	if (conn.phase != WAITING) {
+		return;
+	}
+
+	uint64_t now = monotonic_us();
+	if (conn.op == PLAY_OP || conn.op == STOP_OP) {
+		if (type == SONG_END_FRAME && conn.refused) {
+			// Ends the song the server wouldn't play.
+			finish_op(index);
+		}
+		else if (type == SONG_END_FRAME) {
+			// Timed from the command, since a song that fits in the socket
+			// buffers can arrive all at once.
+			uint64_t stream_us = now - conn.op_start_us;
+			if (conn.first_byte_us != 0 && stream_us > 0) {
+				results.stream_rates.push_back(conn.stream_bytes * 1e6 / stream_us);
+			}
+			results.ops[conn.op]++;
+			finish_op(index);
+		}
+		else if (type == MESSAGE_FRAME) {
+			// Something went wrong, e.g. the server has no songs. A
+			// SONG_END still follows.
+			results.error_replies++;
+			conn.refused = true;
+		}
+	}
+	else if (type == MESSAGE_FRAME) {
+		double elapsed_ms = (now - conn.op_start_us) / 1000.0;
+		if (conn.op == LIST_OP) {
+			results.list_ms.push_back(elapsed_ms);
+		}
+		else {
+			results.info_ms.push_back(elapsed_ms);
+		}
+		results.ops[conn.op]++;
+		finish_op(index);
+	}
+}
+
+/**
+ * Picks a command, going by the mix, and sends it.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::start_op(size_t index) {
+	Connection &conn = conns[index];
+	if (monotonic_us() >= this->end_us) {
+		return;
+	}
+
+	std::discrete_distribution<int> pick(config.weights,
+			config.weights + NUM_OPS);
+	conn.op = (OpKind)pick(rng);
+	conn.phase = WAITING;
+	conn.op_start_us = monotonic_us();
+	conn.first_byte_us = 0;
+	conn.stream_bytes = 0;
+	conn.stop_sent = false;
+	conn.refused = false;
+
+	// The server wraps play's song number around, but not info's.
+	int song = config.num_songs > 0
+		? std::uniform_int_distribution<int>(0, config.num_songs - 1)(rng) : 0;
+	switch (conn.op) {
+	case PLAY_OP:
+		send_command(index, "play " + std::to_string(song));
+		break;
+	case STOP_OP:
+		send_command(index, "play " + std::to_string(song));
+		set_timer(index, conn.op_start_us + config.stop_seconds * 1e6);
+		break;
+	case LIST_OP:
+		send_command(index, "list");
+		break;
+	default:
+		send_command(index, "info " + std::to_string(song));
+		break;
+	}
+}
+
+/**
+ * Is called when a command has finished, and has the connection think for
+ * a bit before the next one.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::finish_op(size_t index) {
+	Connection &conn = conns[index];
+	conn.phase = THINKING;
+	if (config.think_ms == 0) {
+		start_op(index);
+	}
+	else {
+		set_timer(index, monotonic_us() + config.think_ms * 1000);
+	}
+}
+
+/**
+ * Sends a command, holding on to whatever the socket can't take yet.
+ *
+ * @param index The connection.
+ * @param command The text of the command.
+ */
+void BenchLoop::send_command(size_t index, const string &command) {
+	conns[index].outbuf += utf_frame(command);
+	flush(index);
+}
+
+/**
+ * Sends as much of a connection's outbuf as the socket will take.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::flush(size_t index) {
+	Connection &conn = conns[index];
+	while (!conn.outbuf.empty()) {
+		ssize_t n = send(conn.fd, conn.outbuf.data(), conn.outbuf.size(),
+				MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			results.disconnects++;
+			close_connection(index);
+			return;
+		}
+		conn.outbuf.erase(0, n);
+	}
+	watch(index, !conn.outbuf.empty());
+}
+
+/**
+ * Updates which events epoll watches for on a connection.
+ *
+ * @param index The connection.
+ * @param want_out Whether to watch for room in the socket buffer.
+ */
+void BenchLoop::watch(size_t index, bool want_out) {
+	Connection &conn = conns[index];
+	uint32_t events = EPOLLIN | EPOLLRDHUP | (want_out ? (uint32_t)EPOLLOUT : 0);
+	if (events == conn.watched_events) {
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = index;
+	if (epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	conn.watched_events = events;
+}
+
+/**
+ * Sets the connection's timer, replacing any other.
+ *
+ * @param index The connection.
+ * @param when_us Monotonic time for it to go off.
+ */
+void BenchLoop::set_timer(size_t index, uint64_t when_us) {
+	Connection &conn = conns[index];
+	conn.timer_token++;
+	timers.push(BenchTimer{when_us, index, conn.timer_token});
+}
+
+/**
+ * Hangs up a connection. It isn't reopened.
+ *
+ * @param index The connection.
+ */
+void BenchLoop::close_connection(size_t index) {
+	Connection &conn = conns[index];
+	close(conn.fd); // also takes it out of the epoll
+	conn.fd = -1;
+	conn.phase = CLOSED;
+	conn.outbuf.clear();
+}
+
+/**
+ * Summarises a set of measurements as a JSON object.
+ *
+ * @param values The measurements (sorted in place).
+ * @param precision Digits to show after the decimal point.
+ * @return The JSON object.
+ */
+string summary_json(vector<double> &values, int precision) {
+	std::ostringstream out;
+	out.setf(std::ios::fixed);
+	out.precision(precision);
+	out << "{\"count\": " << values.size();
+	if (!values.empty()) {
+		std::sort(values.begin(), values.end());
+		auto percentile = [&values](double p) {
+			return values[std::min(values.size() - 1,
+					(size_t)(p * values.size()))];
+		};
+		double sum = 0;
+		for (double value : values) {
+			sum += value;
+		}
+		out << ", \"min\": " << values.front()
+			<< ", \"mean\": " << sum / values.size()
+			<< ", \"p50\": " << percentile(0.50)
+			<< ", \"p90\": " << percentile(0.90)
+			<< ", \"p99\": " << percentile(0.99)
+			<< ", \"max\": " << values.back();
+	}
+	out << "}";
+	return out.str();
+}
+
+int main(int argc, char **argv) {
+	BenchConfig config;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:m:s:t:w:")) != -1) {
+		switch (opt) {
+		case 'c':
+			config.connections = std::max(1ul, std::stoul(optarg));
+			break;
+		case 'd':
+			config.duration_seconds = std::stod(optarg);
+			break;
+		case 'm':
+			parse_mix(optarg, config);
+			break;
+		case 's':
+			config.stop_seconds = std::stod(optarg);
+			break;
+		case 't':
+			config.threads = std::max(1ul, std::stoul(optarg));
+			break;
+		case 'w':
+			config.think_ms = std::stoul(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+	}
+	config.threads = std::min(config.threads, config.connections);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *found;
+	int status = getaddrinfo(argv[optind], argv[optind + 1], &hints, &found);
+	if (status != 0) {
+		cerr << "ERROR: " << argv[optind] << ": " << gai_strerror(status) << "\n";
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&config.addr, found->ai_addr, found->ai_addrlen);
+	config.addr_len = found->ai_addrlen;
+	freeaddrinfo(found);
+
+	// Thousands of connections need thousands of descriptors.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	config.num_songs = count_songs(config);
+	if (config.num_songs < 0) {
+		cerr << "ERROR: couldn't get the song list from the server\n";
+		exit(EXIT_FAILURE);
+	}
+
+	// Each thread gets an even share of the connections.
+	uint64_t start_us = monotonic_us();
+	uint64_t end_us = start_us + config.duration_seconds * 1e6;
+	vector<BenchResults> thread_results(config.threads);
+	vector<std::thread> threads;
+	for (unsigned i = 0; i < config.threads; i++) {
+		unsigned share = config.connections / config.threads
+			+ (i < config.connections % config.threads ? 1 : 0);
+		threads.emplace_back([&config, &thread_results, i, share, end_us]() {
+			BenchLoop loop(config, share, i + 1);
+			thread_results[i] = loop.run(end_us);
+		});
+	}
+	BenchResults results;
+	for (unsigned i = 0; i < config.threads; i++) {
+		threads[i].join();
+		results.merge(thread_results[i]);
+	}
+	double elapsed = (monotonic_us() - start_us) / 1e6;
+
+	cout.setf(std::ios::fixed);
+	cout.precision(1);
+	cout << "{\n";
+	cout << "  \"connections\": " << config.connections << ",\n";
+	cout << "  \"threads\": " << config.threads << ",\n";
+	cout << "  \"duration_s\": " << elapsed << ",\n";
+	cout << "  \"songs\": " << config.num_songs << ",\n";
+	cout << "  \"mix\": {";
+	for (int i = 0; i < NUM_OPS; i++) {
+		cout << (i > 0 ? ", " : "") << "\"" << OP_NAMES[i] << "\": "
+			<< config.weights[i];
+	}
+	cout << "},\n";
+	cout << "  \"connected\": " << results.connected << ",\n";
+	cout << "  \"connect_failures\": " << results.connect_failures << ",\n";
+	cout << "  \"rejected\": " << results.rejected << ",\n";
+	cout << "  \"disconnects\": " << results.disconnects << ",\n";
+	cout << "  \"protocol_errors\": " << results.protocol_errors << ",\n";
+	cout << "  \"error_replies\": " << results.error_replies << ",\n";
+	cout << "  \"completed\": {";
+	for (int i = 0; i < NUM_OPS; i++) {
+		cout << (i > 0 ? ", " : "") << "\"" << OP_NAMES[i] << "\": "
+			<< results.ops[i];
+	}
+	cout << "},\n";
+	cout << "  \"bytes_received\": " << results.bytes_received << ",\n";
+	cout << "  \"egress_bytes_per_s\": " << results.bytes_received / elapsed
+		<< ",\n";
+	cout << "  \"ttfb_ms\": " << summary_json(results.ttfb_ms, 3) << ",\n";
+	cout << "  \"list_ms\": " << summary_json(results.list_ms, 3) << ",\n";
+	cout << "  \"info_ms\": " << summary_json(results.info_ms, 3) << ",\n";
+	cout << "  \"stream_bytes_per_s\": "
+		<< summary_json(results.stream_rates, 1) << "\n";
+	cout << "}\n";
+}
@@ -14,9 +14,17 @@
 #include <map>
 #include <vector>
 #include <filesystem>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <atomic>
+#include <future>
 
 // C standard libraries
 #include <cerrno>
+#include <csignal>
 #include <string.h>
 
 // POSIX and OS-specific libraries
@@ -24,17 +32,30 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
 
 
+#include "Catalog.h"
 #include "ChunkedDataSender.h"
+#include "ClientSlab.h"
 #include "ConnectedClient.h"
+#include "Handover.h"
+#include "IoPool.h"
+#include "IoUring.h"
+#include "Library.h"
+#include "RadioChannel.h"
+#include "SendScheduler.h"
+#include "SongCache.h"
+#include "Stats.h"
+#include "TimerWheel.h"
 
 namespace fs = std::filesystem;
 using std::ifstream;
@@ -45,39 +66,245 @@ using std::string;
 using std::vector;
 using std::map;
 
-const int BACKLOG = 10;
+// Connections can come in bursts, and we take them all in one go anyway.
+const int BACKLOG = SOMAXCONN;
 const int MAX_EVENTS = 64;
+// How long the music directory has to be left alone before we reload it
+const int RELOAD_DELAY_MS = 500;
+// Number of threads reading directories while finding songs, and tags and
+// .info files while indexing them for search
+const unsigned SCAN_THREADS = 8;
+// How long to wait before accepting again on an io_uring when accepting
+// failed (e.g. we're out of file descriptors)
+const uint64_t ACCEPT_RETRY_MS = 10;
+
+// What a client is told when it's turned away because we're full
+const char SERVER_FULL_MESSAGE[] = "Server is full, try again later";
+
+// Most clients to serve at once over all the event loops (-m), or 0 for as
+// many as we have file descriptors for.
+unsigned max_clients = 0;
+std::atomic<unsigned> num_clients(0);
+
+// Whether the event loops use io_uring rather than epoll (-U)
+bool use_io_uring = false;
 
 // forward declarations
-int accept_connection(int server_socket);
+int accept_connection(int server_socket, int &spare_fd);
+bool admit_client(int client_fd);
 int setup_server_socket(uint16_t port_num);
 void set_non_blocking(int sock);
-vector<fs::path> find_mp3_files(const char *dir);
-void event_loop(int epoll_fd, int server_socket, vector<fs::path> song_list);
+void watch_music_dir(string dir, string index_path,
+		std::promise<void> scanned);
+void index_song_text(std::shared_ptr<const Catalog> catalog);
+int setup_epoll(int server_socket);
+void event_loop(int epoll_fd, int server_socket, int handover_fd,
+		vector<HandedOverClient> handed_over);
+void ring_event_loop(int server_socket, int handover_fd,
+		vector<HandedOverClient> handed_over);
+void usage(const char *prog_name);
+
+/**
+ * Prints how to run the server then exits.
+ *
+ * @param prog_name Name the program was run with (i.e. argv[0]).
+ */
+void usage(const char *prog_name) {
+	cerr << "Usage: " << prog_name << " [-a admin_path] [-b sndbuf_kb]"
+		<< " [-c cache_mb] [-e]"
+		<< " [-I idle_seconds] [-i io_threads] [-m max_clients]"
+		<< " [-p lead_seconds] [-r channels] [-t threads] [-U]"
+		<< " [-u socket_path] [-W stall_seconds] [-x index_path] <port>"
+		<< " <filedir>\n";
+	cerr << "  -a admin_path    answer connections on this Unix socket with the"
+		<< " server's stats\n";
+	cerr << "  -b sndbuf_kb     send buffer size for each client's socket"
+		<< " (default: tuned by the kernel)\n";
+	cerr << "  -c cache_mb      most megabytes of songs to keep memory-mapped"
+		<< " (default 256)\n";
+	cerr << "  -e               use edge-triggered epoll\n";
+	cerr << "  -I idle_seconds  hang up on clients that send nothing for this"
+		<< " long, 0 for never (default 300)\n";
+	cerr << "  -i io_threads    number of threads doing file I/O (default 2)\n";
+	cerr << "  -m max_clients   most clients to serve at once (default: no"
+		<< " limit)\n";
+	cerr << "  -p lead_seconds  send songs at playback speed, staying at most"
+		<< " this far ahead\n";
+	cerr << "  -r channels      number of radio channels to broadcast"
+		<< " (default 0)\n";
+	cerr << "  -t threads       number of event loops to run (default: one per"
+		<< " core)\n";
+	cerr << "  -U               use io_uring rather than epoll (if the kernel"
+		<< " can)\n";
+	cerr << "  -u socket_path   hot restart: take over from (and later hand"
+		<< " over to) other servers on this Unix socket\n";
+	cerr << "  -W stall_seconds hang up on clients that take none of a"
+		<< " response for this long, 0 for never (default 30)\n";
+	cerr << "  -x index_path    remember what's in each music directory in this"
+		<< " file, so a restart only reads the ones that changed\n";
+	exit(EXIT_FAILURE);
+}
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        cerr << "Usage: " << argv[0] << " <port> <filedir>\n";
-        exit(EXIT_FAILURE);
+	unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+	unsigned num_io_threads = 2;
+	int num_channels = 0;
+	string handover_path;
+	string admin_path;
+	string index_path;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "a:b:c:eI:i:m:p:r:t:Uu:W:x:")) != -1) {
+		switch (opt) {
+		case 'a':
+			admin_path = optarg;
+			break;
+		case 'b':
+			ConnectedClient::send_buffer_request = std::stoi(optarg) * 1024;
+			break;
+		case 'c':
+			SongCache::instance().set_budget(std::stoul(optarg) * 1024 * 1024);
+			break;
+		case 'e':
+			ConnectedClient::edge_triggered = true;
+			break;
+		case 'I':
+			ConnectedClient::idle_timeout_ms = std::stoul(optarg) * 1000;
+			break;
+		case 'i':
+			num_io_threads = std::max(1ul, std::stoul(optarg));
+			break;
+		case 'm':
+			max_clients = std::stoul(optarg);
+			break;
+		case 'p':
+			ConnectedClient::pacing_enabled = true;
+			ConnectedClient::pace_lead_seconds = std::stod(optarg);
+			break;
+		case 'r':
+			num_channels = std::max(0, std::stoi(optarg));
+			break;
+		case 't':
+			num_threads = std::max(1ul, std::stoul(optarg));
+			break;
+		case 'U':
+			use_io_uring = true;
+			break;
+		case 'u':
+			handover_path = optarg;
+			break;
+		case 'W':
+			ConnectedClient::stall_timeout_ms = std::stoul(optarg) * 1000;
+			break;
+		case 'x':
+			index_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+    if (argc - optind != 2) {
+		usage(argv[0]);
     }
+	const char *port_arg = argv[optind];
+	const char *dir_arg = argv[optind + 1];
 
-	if (!fs::is_directory(argv[2])) {
-		cerr << "ERROR: " << argv[2] << " is not a directory\n";
+	if (!fs::is_directory(dir_arg)) {
+		cerr << "ERROR: " << dir_arg << " is not a directory\n";
 		exit(EXIT_FAILURE);
 	}
 
     // Get the port number from the arguments.
-    uint16_t port = (uint16_t) std::stoul(argv[1]);
+    uint16_t port = (uint16_t) std::stoul(port_arg);
 
-	int serv_sock = setup_server_socket(port);
+	// A client hanging up mid-send shows up as EPIPE and an EPOLLHUP rather
+	// than killing the whole server.
+	signal(SIGPIPE, SIG_IGN);
 
-    /* 
-	 * Read the other argument (mp3 directory).
-	 * See the notes for this function above.
+	if (use_io_uring && !IoUring::supported()) {
+		cerr << "io_uring isn't available (it needs Linux 6.0 or later),"
+			<< " so using epoll instead.\n";
+		use_io_uring = false;
+	}
+
+	// Find the songs in the background. When taking over from another
+	// server, which carries on serving until then, wait for them first, so
+	// its clients don't find the catalog empty.
+	std::promise<void> scanned;
+	std::future<void> first_scan = scanned.get_future();
+	std::thread(watch_music_dir, string(dir_arg), index_path,
+			std::move(scanned)).detach();
+	if (!handover_path.empty()) {
+		first_scan.wait();
+	}
+
+	// Keep opening and reading songs off the event loops.
+	IoPool::instance().start(num_io_threads);
+
+	// Channel N starts broadcasting with song N, whether or not anyone is
+	// listening yet.
+	RadioChannel::start_channels(num_channels);
+
+	// Everything slow is done, so now's the time to take over the listening
+	// sockets and clients of the server we're replacing (if any). Its
+	// clients are shared out evenly over our loops.
+	vector<int> listeners;
+	vector<HandedOverClient> handed_over;
+	if (!handover_path.empty()
+			&& Handover::take_over(handover_path, listeners, handed_over)) {
+		cout << "Took over " << handed_over.size() << " clients.\n";
+		num_threads = std::max(num_threads, (unsigned)listeners.size());
+	}
+	vector<vector<HandedOverClient>> loop_clients(num_threads);
+	for (size_t i = 0; i < handed_over.size(); i++) {
+		loop_clients[i % num_threads].push_back(std::move(handed_over[i]));
+	}
+
+	/*
+	 * Each thread runs its own event loop with its own listening socket,
+	 * epoll and clients. SO_REUSEPORT has the kernel spread new connections
+	 * across the listeners, so the only thing the loops share is the
+	 * (read-only) catalog and the song cache.
 	 */
-    vector<fs::path> song_list = find_mp3_files(argv[2]);
-    cout << "Found " << song_list.size() << " songs.\n";
+	vector<std::thread> loops;
+	for (unsigned i = 0; i < num_threads; i++) {
+		int serv_sock = i < listeners.size() ? listeners[i]
+			: setup_server_socket(port);
+		int handover_fd = handover_path.empty() ? -1
+			: Handover::instance().add_loop();
+		if (use_io_uring) {
+			loops.emplace_back(ring_event_loop, serv_sock, handover_fd,
+					std::move(loop_clients[i]));
+		}
+		else {
+			int epoll_fd = setup_epoll(serv_sock);
+			loops.emplace_back(event_loop, epoll_fd, serv_sock, handover_fd,
+					std::move(loop_clients[i]));
+		}
+	}
 
+	if (!admin_path.empty()) {
+		ServerStats::instance().start_admin(admin_path);
+	}
+
+	// Be ready to hand all of that over in turn.
+	if (!handover_path.empty()) {
+		Handover::instance().start(handover_path);
+	}
+
+	for (std::thread &loop : loops) {
+		loop.join();
+	}
+}
+
+/**
+ * Creates an epoll that watches the server socket for new connections.
+ *
+ * @param server_socket Socket that is listening for connections.
+ * @return The file descriptor of the new epoll.
+ */
+int setup_epoll(int server_socket) {
 	// Create the epoll, which returns a file descriptor for us to use later.
 	int epoll_fd = epoll_create1(0);
 	if (epoll_fd < 0) {
@@ -89,15 +316,18 @@ int main(int argc, char **argv) {
 	// server socket.
 	struct epoll_event server_ev;
 	memset(&server_ev, 0, sizeof(server_ev));
-	server_ev.data.fd = serv_sock;
+	server_ev.data.fd = server_socket;
 	server_ev.events = EPOLLIN;
+	if (ConnectedClient::edge_triggered) {
+		server_ev.events |= EPOLLET;
+	}
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, serv_sock, &server_ev) == -1) {
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &server_ev) == -1) {
 		perror("epoll_ctl");
 		exit(EXIT_FAILURE);
 	}
-	
-	event_loop(epoll_fd, serv_sock, song_list);
+
+	return epoll_fd;
 }
 
 /**
@@ -112,7 +342,7 @@ int setup_server_socket(uint16_t port_num) {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
 
     /* Set SO_REUSEADDR so that we don't waste time in TIME_WAIT. */
-    int val = 0;
+    int val = 1;
 	val = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, 
 							&val, sizeof(val));
     if (val < 0) {
@@ -120,6 +350,15 @@ int setup_server_socket(uint16_t port_num) {
         exit(EXIT_FAILURE);
     }
 
+    /* Set SO_REUSEPORT so that every event loop can have its own listener. */
+    val = 1;
+	val = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+							&val, sizeof(val));
+    if (val < 0) {
+        perror("Setting socket option failed");
+        exit(EXIT_FAILURE);
+    }
+
     /* 
 	 * Set our server socket to non-blocking mode.  This way, if we
      * accidentally accept() when we shouldn't have, we won't block
@@ -148,22 +387,69 @@ int setup_server_socket(uint16_t port_num) {
 
 /**
  * Accepts a connection and returns the socket descriptor of the new client
- * that has connected to us.
+ * that has connected to us, already in non-blocking mode.
  *
  * @param server_socket Socket descriptor of the server (that is listening)
- * @return Socket descriptor for newly connected client.
+ * @param spare_fd A descriptor kept open so that, if we run out, we can
+ * 	free it up to accept a connection just to close it.
+ * @return Socket descriptor for newly connected client, or -1 if there are
+ * 	no more connections waiting (or we can't take any more right now).
  */
-int accept_connection(int server_socket) {
-	struct sockaddr_storage their_addr;
-	socklen_t addr_size = sizeof(their_addr);
-	int new_fd = accept(server_socket, (struct sockaddr *)&their_addr,
-						&addr_size);
-	if (new_fd < 0) {
-		perror("accept");
-		exit(EXIT_FAILURE);
-	}
+int accept_connection(int server_socket, int &spare_fd) {
+	while (true) {
+		struct sockaddr_storage their_addr;
+		socklen_t addr_size = sizeof(their_addr);
+		int new_fd = accept4(server_socket, (struct sockaddr *)&their_addr,
+							&addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_fd >= 0) {
+			return new_fd;
+		}
 
-	return new_fd;
+		switch (errno) {
+		case EAGAIN:
+			return -1;
+		case EMFILE:
+		case ENFILE:
+			// Out of file descriptors. Leaving the connection in the backlog
+			// would have epoll tell us about it again straight away, so use
+			// the spare to take it off and turn it away. (This error comes
+			// before the backlog is checked, so there may not be one.)
+			if (spare_fd < 0) {
+				return -1;
+			}
+			close(spare_fd);
+			new_fd = accept(server_socket, NULL, NULL);
+			if (new_fd >= 0) {
+				close(new_fd);
+			}
+			spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (new_fd < 0) {
+				return -1;
+			}
+			break;
+		case ENOBUFS:
+		case ENOMEM:
+			// Try again once the kernel has some memory to spare.
+			return -1;
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+		case ENETDOWN:
+		case ENETUNREACH:
+		case EHOSTDOWN:
+		case EHOSTUNREACH:
+		case ENONET:
+		case ENOPROTOOPT:
+		case EOPNOTSUPP:
+			// Interrupted, or something went wrong with this one
+			// connection (e.g. the client gave up before we got to it);
+			// try the next one.
+			break;
+		default:
+			perror("accept4");
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
 /*  
@@ -195,151 +481,460 @@ void set_non_blocking(int sock) {
 }
 
 
-/*
- * Given a path to a directory, this function searches the directory for any
- * files that end in ".mp3".
- * When it files an MP3 file, it also looks for an associated ".info" file, and
- * prints the contents of this file if it exists.
- *
- * @info You'll need to edit this to meet your needs (i.e. don't expect this
- * to do everything you want without any effort). I would recommend making it
- * return a vector (C++'s version of Java's ArrayList) containing the paths to
- * each of the mp3 files you find.
+/**
+ * Reads the tags and .info file of every song in a catalog, then gives it a
+ * search index that covers them, in place of the one it started with (which
+ * covers just file names). The .info files are kept as the catalog's replies
+ * to info along the way. Gives up if a newer catalog is published in the
+ * meantime. Runs in its own thread.
  *
- * @param dir String that represents the path to the directory that you want
- * 				to check.
+ * @param catalog The catalog to index.
+ */
+void index_song_text(std::shared_ptr<const Catalog> catalog) {
+	const vector<fs::path> &songs = catalog->song_list();
+	vector<SongText> texts(songs.size());
+	std::atomic<size_t> next_song(0);
+	std::atomic<bool> replaced(false);
+
+	auto read_texts = [&]() {
+		size_t i;
+		while (!replaced && (i = next_song++) < songs.size()) {
+			std::shared_ptr<const string> info = catalog->load_info(i);
+			texts[i] = SearchIndex::read_song_text(songs[i],
+					info ? *info : string());
+			if (i % 1024 == 0 && Catalog::current() != catalog) {
+				replaced = true;
+			}
+		}
+	};
+	vector<std::thread> readers;
+	for (unsigned i = 1; i < SCAN_THREADS; i++) {
+		readers.emplace_back(read_texts);
+	}
+	read_texts();
+	for (std::thread &reader : readers) {
+		reader.join();
+	}
+
+	if (!replaced) {
+		catalog->set_search_index(
+				std::make_shared<const SearchIndex>(songs, texts));
+	}
+}
+
+/**
+ * Finds the songs in the music directory (and below), publishes them as a
+ * new Catalog, then keeps doing so whenever songs are added, removed or
+ * changed. Runs in its own thread for the life of the server, so the event
+ * loops can take connections while the first scan is still going.
  *
- * @return Number of MP3 files found inside of the specified directory.
+ * @param dir Path to the music directory.
+ * @param index_path Where to keep the library's index between restarts, or
+ * 	empty for nowhere (see Library).
+ * @param scanned Set once the first scan has been published.
  */
- vector<fs::path> find_mp3_files(const char *dir) {
-	int num_mp3_files = 0;
-	vector<fs::path> list;
-	// Loop through all files in the directory
-	for(fs::directory_iterator entry(dir); entry != fs::directory_iterator(); ++entry) {
-		string filename = entry->path().filename().string();
-
-		// See if the current file is an MP3 file
-		if (entry->path().extension() == ".mp3") {
-			cout << "(" << num_mp3_files << ") " << filename << "\n";
-			num_mp3_files++;
-
-			//
-			list.push_back(entry->path());
-			// Look for an associated info file
-			fs::path info_file_path = entry->path();
-			info_file_path = info_file_path.replace_extension(".mp3.info");
-			if (fs::is_regular_file(info_file_path)) {
-				// read contents of file into a buffer
-				std::ifstream t(info_file_path.string());
-				std::stringstream buffer;
-				buffer << t.rdbuf();
-				cout << "Info:\n" << buffer.str() << "\n";
+void watch_music_dir(string dir, string index_path,
+		std::promise<void> scanned) {
+	Library library(dir, index_path, SCAN_THREADS);
+
+	// Watches are added after each scan, for every directory it found. A
+	// directory that already has one keeps it (with the same number).
+	int inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("inotify_init1");
+	}
+	map<int, fs::path> watched_dirs;
+	bool out_of_watches = false;
+	auto scan = [&]() {
+		uint64_t start_ms = monotonic_ms();
+		size_t num_read;
+		vector<fs::path> song_list = library.scan(num_read);
+		std::shared_ptr<const Catalog> catalog =
+			std::make_shared<const Catalog>(song_list);
+		Catalog::publish(catalog);
+		std::thread(index_song_text, catalog).detach();
+
+		for (const fs::path &path : library.directories()) {
+			if (inotify_fd < 0) {
+				break;
+			}
+			int wd = inotify_add_watch(inotify_fd, path.c_str(), IN_CREATE
+					| IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO
+					| IN_ONLYDIR);
+			if (wd >= 0) {
+				watched_dirs[wd] = path;
+			}
+			else if (!out_of_watches) {
+				// Most likely fs.inotify.max_user_watches; the songs are
+				// still served, we just won't see changes to them all.
+				perror("inotify_add_watch");
+				out_of_watches = true;
 			}
 		}
+
+		cout << "Found " << song_list.size() << " songs in "
+			<< monotonic_ms() - start_ms << " ms (read " << num_read
+			<< " directories).\n";
+	};
+
+	try {
+		scan();
+	}
+	catch (const fs::filesystem_error &err) {
+		cerr << "Could not scan songs: " << err.what() << "\n";
 	}
+	scanned.set_value();
+	if (inotify_fd < 0) {
+		return; // keep serving the songs we already found
+	}
+
+	alignas(struct inotify_event) char buf[4096];
+	while (true) {
+		// Wait for something to change, then keep reading until it has been
+		// quiet for a while, so copying in a whole album is one reload.
+		// Changes to anything but songs, their info and directories (e.g.
+		// the index file, if it's kept in here) don't count.
+		std::set<fs::path> changed;
+		bool dirs_changed = false;
+		struct pollfd watch_fd;
+		watch_fd.fd = inotify_fd;
+		watch_fd.events = POLLIN;
+		int timeout = -1;
+		while (poll(&watch_fd, 1, timeout) > 0) {
+			ssize_t len = read(inotify_fd, buf, sizeof(buf));
+			if (len < 0) {
+				perror("inotify read");
+				close(inotify_fd);
+				return;
+			}
 
-    return list;
+			for (char *p = buf; p < buf + len; ) {
+				struct inotify_event *event = (struct inotify_event *)p;
+				p += sizeof(struct inotify_event) + event->len;
+
+				if (event->mask & IN_IGNORED) {
+					// The directory is gone, and its watch with it.
+					watched_dirs.erase(event->wd);
+					continue;
+				}
+				auto watched = watched_dirs.find(event->wd);
+				if (event->len == 0 || watched == watched_dirs.end()) {
+					continue;
+				}
+				string name = event->name;
+				if (event->mask & IN_ISDIR) {
+					dirs_changed = true;
+				}
+				else if (fs::path(name).extension() == ".mp3"
+						|| fs::path(name).extension() == ".info") {
+					changed.insert(watched->second / name);
+				}
+			}
+			if (dirs_changed || !changed.empty()) {
+				timeout = RELOAD_DELAY_MS;
+			}
+		}
+
+		// Songs that changed on disk shouldn't be sent from the old mapping.
+		for (const fs::path &path : changed) {
+			SongCache::instance().forget(path);
+		}
+
+		try {
+			scan();
+		}
+		catch (const fs::filesystem_error &err) {
+			cerr << "Could not reload songs: " << err.what() << "\n";
+		}
+	}
 }
 
 /**
- * Accepts a new client then sets the server up to be ready to receive data
- * from that client.
- * After exiting, we'll have a new client set to RECEIVING mode, our socket to
- * that client will be non-blocking, and our epoll interest list will contain
- * this new client (watching for inputs or closes from the client).
- * This function is called from the event loop function
+ * Sets up a ConnectedClient for a socket, in RECEIVING mode, and adds it to
+ * our epoll interest list (watching for inputs or closes from the client).
  *
- * @param server_socket Socket listening for new connections.
- * @param clients Mapping between client sockets and client info
+ * @param client_fd The client's socket, in non-blocking mode.
+ * @param clients Slab of clients, indexed by their socket
  * @param epoll_fd File descriptor for epoll
+ * @param timers The event loop's timers
+ * @param scheduler The event loop's send scheduler
+ * @param completions Where the event loop gets its song loads
+ * @param stats The event loop's counters
+ * @param ring The event loop's io_uring, or NULL if it uses epoll
+ * @return The new client.
  */
-void setup_new_client(int server_socket, 
-						map<int, ConnectedClient> &clients, 
-						int epoll_fd) {
-	int client_fd = accept_connection(server_socket);
-	// cout << "Accepted a new connection!\n";
-
-	// The client_fd shouldn't exist in our clients map.
-	if (clients.find(client_fd) != clients.end()) {
+ConnectedClient &add_client(int client_fd, ClientSlab &clients, int epoll_fd,
+		TimerWheel &timers, SendScheduler &scheduler,
+		IoCompletions &completions, LoopStats *stats, IoUring *ring) {
+	// The client_fd shouldn't belong to an existing client.
+	if (clients.find_fd(client_fd) != NULL) {
 		cerr << "ERROR: File descriptor already mapped to an existing client.\n";
 		exit(EXIT_FAILURE);
 	}
 
-	// Set this to non-blocking mode so we never get hung up
-	// trying to send or receive from this client.
-	set_non_blocking(client_fd);
+	// We have a new client so we'll create a new ConnectClient object to
+	// represent this new client, in the slot for its fd.
+	ConnectedClient &client = clients.add(client_fd, &timers, &scheduler,
+			&completions, stats, ring);
+
+	if (ring != NULL) {
+		// Have whatever the client sends handed to us as it arrives.
+		ring->recv_multishot(client_fd, ring_key(RECV_OP, client.epoll_key()));
+		return client;
+	}
 
 	// Watch for "input" and "hangup" events for new clients.
 	struct epoll_event new_client_ev;
 	memset(&new_client_ev, 0, sizeof(new_client_ev));
-	new_client_ev.events = EPOLLIN | EPOLLRDHUP;
-	new_client_ev.data.fd = client_fd;
+	new_client_ev.events = client.watched_events;
+	new_client_ev.data.u64 = client.epoll_key();
 
 	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, 
 					&new_client_ev) == -1) {
 		perror("epoll_ctl: client_fd");
 		exit(EXIT_FAILURE);
 	}
+	return client;
+}
 
-	// We have a new client so we'll create a new ConnectClient object to
-	// represent this new client.
-	ConnectedClient cc(client_fd, RECEIVING);
-	// Add this new connected client to our map from file descriptor to client.
-	clients[client_fd] = cc;
-	// cout << "Finished setting up new client\n";
+/**
+ * Accepts every client waiting to connect, then sets the server up to be
+ * ready to receive data from each of them. If that would take us past
+ * max_clients, the client is told the server is full and hung up on.
+ * After exiting, we'll have a new client set to RECEIVING mode for each
+ * connection, our sockets to them will be non-blocking, and our epoll
+ * interest list will contain them (watching for inputs or closes from the
+ * clients). Taking the whole backlog at once means a burst of connections
+ * costs one trip through epoll rather than one per client.
+ * This function is called from the event loop function
+ *
+ * @param server_socket Socket listening for new connections.
+ * @param clients Slab of clients, indexed by their socket
+ * @param epoll_fd File descriptor for epoll
+ * @param timers The event loop's timers
+ * @param scheduler The event loop's send scheduler
+ * @param completions Where the event loop gets its song loads
+ * @param stats The event loop's counters
+ * @param spare_fd The event loop's spare descriptor (see accept_connection)
+ */
+void setup_new_clients(int server_socket, 
+						ClientSlab &clients, 
+						int epoll_fd, TimerWheel &timers,
+						SendScheduler &scheduler,
+						IoCompletions &completions, LoopStats *stats,
+						int &spare_fd) {
+	int client_fd;
+	while ((client_fd = accept_connection(server_socket, spare_fd)) >= 0) {
+		if (admit_client(client_fd)) {
+			add_client(client_fd, clients, epoll_fd, timers, scheduler,
+					completions, stats, NULL);
+		}
+	}
+}
+
+/**
+ * Counts a newly accepted client against max_clients. If that would take
+ * us past it, the client is told the server is full and hung up on.
+ *
+ * @param client_fd The new client's socket.
+ * @return true if we can take the client on.
+ */
+bool admit_client(int client_fd) {
+	if (max_clients > 0 && ++num_clients > max_clients) {
+		// The reply is short enough to fit in an empty socket buffer,
+		// so there's no need to wait around to send it.
+		num_clients--;
+		send(client_fd, SERVER_FULL_MESSAGE, strlen(SERVER_FULL_MESSAGE),
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(client_fd);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Hangs up on a client and forgets about it.
+ *
+ * @param client The client.
+ * @param clients Slab of clients, indexed by their socket
+ * @param epoll_fd File descriptor for epoll (-1 for an io_uring loop)
+ */
+void remove_client(ConnectedClient *client, ClientSlab &clients,
+		int epoll_fd) {
+	client->handle_close(epoll_fd);
+	clients.remove(client->client_fd);
+	if (max_clients > 0) {
+		num_clients--;
+	}
 }
 
 /**
- * Waits for epoll events then handles them accordingly.
+ * Gives the loop's listening socket and clients, just as they are, to the
+ * new server that's taking over (see Handover). Never returns.
+ *
+ * @param server_socket Socket that is listening for connections.
+ * @param clients Slab of clients, indexed by their socket
+ */
+[[noreturn]] void hand_over_loop(int server_socket, ClientSlab &clients) {
+	vector<HandedOverClient> loop_clients;
+	clients.for_each([&loop_clients](ConnectedClient &client) {
+		HandedOverClient handed;
+		handed.fd = client.client_fd;
+		handed.state = client.save_state();
+		loop_clients.push_back(std::move(handed));
+	});
+	Handover::instance().hand_over(server_socket, std::move(loop_clients));
+}
+
+/**
+ * Waits for epoll events then handles them accordingly. Every thread runs
+ * one of these, and nothing in it is shared with the other threads.
  *
  * @param epoll_fd File descriptor for our epoll.
  * @param server_socket Socket that is listening for connections.
+ * @param handover_fd Eventfd that says a new server is taking over (see
+ * 	Handover), or -1 if hot restarts are off.
+ * @param handed_over Clients to carry on with from the server we took over
+ * 	from.
  */
-void event_loop(int epoll_fd, int server_socket, vector<fs::path> song_list) {
+void event_loop(int epoll_fd, int server_socket, int handover_fd,
+		vector<HandedOverClient> handed_over) {
 	// associate client's file descriptor with its ConnectedClient object
-	map<int, ConnectedClient> clients;
+	ClientSlab clients;
+	TimerWheel timers;
+	vector<Timer> expired;
+	SendScheduler scheduler;
+	IoCompletions completions;
+	vector<std::shared_ptr<SongLoad>> loads;
+	LoopStats *stats = ServerStats::instance().add_loop();
+
+	// Held in reserve for when we run out of file descriptors
+	int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	// Watch for songs the IoPool has finished loading for our clients. The
+	// eventfd's key can't be mistaken for a client's, since those always
+	// have a generation of at least 1.
+	struct epoll_event completions_ev;
+	memset(&completions_ev, 0, sizeof(completions_ev));
+	completions_ev.data.u64 = (uint64_t)completions.fd();
+	completions_ev.events = EPOLLIN;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, completions.fd(),
+				&completions_ev) == -1) {
+		perror("epoll_ctl: completions");
+		exit(EXIT_FAILURE);
+	}
+
+	// Watch for a new server wanting to take over.
+	if (handover_fd >= 0) {
+		struct epoll_event handover_ev;
+		memset(&handover_ev, 0, sizeof(handover_ev));
+		handover_ev.data.u64 = (uint64_t)handover_fd;
+		handover_ev.events = EPOLLIN;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handover_fd, &handover_ev) == -1) {
+			perror("epoll_ctl: handover");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Carry on with the clients of the server we took over from.
+	for (HandedOverClient &handed : handed_over) {
+		if (max_clients > 0) {
+			num_clients++;
+		}
+		ConnectedClient &client = add_client(handed.fd, clients, epoll_fd,
+				timers, scheduler, completions, stats, NULL);
+		if (!client.restore_state(epoll_fd, handed.state)) {
+			cerr << "Couldn't restore a handed over client\n";
+			shutdown(handed.fd, SHUT_RDWR);
+		}
+	}
+	handed_over.clear();
 
     while (true) {
-		// wait for some events to occur, writing them to our events array
+		// wait for some events to occur, writing them to our events array,
+		// but don't sleep past the next timer, or at all if there are
+		// clients waiting for their turn to send
 		struct epoll_event events[MAX_EVENTS];
 
-		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		int timeout = scheduler.empty() ? timers.next_timeout(monotonic_ms()) : 0;
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
 		if (num_events < 0) {
+			if (errno == EINTR) continue;
 			perror("epoll_wait");
 			exit(EXIT_FAILURE);
 		}
+		uint64_t wakeup_us = monotonic_us();
+
+		// Let any clients whose timers went off get on with it
+		expired.clear();
+		timers.expire(monotonic_ms(), expired);
+		for (const Timer &t : expired) {
+			ConnectedClient *client = clients.find_fd(t.fd);
+			if (client != NULL) {
+				client->handle_timer(epoll_fd, t);
+			}
+		}
+
+		// Hold on to the current catalog while we handle this batch of
+		// events; if a reload publishes a new one, we'll see it next time.
+		std::shared_ptr<const Catalog> catalog = Catalog::current();
 
 		// Loop through all the I/O events that just happened.
 		for (int n = 0; n < num_events; n++) {
+			uint64_t key = events[n].data.u64;
+			if (key == (uint64_t)server_socket) {
+				/*
+				 * If the server socket is ready for "reading," that implies
+				 * we have a new client that wants to connect so lets
+				 * set up the new clients now.
+				 */
+				setup_new_clients(server_socket, clients, epoll_fd, timers,
+						scheduler, completions, stats, spare_fd);
+				continue;
+			}
+			else if (handover_fd >= 0 && key == (uint64_t)handover_fd) {
+				// A new server is taking over, so give it our listening
+				// socket and clients and stop here.
+				hand_over_loop(server_socket, clients);
+			}
+			else if (key == (uint64_t)completions.fd()) {
+				// Start sending the songs that are ready, to whichever of
+				// their clients are still around.
+				loads.clear();
+				completions.take(loads);
+				for (std::shared_ptr<SongLoad> &load : loads) {
+					ConnectedClient *client = clients.find(load->client_key);
+					if (client != NULL) {
+						client->handle_loaded(epoll_fd, load);
+					}
+				}
+				continue;
+			}
+
+			ConnectedClient *client = clients.find(key);
+			if (client == NULL) {
+				// The client this event was for was closed earlier on in
+				// this batch of events.
+				continue;
+			}
+
 			// Check if this is a "hang up" event (i.e. client closed the
 			// connection).
-			if ((events[n].events & EPOLLRDHUP) != 0) {
+			if ((events[n].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
 				// If we get here, the socket associated with this event was
 				// closed by the remote host so we should clean up.
-				clients[events[n].data.fd].handle_close(epoll_fd);
-				clients.erase(events[n].data.fd);
+				remove_client(client, clients, epoll_fd);
+				continue;
 			}
 
 			// Check if this is an "input" event (i.e. ready to "read" from
 			// this socket)
 			else if ((events[n].events & EPOLLIN) != 0) {
-				if (events[n].data.fd == server_socket) {
-					/*
-					 * If the server socket is ready for "reading," that implies
-					 * we have a new client that wants to connect so lets
-					 * set up that new client now.
-					 */
-					setup_new_client(server_socket, clients, epoll_fd);
-
-				}
-				else {
-					/*
-					 * This wasn't the server socket so this means we have a
-					 * client that has sent us data so we can receive it now
-					 * without worrying about blocking.
-					 */
-					clients[events[n].data.fd].handle_input(epoll_fd, song_list);
-				}
+				/*
+				 * This means we have a client that has sent us data so we
+				 * can receive it now without worrying about blocking.
+				 */
+				client->handle_input(epoll_fd, *catalog);
             }
 
 			// Check if this is an "output" event.
@@ -352,8 +947,228 @@ void event_loop(int epoll_fd, int server_socket, vector<fs::path> song_list) {
 				 * You'll therefore need to continue sending whatever response
 				 * you had in progress.
 				 */
-            	clients[events[n].data.fd].continue_response(epoll_fd);
+            	client->continue_response(epoll_fd);
 			}
         }
+
+		// Give everyone who still has more to send another turn.
+		scheduler.run_round(clients, epoll_fd);
+
+		stats->record_iteration(monotonic_us() - wakeup_us, num_events);
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Does the same job as event_loop, but hears about everything through an
+ * io_uring rather than epoll (-U). New connections come from a multishot
+ * accept and clients' commands from multishot recvs, so a trip around the
+ * loop takes one io_uring_enter no matter how many clients had something
+ * going on, instead of an epoll_wait plus an accept, recv or epoll_ctl for
+ * each of them. Sending is done the same way as with epoll, straight from
+ * the loop (the DRR turns and session frames need to know right away how
+ * much went out), so only a client that fills its socket buffer gets a
+ * request on the ring, to poll for room.
+ *
+ * @param server_socket Socket that is listening for connections.
+ * @param handover_fd Eventfd that says a new server is taking over (see
+ * 	Handover), or -1 if hot restarts are off.
+ * @param handed_over Clients to carry on with from the server we took over
+ * 	from.
+ */
+void ring_event_loop(int server_socket, int handover_fd,
+		vector<HandedOverClient> handed_over) {
+	ClientSlab clients;
+	TimerWheel timers;
+	vector<Timer> expired;
+	SendScheduler scheduler;
+	IoCompletions completions;
+	vector<std::shared_ptr<SongLoad>> loads;
+	LoopStats *stats = ServerStats::instance().add_loop();
+	IoUring ring;
+
+	// Held in reserve for when we run out of file descriptors
+	int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	// When to start accepting again after it failed, or 0 if it's going
+	uint64_t accept_retry_ms = 0;
+	// Set once a new server is taking over, after which nothing is started
+	// again on the ring
+	bool handing_over = false;
+
+	ring.accept_multishot(server_socket, ring_key(ACCEPT_OP, server_socket));
+	ring.poll(completions.fd(), POLLIN,
+			ring_key(COMPLETIONS_OP, completions.fd()), true);
+	if (handover_fd >= 0) {
+		ring.poll(handover_fd, POLLIN, ring_key(HANDOVER_OP, handover_fd),
+				false);
+	}
+
+	// Carry on with the clients of the server we took over from.
+	for (HandedOverClient &handed : handed_over) {
+		if (max_clients > 0) {
+			num_clients++;
+		}
+		ConnectedClient &client = add_client(handed.fd, clients, -1, timers,
+				scheduler, completions, stats, &ring);
+		if (!client.restore_state(-1, handed.state)) {
+			cerr << "Couldn't restore a handed over client\n";
+			shutdown(handed.fd, SHUT_RDWR);
+		}
+	}
+	handed_over.clear();
+
+	std::shared_ptr<const Catalog> catalog = Catalog::current();
+
+	// Handles one completion off the ring.
+	std::function<void(const struct io_uring_cqe &)> handle_completion =
+			[&](const struct io_uring_cqe &cqe) {
+		bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+		switch (ring_op(cqe.user_data)) {
+		case ACCEPT_OP:
+			if (cqe.res >= 0 && admit_client(cqe.res)) {
+				add_client(cqe.res, clients, -1, timers, scheduler,
+						completions, stats, &ring);
+			}
+			if (!more && !handing_over) {
+				// The accept stopped, most likely because we're out of
+				// file descriptors. Clear the backlog the old way, which
+				// knows what to do about that, and go again shortly.
+				int client_fd;
+				while ((client_fd = accept_connection(server_socket,
+								spare_fd)) >= 0) {
+					if (admit_client(client_fd)) {
+						add_client(client_fd, clients, -1, timers, scheduler,
+								completions, stats, &ring);
+					}
+				}
+				accept_retry_ms = monotonic_ms() + ACCEPT_RETRY_MS;
+			}
+			break;
+
+		case RECV_OP: {
+			ConnectedClient *client = clients.find(
+					ring_client_key(cqe.user_data));
+			if ((cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+				if (client != NULL && cqe.res > 0) {
+					client->handle_received(-1, *catalog, ring.buffer(cqe),
+							cqe.res);
+				}
+				ring.recycle(cqe);
+			}
+			if (client == NULL || more || cqe.res == -ECANCELED) {
+				break;
+			}
+			if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+				// We ran out of buffers for a moment; they've been handed
+				// back by now.
+				if (!handing_over) {
+					ring.recv_multishot(client->client_fd, cqe.user_data);
+				}
+			}
+			else {
+				// The client hung up (0), or the connection broke.
+				remove_client(client, clients, -1);
+			}
+			break;
+		}
+
+		case WRITABLE_OP: {
+			ConnectedClient *client = clients.find(
+					ring_client_key(cqe.user_data));
+			if (client == NULL) {
+				break;
+			}
+			client->watched_events &= ~EPOLLOUT;
+			// A hang up is dealt with when the recv sees it.
+			if (cqe.res > 0 && (cqe.res & (POLLHUP | POLLERR)) == 0
+					&& client->state == SENDING && !handing_over) {
+				client->continue_response(-1);
+			}
+			break;
+		}
+
+		case COMPLETIONS_OP:
+			if (cqe.res > 0) {
+				// Start sending the songs that are ready, to whichever of
+				// their clients are still around.
+				loads.clear();
+				completions.take(loads);
+				for (std::shared_ptr<SongLoad> &load : loads) {
+					ConnectedClient *client = clients.find(load->client_key);
+					if (client != NULL) {
+						client->handle_loaded(-1, load);
+					}
+				}
+			}
+			if (!more && !handing_over) {
+				ring.poll(completions.fd(), POLLIN, cqe.user_data, true);
+			}
+			break;
+
+		case HANDOVER_OP:
+			if (cqe.res <= 0 || handing_over) {
+				break;
+			}
+			// A new server is taking over. Stop everything on the ring, so
+			// the kernel doesn't go on accepting or reading on sockets that
+			// are about to be the new server's, and deal with whatever it
+			// already got (e.g. commands clients have sent, which go across
+			// in their inbuf). Then hand over and stop here.
+			handing_over = true;
+			ring.cancel_all();
+			struct io_uring_cqe left;
+			while (ring.next_completion(left)) {
+				handle_completion(left);
+			}
+			hand_over_loop(server_socket, clients);
+
+		default:
+			break; // a cancel finishing
+		}
+	};
+
+	while (true) {
+		// Wait for completions, but don't sleep past the next timer, or at
+		// all if there are clients waiting for their turn to send.
+		uint64_t now = monotonic_ms();
+		if (accept_retry_ms != 0 && now >= accept_retry_ms) {
+			accept_retry_ms = 0;
+			ring.accept_multishot(server_socket,
+					ring_key(ACCEPT_OP, server_socket));
+		}
+		int timeout = scheduler.empty() ? timers.next_timeout(now) : 0;
+		if (accept_retry_ms != 0 && (timeout < 0
+					|| (uint64_t)timeout > accept_retry_ms - now)) {
+			timeout = accept_retry_ms - now;
+		}
+		ring.enter(timeout);
+		uint64_t wakeup_us = monotonic_us();
+
+		// Let any clients whose timers went off get on with it
+		expired.clear();
+		timers.expire(monotonic_ms(), expired);
+		for (const Timer &t : expired) {
+			ConnectedClient *client = clients.find_fd(t.fd);
+			if (client != NULL) {
+				client->handle_timer(-1, t);
+			}
+		}
+
+		// Hold on to the current catalog while we handle this batch of
+		// completions; if a reload publishes a new one, we'll see it next
+		// time.
+		catalog = Catalog::current();
+
+		int num_events = 0;
+		struct io_uring_cqe cqe;
+		while (ring.next_completion(cqe)) {
+			num_events++;
+			handle_completion(cqe);
+		}
+
+		// Give everyone who still has more to send another turn.
+		scheduler.run_round(clients, -1);
+
+		stats->record_iteration(monotonic_us() - wakeup_us, num_events);
+	}
+}